@@ -0,0 +1,79 @@
+/* The libc side of the host build. Kept apart from the kernel sources
+ * because the kernel's inttypes.h clashes with the libc headers.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+// Same layout as MMapEntry in mmap.c
+typedef struct
+{
+	uint64_t base;
+	uint64_t length;
+	uint32_t type;
+	uint32_t ACPI;
+} E820Entry;
+
+#define E820_USABLE 1
+#define E820_RESERVED 2
+
+void host_arena_init(void)
+{
+	// Keep the output up to date if a test crashes
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	void* arena = mmap((void*)HOST_ARENA_BASE, HOST_ARENA_SIZE,
+			PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
+			-1, 0);
+	if (arena != (void*)HOST_ARENA_BASE)
+	{
+		perror("mmap arena");
+		exit(2);
+	}
+
+	// Out of order and overlapping on purpose, like real BIOSes
+	const E820Entry entries[] =
+	{
+		{ HOST_ARENA_BASE + (96UL << 20), 16UL << 20, E820_USABLE, 1 },
+		{ HOST_ARENA_BASE, 0x9F000, E820_USABLE, 1 },
+		{ HOST_ARENA_BASE + 0x9F000, 0x61000, E820_RESERVED, 1 },
+		{ HOST_ARENA_BASE + 0x100000, HOST_ARENA_SIZE - 0x100000, E820_USABLE, 1 },
+		{ HOST_HOLE_BASE, HOST_HOLE_SIZE, E820_RESERVED, 1 },
+	};
+
+	const uint32_t count = sizeof(entries) / sizeof(entries[0]);
+	*(uint32_t*)HOST_E820_COUNT_ADDRESS = count;
+	E820Entry* e820 = (E820Entry*)HOST_E820_ADDRESS;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		e820[i] = entries[i];
+	}
+}
+
+void host_putchar(char c)
+{
+	putchar(c);
+}
+
+void host_abort(void)
+{
+	fflush(stdout);
+	abort();
+}
+
+unsigned long host_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
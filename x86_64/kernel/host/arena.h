@@ -0,0 +1,40 @@
+#ifndef __X86_64_HOST_ARENA_H__
+#define __X86_64_HOST_ARENA_H__
+
+/* Simulated physical memory for the host build. Shared between the
+ * libc side (arena.c) and the kernel side, so it only uses plain C
+ * types.
+ *
+ * The arena is mapped at a fixed address so physical and virtual
+ * addresses are the same, like the kernel's identity mapping. It has to
+ * stay below 512GiB, the page table code only keeps 39 address bits.
+ */
+#define HOST_ARENA_BASE 0x100000000UL
+#define HOST_ARENA_SIZE (128UL << 20)
+
+// Where mmap_init() finds the fake E820 map, same offsets as the
+// bootloader uses in low memory
+#define HOST_E820_COUNT_ADDRESS (HOST_ARENA_BASE + 0x2D00)
+#define HOST_E820_ADDRESS (HOST_ARENA_BASE + 0x2D04)
+
+// The pretend kernel image, see __KERNEL_ALL_LO/HI in the makefile
+#define HOST_KERNEL_LO (HOST_ARENA_BASE + 0x100000)
+#define HOST_KERNEL_HI (HOST_ARENA_BASE + 0x300000)
+
+// A reserved region in the middle of usable memory, not 2MiB aligned
+#define HOST_HOLE_BASE (HOST_ARENA_BASE + 0x4100000)
+#define HOST_HOLE_SIZE 0x280000UL
+
+/* Map the arena and write the fake E820 map into it.
+ */
+void host_arena_init(void);
+
+void host_putchar(char c);
+
+void host_abort(void);
+
+/* Monotonic time in nanoseconds.
+ */
+unsigned long host_nsec(void);
+
+#endif
@@ -0,0 +1,570 @@
+/* Unit tests and benchmarks of the memory subsystem, run as a normal
+ * Linux program against the simulated physical memory in arena.c.
+ *
+ *   memtest        - Run the tests
+ *   memtest bench  - Run the tests, then the benchmarks
+ */
+#include "arena.h"
+
+#include "inttypes.h"
+#include "support.h"
+#include "kprintf.h"
+#include "memory/init.h"
+#include "memory/color.h"
+#include "memory/mmap.h"
+#include "memory/numa.h"
+#include "memory/slab.h"
+#include "memory/paging.h"
+#include "memory/defines.h"
+#include "memory/phys_alloc.h"
+
+// Defined in shim.c
+void host_paging_init(void);
+
+// Unused address the paging tests map at
+#define TEST_VIRT_BASE 0xFFFF800000000000ULL
+
+#define MAX_2MIB_FRAMES (HOST_ARENA_SIZE / _2_MIB)
+#define MAX_4KIB_FRAMES (HOST_ARENA_SIZE / _4_KIB)
+
+static void* frames[MAX_4KIB_FRAMES];
+static uint8_t seen[MAX_4KIB_FRAMES];
+
+static uint64_t failures = 0;
+static uint64_t checks = 0;
+
+#define CHECK(X) \
+	do { \
+		++checks; \
+		if (!(X)) \
+		{ \
+			kprintf("FAIL %s:%d: %s\n", __FILE__, (int64_t)__LINE__, #X); \
+			++failures; \
+		} \
+	} while (0)
+
+/* Mark a frame as handed out, false if it already was.
+ */
+static
+bool mark_seen(const void* frame, uint64_t size)
+{
+	const uint64_t index = ((uint64_t)frame - HOST_ARENA_BASE) / size;
+	if (seen[index])
+	{
+		return false;
+	}
+
+	seen[index] = 1;
+	return true;
+}
+
+static
+void clear_seen(void)
+{
+	for (uint64_t i = 0; i < MAX_4KIB_FRAMES; ++i)
+	{
+		seen[i] = 0;
+	}
+}
+
+/* Check that a whole range lies in one usable region and away from the
+ * reserved parts of the fake E820 map.
+ */
+static
+bool range_usable(uint64_t base, uint64_t length)
+{
+	const int32_t region = mmap_find(base);
+	if (region < 0 || mmap_find(base + length - 1) != region)
+	{
+		return false;
+	}
+
+	const uint64_t end = base + length;
+	return base >= mmap_boot_end() &&
+		(end <= HOST_HOLE_BASE || base >= HOST_HOLE_BASE + HOST_HOLE_SIZE);
+}
+
+/* Allocate 2MiB frames until the allocator runs out.
+ */
+static
+uint64_t drain_2MIB(void)
+{
+	uint64_t count = 0;
+	void* frame;
+	while ((frame = phys_alloc_2MIB()) != NULL)
+	{
+		ASSERT(count < MAX_2MIB_FRAMES);
+		frames[count++] = frame;
+	}
+	return count;
+}
+
+static
+void test_mmap(void)
+{
+	CHECK(mmap_length > 0);
+
+	for (int32_t i = 0; i < mmap_length; ++i)
+	{
+		const uint64_t base = mmap_array[i].base;
+		const uint64_t end = base + mmap_array[i].length;
+
+		CHECK(mmap_array[i].length > 0);
+		CHECK(base >= mmap_boot_end());
+		CHECK(end <= HOST_HOLE_BASE || base >= HOST_HOLE_BASE + HOST_HOLE_SIZE);
+		CHECK(mmap_find(base) == i);
+		CHECK(mmap_find(end - 1) == i);
+
+		// Sorted, merged and not touching
+		if (i + 1 < mmap_length)
+		{
+			CHECK(end < mmap_array[i+1].base);
+		}
+	}
+
+	CHECK(mmap_find(HOST_HOLE_BASE) == -1);
+	CHECK(mmap_find(HOST_HOLE_BASE + HOST_HOLE_SIZE - 1) == -1);
+	CHECK(mmap_find(HOST_KERNEL_LO) == -1);
+	CHECK(mmap_find(HOST_ARENA_BASE + HOST_ARENA_SIZE) == -1);
+
+	// The allocator owns the map, only never usable memory can be reserved
+	CHECK(mmap_reserve(HOST_HOLE_BASE, _4_KIB));
+	CHECK(!mmap_reserve(HOST_ARENA_BASE + HOST_ARENA_SIZE - _4_KIB, _4_KIB));
+}
+
+static
+void test_phys_alloc_2MIB(void)
+{
+	clear_seen();
+	const uint64_t count = drain_2MIB();
+	CHECK(count > 0);
+	CHECK(phys_alloc_2MIB() == NULL);
+
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		const uint64_t frame = (uint64_t)frames[i];
+		CHECK(MASK_2MIB(frame) == frame);
+		CHECK(range_usable(frame, _2_MIB));
+		CHECK(mark_seen(frames[i], _2_MIB));
+		*(uint64_t*)frame = i;
+	}
+
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		CHECK(*(uint64_t*)frames[i] == i);
+		phys_free_2MIB(frames[i]);
+	}
+
+	// Everything came back
+	CHECK(drain_2MIB() == count);
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		phys_free_2MIB(frames[i]);
+	}
+}
+
+static
+void test_phys_alloc_4KIB(void)
+{
+	const uint64_t frames_2MIB = drain_2MIB();
+	for (uint64_t i = 0; i < frames_2MIB; ++i)
+	{
+		phys_free_2MIB(frames[i]);
+	}
+
+	clear_seen();
+	uint64_t count = 0;
+	void* frame;
+	while ((frame = phys_alloc_4KIB()) != NULL)
+	{
+		ASSERT(count < MAX_4KIB_FRAMES);
+		frames[count++] = frame;
+	}
+
+	// Every 2MiB frame became a pool, with the first page as its header
+	CHECK(count == frames_2MIB * (_2_MIB / _4_KIB - 1));
+
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		const uint64_t page = (uint64_t)frames[i];
+		CHECK(MASK_4KIB(page) == page);
+		CHECK(MASK_2MIB(page) != page);
+		CHECK(range_usable(page, _4_KIB));
+		CHECK(mark_seen(frames[i], _4_KIB));
+	}
+
+	// Free in a different order than allocated
+	for (uint64_t i = 0; i < count; i += 2)
+	{
+		phys_free_4KIB(frames[i]);
+	}
+	for (uint64_t i = 1; i < count; i += 2)
+	{
+		phys_free_4KIB(frames[i]);
+	}
+
+	// Empty pools go back to the 2MiB lists
+	CHECK(drain_2MIB() == frames_2MIB);
+	for (uint64_t i = 0; i < frames_2MIB; ++i)
+	{
+		phys_free_2MIB(frames[i]);
+	}
+}
+
+static
+void test_color(void)
+{
+	color_set_enabled(true);
+	const uint32_t colors = color_count();
+	if (colors < 2)
+	{
+		kprintf("memtest: color tests skipped, %d colors\n", colors);
+		return;
+	}
+
+	const uint64_t frames_2MIB = drain_2MIB();
+	for (uint64_t i = 0; i < frames_2MIB; ++i)
+	{
+		phys_free_2MIB(frames[i]);
+	}
+
+	ColorSet set;
+	CHECK(color_reserve(&set, 1));
+	CHECK(set.colors == 1);
+
+	// Enough pages of one color to split several frames
+	clear_seen();
+	const uint64_t count = 3 * (_2_MIB / _4_KIB) / colors;
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		frames[i] = color_alloc_4KIB(&set);
+		CHECK(frames[i] != NULL);
+		CHECK(color_of((uint64_t)frames[i]) == 0);
+		CHECK(mark_seen(frames[i], _4_KIB));
+	}
+
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		color_free_4KIB(frames[i]);
+	}
+	color_release(&set);
+	color_set_enabled(false);
+
+	// Frames whose pages are all free went back to the 2MiB lists
+	CHECK(drain_2MIB() == frames_2MIB);
+	for (uint64_t i = 0; i < frames_2MIB; ++i)
+	{
+		phys_free_2MIB(frames[i]);
+	}
+}
+
+static
+void test_paging(void)
+{
+	uint64_t phys = 0;
+
+	// The identity map covers the whole arena with 2MiB pages
+	const uint64_t identity = HOST_ARENA_BASE + 5*_2_MIB + 0x1234;
+	CHECK(kvirt_to_phys(identity, &phys) && phys == identity);
+
+	// 4KiB mapping
+	const uint64_t page = (uint64_t)phys_alloc_4KIB_safe("test page");
+	CHECK(kmap_page(TEST_VIRT_BASE, page, PG_FLAG_RW, PAGE_4KIB));
+	CHECK(kvirt_to_phys(TEST_VIRT_BASE + 0x123, &phys) && phys == page + 0x123);
+	CHECK(!kvirt_to_phys(TEST_VIRT_BASE + _4_KIB, &phys));
+	CHECK(kunmap_page(TEST_VIRT_BASE, &phys) && phys == page);
+	CHECK(!kvirt_to_phys(TEST_VIRT_BASE, &phys));
+	phys_free_4KIB((void*)page);
+
+	// 2MiB mapping keeps the offset within the large page
+	const uint64_t large = (uint64_t)phys_alloc_2MIB_safe("test frame");
+	const uint64_t virt_large = TEST_VIRT_BASE + _1_GIB;
+	CHECK(kmap_page(virt_large, large, PG_FLAG_RW, PAGE_2MIB));
+	CHECK(kvirt_to_phys(virt_large + 0x12345, &phys) && phys == large + 0x12345);
+	CHECK(kunmap_page(virt_large, &phys) && phys == large);
+	phys_free_2MIB((void*)large);
+
+	// map_page_auto hands out zeroed pages, and unmap_page_auto frees
+	// them to the allocator of the right size
+	uint64_t* dirty = (uint64_t*) phys_alloc_4KIB_safe("dirty page");
+	for (uint64_t i = 0; i < _4_KIB / 8; ++i)
+	{
+		dirty[i] = ~0ULL;
+	}
+	phys_free_4KIB(dirty);
+
+	const PhysNodeStats* stats = phys_alloc_node_stats(numa_local_node());
+	const uint64_t frees_4KIB = stats->free_4KIB;
+	const uint64_t frees_2MIB = stats->free_2MIB;
+
+	kmap_page_auto(TEST_VIRT_BASE, PG_FLAG_RW, PAGE_4KIB);
+	CHECK(kvirt_to_phys(TEST_VIRT_BASE, &phys));
+	bool zeroed = true;
+	for (uint64_t i = 0; i < _4_KIB / 8; ++i)
+	{
+		zeroed = zeroed && ((uint64_t*)phys)[i] == 0;
+	}
+	CHECK(zeroed);
+
+	kunmap_page_auto(TEST_VIRT_BASE);
+	CHECK(stats->free_4KIB == frees_4KIB + 1);
+	CHECK(stats->free_2MIB == frees_2MIB);
+}
+
+static
+void test_slab(void)
+{
+	static const uint64_t sizes[] = { 1, 8, 16, 24, 100, 128, 500, 1024, 2000, 2048 };
+	void* blocks[sizeof(sizes) / sizeof(sizes[0])];
+
+	for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+	{
+		blocks[i] = kmalloc(sizes[i]);
+		CHECK(blocks[i] != NULL);
+		CHECK(((uint64_t)blocks[i] & 7) == 0);
+		if ((sizes[i] & (sizes[i] - 1)) == 0 && sizes[i] >= 8)
+		{
+			CHECK(((uint64_t)blocks[i] & (sizes[i] - 1)) == 0);
+		}
+
+		uint8_t* bytes = (uint8_t*)blocks[i];
+		for (uint64_t b = 0; b < sizes[i]; ++b)
+		{
+			bytes[b] = (uint8_t)i;
+		}
+	}
+
+	for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+	{
+		const uint8_t* bytes = (const uint8_t*)blocks[i];
+		CHECK(bytes[0] == i && bytes[sizes[i] - 1] == i);
+		kfree(blocks[i]);
+	}
+
+	CHECK(kmalloc(0) == NULL);
+	CHECK(kmalloc(KMALLOC_MAX_SIZE + 1) == NULL);
+}
+
+/* Print the cost per operation of a timed loop.
+ */
+static
+void report(const char* name, uint64_t ops, uint64_t cycles, uint64_t nsec)
+{
+	kprintf("bench: %s %d ops, %d cycles/op, %d ns/op, %d Kops/s\n", name, ops,
+			cycles / ops, nsec / ops, nsec > 0 ? (ops * 1000000) / nsec : 0);
+}
+
+static
+void bench_alloc(void)
+{
+	// 2MiB frames, alloc and free of the whole arena
+	uint64_t count = drain_2MIB();
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		phys_free_2MIB(frames[i]);
+	}
+
+	uint64_t cycles = _rdtsc();
+	uint64_t nsec = host_nsec();
+	count = drain_2MIB();
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		phys_free_2MIB(frames[i]);
+	}
+	report("phys_alloc_2MIB+free", count, _rdtsc() - cycles, host_nsec() - nsec);
+
+	// 4KiB frames, including splitting 2MiB frames into pools
+	cycles = _rdtsc();
+	nsec = host_nsec();
+	count = 0;
+	void* frame;
+	while ((frame = phys_alloc_4KIB()) != NULL)
+	{
+		frames[count++] = frame;
+	}
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		phys_free_4KIB(frames[i]);
+	}
+	report("phys_alloc_4KIB+free", count, _rdtsc() - cycles, host_nsec() - nsec);
+
+	// Steady state, pools already split
+	const uint64_t batch = 256;
+	const uint64_t rounds = 4096;
+	cycles = _rdtsc();
+	nsec = host_nsec();
+	for (uint64_t r = 0; r < rounds; ++r)
+	{
+		for (uint64_t i = 0; i < batch; ++i)
+		{
+			frames[i] = phys_alloc_4KIB();
+		}
+		for (uint64_t i = 0; i < batch; ++i)
+		{
+			phys_free_4KIB(frames[i]);
+		}
+	}
+	report("phys_alloc_4KIB+free batch", batch * rounds, _rdtsc() - cycles,
+			host_nsec() - nsec);
+
+	cycles = _rdtsc();
+	nsec = host_nsec();
+	for (uint64_t r = 0; r < rounds; ++r)
+	{
+		for (uint64_t i = 0; i < batch; ++i)
+		{
+			frames[i] = kmalloc(64);
+		}
+		for (uint64_t i = 0; i < batch; ++i)
+		{
+			kfree(frames[i]);
+		}
+	}
+	report("kmalloc(64)+kfree batch", batch * rounds, _rdtsc() - cycles,
+			host_nsec() - nsec);
+}
+
+/* Free a share of all 4KiB pages in a pseudo random pattern and count how
+ * many 2MiB frames the free memory can still provide.
+ */
+static
+void bench_fragmentation(void)
+{
+	static const uint32_t keep_percent[] = { 1, 10, 50, 90 };
+
+	for (uint32_t k = 0; k < sizeof(keep_percent) / sizeof(keep_percent[0]); ++k)
+	{
+		uint64_t count = 0;
+		void* frame;
+		while ((frame = phys_alloc_4KIB()) != NULL)
+		{
+			frames[count++] = frame;
+		}
+
+		// Keep a random subset allocated, free the rest
+		uint64_t seed = 12345;
+		uint64_t kept = 0;
+		for (uint64_t i = 0; i < count; ++i)
+		{
+			seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+			if ((seed >> 33) % 100 < keep_percent[k])
+			{
+				frames[kept++] = frames[i];
+			}
+			else
+			{
+				phys_free_4KIB(frames[i]);
+			}
+		}
+
+		const uint64_t free_bytes = (count - kept) * _4_KIB;
+
+		// How much of the free memory is still available as 2MiB frames
+		uint64_t large = 0;
+		void* large_frames[MAX_2MIB_FRAMES];
+		while ((frame = phys_alloc_2MIB()) != NULL)
+		{
+			large_frames[large++] = frame;
+		}
+
+		kprintf("bench: fragmentation %d%% kept: %dMiB free, %dMiB as 2MiB frames\n",
+				(int64_t)keep_percent[k], free_bytes / _1_MIB, large * 2);
+
+		for (uint64_t i = 0; i < large; ++i)
+		{
+			phys_free_2MIB(large_frames[i]);
+		}
+		for (uint64_t i = 0; i < kept; ++i)
+		{
+			phys_free_4KIB(frames[i]);
+		}
+	}
+}
+
+/* Time virt_to_phys() through 4KiB mappings and through the 2MiB
+ * identity map, in a pseudo random order.
+ */
+static
+void bench_page_walk(void)
+{
+	const uint64_t pages = 4096;
+	const uint64_t lookups = 1 << 20;
+	const uint64_t backing = HOST_ARENA_BASE + 8*_2_MIB;
+
+	uint64_t cycles = _rdtsc();
+	uint64_t nsec = host_nsec();
+	for (uint64_t i = 0; i < pages; ++i)
+	{
+		kmap_page(TEST_VIRT_BASE + i*_4_KIB, backing + i*_4_KIB, PG_FLAG_RW, PAGE_4KIB);
+	}
+	report("map_page 4KiB", pages, _rdtsc() - cycles, host_nsec() - nsec);
+
+	uint64_t seed = 1;
+	uint64_t sum = 0;
+	uint64_t phys;
+	cycles = _rdtsc();
+	nsec = host_nsec();
+	for (uint64_t i = 0; i < lookups; ++i)
+	{
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		kvirt_to_phys(TEST_VIRT_BASE + ((seed >> 33) % pages) * _4_KIB, &phys);
+		sum += phys;
+	}
+	report("virt_to_phys 4KiB", lookups, _rdtsc() - cycles, host_nsec() - nsec);
+
+	cycles = _rdtsc();
+	nsec = host_nsec();
+	for (uint64_t i = 0; i < lookups; ++i)
+	{
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		kvirt_to_phys(HOST_ARENA_BASE + (seed >> 33) % HOST_ARENA_SIZE, &phys);
+		sum += phys;
+	}
+	report("virt_to_phys 2MiB", lookups, _rdtsc() - cycles, host_nsec() - nsec);
+	__asm__ volatile("" :: "r"(sum));
+
+	cycles = _rdtsc();
+	nsec = host_nsec();
+	for (uint64_t i = 0; i < pages; ++i)
+	{
+		kunmap_page(TEST_VIRT_BASE + i*_4_KIB, &phys);
+	}
+	report("unmap_page 4KiB", pages, _rdtsc() - cycles, host_nsec() - nsec);
+}
+
+static
+bool is_bench(const char* arg)
+{
+	const char* expected = "bench";
+	while (*arg && *arg == *expected)
+	{
+		++arg;
+		++expected;
+	}
+	return *arg == *expected;
+}
+
+int main(int argc, char** argv)
+{
+	host_arena_init();
+	host_paging_init();
+	memory_init();
+
+	test_mmap();
+	test_phys_alloc_2MIB();
+	test_phys_alloc_4KIB();
+	test_color();
+	test_paging();
+	test_slab();
+
+	kprintf("memtest: %d checks, %d failures\n", checks, failures);
+
+	if (failures == 0 && argc > 1 && is_bench(argv[1]))
+	{
+		bench_alloc();
+		bench_fragmentation();
+		bench_page_walk();
+	}
+
+	return failures == 0 ? 0 : 1;
+}
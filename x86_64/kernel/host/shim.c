@@ -0,0 +1,53 @@
+/* Stand-ins for the parts of the kernel the memory code links against
+ * that only make sense on real hardware.
+ */
+#include "arena.h"
+
+#include "inttypes.h"
+#include "safety.h"
+#include "serial.h"
+#include "textmode.h"
+#include "kprintf.h"
+#include "acpi/acpi.h"
+#include "memory/types.h"
+#include "memory/defines.h"
+
+// The boot page tables, built by prekernel.s in the kernel
+PML4_Table kernel_PML4 __attribute__((aligned(4096)));
+PDP_Table kernel_PDPTE __attribute__((aligned(4096)));
+PD_Table kernel_PDT __attribute__((aligned(4096)));
+
+/* Identity map the first 1GiB with 2MiB pages, like prekernel.s.
+ */
+void host_paging_init(void)
+{
+	kernel_PML4.entries[0] = (uint64_t)&kernel_PDPTE | PML4_WRITABLE | PML4_PRESENT;
+	kernel_PDPTE.entries[0] = (uint64_t)&kernel_PDT | PDPT_WRITABLE | PDPT_PRESENT;
+	for (uint64_t i = 0; i < PDT_ENTRIES; ++i)
+	{
+		kernel_PDT.entries[i] = i*_2_MIB | PDT_PAGE_SIZE | PDT_WRITABLE | PDT_PRESENT;
+	}
+}
+
+void text_mode_char(char c)
+{
+	host_putchar(c);
+}
+
+void serial_char(char c)
+{
+	UNUSED(c);
+}
+
+void panic_(const char* message)
+{
+	kprintf("%s - PANIC\n", message);
+	host_abort();
+}
+
+// No firmware tables, numa_init() falls back to a single node
+const ACPITableHeader* acpi_find_table(uint32_t sig)
+{
+	UNUSED(sig);
+	return NULL;
+}
@@ -0,0 +1,153 @@
+#include "acpi.h"
+
+#include "memory/defines.h"
+#include "memory/paging.h"
+#include "log.h"
+
+static const RSDPStruct* rsdp = NULL;
+static const ACPITableHeader* root_table = NULL;
+static bool use_xsdt = false;
+
+/* Sum all of the bytes in a region, a valid ACPI structure sums to zero.
+ */
+static
+uint8_t checksum(const void* ptr, uint64_t length)
+{
+	const uint8_t* p = (const uint8_t*)ptr;
+	uint8_t sum = 0;
+	for (uint64_t i = 0; i < length; ++i)
+	{
+		sum += p[i];
+	}
+
+	return sum;
+}
+
+/* Check that a physical range is covered by the kernel's identity map.
+ * Tables are read in place, so anything outside the map would fault.
+ */
+static
+bool is_mapped(uint64_t address, uint64_t length)
+{
+	uint64_t dummy;
+	return kvirt_to_phys(address, &dummy)
+		&& kvirt_to_phys(address + length - 1, &dummy);
+}
+
+/* Scan a region for the RSDP signature. The RSDP is always on a 16-byte
+ * boundary so only one 64-bit compare is needed per paragraph.
+ */
+static
+const RSDPStruct* scan_rsdp(uint64_t start, uint64_t length)
+{
+	for (uint64_t addr = start; addr < start + length; addr += 16)
+	{
+		const RSDPStruct* r = (const RSDPStruct*)addr;
+		if (r->signature == RSDP_SIG && checksum(r, 20) == 0)
+		{
+			return r;
+		}
+	}
+
+	return NULL;
+}
+
+bool acpi_init()
+{
+	if (root_table != NULL)
+	{
+		return true;
+	}
+
+	// Same two locations as the MP floating pointer. The first KiB of
+	// the EBDA and then the BIOS read-only area.
+	const uint64_t ebda = (uint64_t)(*(volatile uint16_t*)0x40E) << 4;
+	if (ebda != 0)
+	{
+		rsdp = scan_rsdp(ebda, _1_KIB);
+	}
+
+	if (rsdp == NULL)
+	{
+		rsdp = scan_rsdp(0xE0000, 0x20000);
+	}
+
+	if (rsdp == NULL)
+	{
+		return false;
+	}
+
+	if (rsdp->revision >= 2 && rsdp->xsdt_address != 0 &&
+			checksum(rsdp, rsdp->length) == 0)
+	{
+		root_table = (const ACPITableHeader*)rsdp->xsdt_address;
+		use_xsdt = true;
+	}
+	else
+	{
+		root_table = (const ACPITableHeader*)(uint64_t)rsdp->rsdt_address;
+		use_xsdt = false;
+	}
+
+	if (!is_mapped((uint64_t)root_table, sizeof(ACPITableHeader)) ||
+			!is_mapped((uint64_t)root_table, root_table->length) ||
+			checksum(root_table, root_table->length) != 0)
+	{
+		log_warn(ACPI, "ACPI: Bad root table at 0x%x\n", root_table);
+		root_table = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+const ACPITableHeader* acpi_find_table(uint32_t signature)
+{
+	if (!acpi_init())
+	{
+		return NULL;
+	}
+
+	// The root table is followed by an array of 32-bit (RSDT) or
+	// 64-bit (XSDT) physical table pointers.
+	const uint64_t entry_size = use_xsdt ? 8 : 4;
+	const uint64_t entries = (root_table->length - sizeof(ACPITableHeader)) / entry_size;
+	const uint8_t* base = (const uint8_t*)(root_table + 1);
+
+	for (uint64_t i = 0; i < entries; ++i)
+	{
+		uint64_t address;
+		if (use_xsdt)
+		{
+			// XSDT entries are not guaranteed to be 8-byte aligned
+			const uint32_t* p = (const uint32_t*)(base + i*entry_size);
+			address = ((uint64_t)p[1] << 32) | p[0];
+		}
+		else
+		{
+			address = ((const uint32_t*)base)[i];
+		}
+
+		if (!is_mapped(address, sizeof(ACPITableHeader)))
+		{
+			continue;
+		}
+
+		const ACPITableHeader* table = (const ACPITableHeader*)address;
+		if (table->signature != signature)
+		{
+			continue;
+		}
+
+		if (!is_mapped(address, table->length) ||
+				checksum(table, table->length) != 0)
+		{
+			log_warn(ACPI, "ACPI: Bad table %l4s at 0x%x\n", &table->signature, address);
+			continue;
+		}
+
+		return table;
+	}
+
+	return NULL;
+}
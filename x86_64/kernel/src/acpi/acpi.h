@@ -0,0 +1,217 @@
+#ifndef __X86_64_ACPI_ACPI_H__
+#define __X86_64_ACPI_ACPI_H__
+
+#include "safety.h"
+#include "inttypes.h"
+
+// Root System Description Pointer. Found by scanning the EBDA and
+// BIOS read-only memory on 16-byte boundaries. Revision 2 and later
+// add the extended fields for the XSDT.
+//
+// Section 5.2.5 of the ACPI specification
+typedef struct
+{
+	uint64_t signature; // Contains the string "RSD PTR "
+	uint8_t checksum;
+	char oem_id[6];
+	uint8_t revision;
+	uint32_t rsdt_address;
+	// Revision 2+
+	uint32_t length;
+	uint64_t xsdt_address;
+	uint8_t ext_checksum;
+	uint8_t reserved[3];
+} __attribute__((packed)) RSDPStruct;
+
+COMPILE_ASSERT(sizeof(RSDPStruct) == 36);
+
+// Every ACPI table (except the RSDP) starts with this header
+typedef struct
+{
+	uint32_t signature;
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__((packed)) ACPITableHeader;
+
+COMPILE_ASSERT(sizeof(ACPITableHeader) == 36);
+
+#define RSDP_SIG 0x2052545020445352ULL // The string "RSD PTR "
+#define RSDT_SIG 0x54445352 // The string "RSDT"
+#define XSDT_SIG 0x54445358 // The string "XSDT"
+#define SRAT_SIG 0x54415253 // The string "SRAT"
+#define SLIT_SIG 0x54494C53 // The string "SLIT"
+#define MADT_SIG 0x43495041 // The string "APIC"
+
+// System Resource Affinity Table
+//
+// Section 5.2.16 of the ACPI specification
+typedef struct
+{
+	ACPITableHeader header;
+	uint32_t reserved1; // Must be 1
+	uint64_t reserved2;
+} __attribute__((packed)) SRATHeader;
+
+COMPILE_ASSERT(sizeof(SRATHeader) == 48);
+
+#define SRAT_LAPIC_TYPE  0
+#define SRAT_MEMORY_TYPE 1
+#define SRAT_X2APIC_TYPE 2
+
+#define SRAT_ENABLED 0x1
+
+typedef struct
+{
+	uint8_t type;
+	uint8_t length;
+	uint8_t proximity_lo;
+	uint8_t apic_id;
+	uint32_t flags;
+	uint8_t sapic_eid;
+	uint8_t proximity_hi[3];
+	uint32_t clock_domain;
+} __attribute__((packed)) SRATLapicEntry;
+
+COMPILE_ASSERT(sizeof(SRATLapicEntry) == 16);
+
+typedef struct
+{
+	uint8_t type;
+	uint8_t length;
+	uint32_t proximity;
+	uint16_t reserved1;
+	uint32_t base_lo;
+	uint32_t base_hi;
+	uint32_t length_lo;
+	uint32_t length_hi;
+	uint32_t reserved2;
+	uint32_t flags;
+	uint64_t reserved3;
+} __attribute__((packed)) SRATMemoryEntry;
+
+COMPILE_ASSERT(sizeof(SRATMemoryEntry) == 40);
+
+typedef struct
+{
+	uint8_t type;
+	uint8_t length;
+	uint16_t reserved1;
+	uint32_t proximity;
+	uint32_t x2apic_id;
+	uint32_t flags;
+	uint32_t clock_domain;
+	uint32_t reserved2;
+} __attribute__((packed)) SRATX2apicEntry;
+
+COMPILE_ASSERT(sizeof(SRATX2apicEntry) == 24);
+
+// System Locality Information Table. Followed by a locality_count by
+// locality_count matrix of one byte relative distances. The distance
+// from a domain to itself is always 10.
+//
+// Section 5.2.17 of the ACPI specification
+typedef struct
+{
+	ACPITableHeader header;
+	uint64_t locality_count;
+} __attribute__((packed)) SLITHeader;
+
+COMPILE_ASSERT(sizeof(SLITHeader) == 44);
+
+// Multiple APIC Description Table. Followed by variable length
+// entries, each starting with a type and length byte.
+//
+// Section 5.2.12 of the ACPI specification
+typedef struct
+{
+	ACPITableHeader header;
+	uint32_t lapic_address;
+	uint32_t flags;
+} __attribute__((packed)) MADTHeader;
+
+COMPILE_ASSERT(sizeof(MADTHeader) == 44);
+
+#define MADT_LAPIC_TYPE    0
+#define MADT_IOAPIC_TYPE   1
+#define MADT_OVERRIDE_TYPE 2
+#define MADT_X2APIC_TYPE   9
+
+#define MADT_ENABLED        0x1
+#define MADT_ONLINE_CAPABLE 0x2
+
+typedef struct
+{
+	uint8_t type;
+	uint8_t length;
+	uint8_t processor_uid;
+	uint8_t apic_id;
+	uint32_t flags;
+} __attribute__((packed)) MADTLapicEntry;
+
+COMPILE_ASSERT(sizeof(MADTLapicEntry) == 8);
+
+typedef struct
+{
+	uint8_t type;
+	uint8_t length;
+	uint8_t id;
+	uint8_t reserved;
+	uint32_t address;
+	uint32_t gsi_base;
+} __attribute__((packed)) MADTIOAPICEntry;
+
+COMPILE_ASSERT(sizeof(MADTIOAPICEntry) == 12);
+
+// The flags use the same encoding as the MP table's I/O interrupt
+// assignment entries
+typedef struct
+{
+	uint8_t type;
+	uint8_t length;
+	uint8_t bus;        // Always 0, ISA
+	uint8_t source;     // ISA IRQ
+	uint32_t gsi;
+	uint16_t flags;
+} __attribute__((packed)) MADTOverrideEntry;
+
+COMPILE_ASSERT(sizeof(MADTOverrideEntry) == 10);
+
+typedef struct
+{
+	uint8_t type;
+	uint8_t length;
+	uint16_t reserved;
+	uint32_t x2apic_id;
+	uint32_t flags;
+	uint32_t processor_uid;
+} __attribute__((packed)) MADTX2apicEntry;
+
+COMPILE_ASSERT(sizeof(MADTX2apicEntry) == 16);
+
+/* Find the RSDP and remember where the RSDT/XSDT is. Safe to call
+ * more than once, later calls do nothing.
+ *
+ * Returns:
+ *   True if a valid RSDP was found, false otherwise.
+ */
+bool acpi_init(void);
+
+/* Find an ACPI table by signature. The table's checksum is verified,
+ * and tables that are not identity mapped are skipped.
+ *
+ * Params:
+ *   signature - The four character signature, for example SRAT_SIG
+ *
+ * Returns:
+ *   A pointer to the table header, or NULL if the table does not
+ *   exist or could not be validated.
+ */
+const ACPITableHeader* acpi_find_table(uint32_t signature);
+
+#endif
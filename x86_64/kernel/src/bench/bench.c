@@ -0,0 +1,119 @@
+#include "bench.h"
+
+#ifdef BENCH_KERNEL
+
+#include "cpuid.h"
+#include "support.h"
+#include "kprintf.h"
+#include "memory/phys_alloc.h"
+
+// Port of QEMU's isa-debug-exit device, see the x64_bench make target
+#define QEMU_EXIT_PORT 0xF4
+
+#define CPUID_80000001_EDX_RDTSCP (1 << 27)
+
+// Placed by the linker around the .bench section
+extern const Bench start_of_bench[];
+extern const Bench end_of_bench[];
+
+COMPILE_ASSERT(BENCH_SAMPLES * sizeof(uint64_t) <= 4096);
+
+bool bench_have_rdtscp = false;
+
+// Cycles of an empty bench_tsc_start()/bench_tsc_stop() pair
+static uint64_t timer_overhead = 0;
+
+static
+void sort_samples(uint64_t* samples, uint32_t count)
+{
+	for (uint32_t i = 1; i < count; ++i)
+	{
+		const uint64_t value = samples[i];
+		int32_t j = i - 1;
+		while (j >= 0 && samples[j] > value)
+		{
+			samples[j+1] = samples[j];
+			--j;
+		}
+		samples[j+1] = value;
+	}
+}
+
+static
+void calibrate(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid_count(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+	if (eax >= 0x80000001)
+	{
+		cpuid_count(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+		bench_have_rdtscp = (edx & CPUID_80000001_EDX_RDTSCP) != 0;
+	}
+
+	timer_overhead = (uint64_t)-1;
+	for (uint32_t i = 0; i < BENCH_SAMPLES; ++i)
+	{
+		const uint64_t start = bench_tsc_start();
+		const uint64_t cycles = bench_tsc_stop() - start;
+		if (cycles < timer_overhead)
+		{
+			timer_overhead = cycles;
+		}
+	}
+}
+
+/* Time one call of a benchmark, without the timer overhead and the
+ * paused cycles.
+ */
+static
+uint64_t run_sample(const Bench* bench)
+{
+	BenchState state;
+	state.iterations = bench->iterations;
+	state.paused_at = 0;
+	state.paused_cycles = 0;
+
+	const uint64_t start = bench_tsc_start();
+	bench->fn(&state);
+	uint64_t cycles = bench_tsc_stop() - start - state.paused_cycles;
+
+	cycles = cycles > timer_overhead ? cycles - timer_overhead : 0;
+	return cycles / bench->iterations;
+}
+
+void bench_run_all()
+{
+	calibrate();
+
+	kprintf("bench: start, timer overhead %d cycles, rdtscp %d\n",
+			timer_overhead, bench_have_rdtscp);
+
+	uint64_t* samples = (uint64_t*) phys_alloc_4KIB_safe("bench samples");
+
+	for (const Bench* bench = start_of_bench; bench < end_of_bench; ++bench)
+	{
+		for (uint32_t i = 0; i < BENCH_WARMUP; ++i)
+		{
+			run_sample(bench);
+		}
+
+		for (uint32_t i = 0; i < BENCH_SAMPLES; ++i)
+		{
+			samples[i] = run_sample(bench);
+		}
+
+		sort_samples(samples, BENCH_SAMPLES);
+		kprintf("bench: %s min %d median %d p99 %d cycles/op\n", bench->name,
+				samples[0], samples[BENCH_SAMPLES / 2],
+				samples[(BENCH_SAMPLES * 99) / 100]);
+	}
+
+	phys_free_4KIB(samples);
+	kprintf("bench: done\n");
+}
+
+void bench_exit_qemu(uint8_t code)
+{
+	_outb(QEMU_EXIT_PORT, code);
+}
+#endif
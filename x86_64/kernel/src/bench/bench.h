@@ -0,0 +1,117 @@
+#ifndef __X86_64_BENCH_BENCH_H__
+#define __X86_64_BENCH_BENCH_H__
+
+#include "inttypes.h"
+
+/* In-kernel microbenchmarks. Only built into the BENCH_KERNEL image.
+ *
+ * A benchmark is a function registered with BENCH(). The harness calls
+ * it BENCH_WARMUP times to warm caches and TLBs, then BENCH_SAMPLES
+ * times while timing every call. Each call runs the operation
+ * 'iterations' times, a sample is the cycles of one call divided by the
+ * iterations. The min, median and 99th percentile of the samples are
+ * printed over serial, one line per benchmark:
+ *
+ *   bench: <name> min <n> median <n> p99 <n> cycles/op
+ *
+ * Work that should not be timed, like freeing what a sample allocated,
+ * goes between bench_pause() and bench_resume().
+ */
+
+#define BENCH_WARMUP 16
+#define BENCH_SAMPLES 256
+
+typedef struct
+{
+	uint64_t iterations;
+
+	// Used by bench_pause()/bench_resume()
+	uint64_t paused_at;
+	uint64_t paused_cycles;
+} BenchState;
+
+typedef struct
+{
+	const char* name;
+	void (*fn)(BenchState* state);
+	uint64_t iterations;
+} Bench;
+
+/* Register a benchmark. The body runs the operation
+ * state->iterations times.
+ *
+ *   BENCH(my_bench, 64)
+ *   {
+ *       for (uint64_t i = 0; i < state->iterations; ++i) { ... }
+ *   }
+ *
+ * Params:
+ *   NAME       - Name of the benchmark, a valid identifier
+ *   ITERATIONS - Operations per sample
+ */
+#define BENCH(NAME, ITERATIONS) \
+	static void bench_fn_##NAME(BenchState* state); \
+	static const Bench bench_##NAME \
+		__attribute__((section(".bench"), used, aligned(8))) = \
+		{ #NAME, bench_fn_##NAME, (ITERATIONS) }; \
+	static void bench_fn_##NAME(BenchState* state)
+
+extern bool bench_have_rdtscp;
+
+/* Read the TSC after every earlier instruction has completed. CPUID
+ * serializes, so nothing before it leaks into the timed region.
+ */
+static inline __attribute__((always_inline))
+uint64_t bench_tsc_start(void)
+{
+	uint32_t lo, hi;
+	__asm__ volatile("cpuid\n\trdtsc"
+			: "=a"(lo), "=d"(hi) : "a"(0) : "rbx", "rcx", "memory");
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* Read the TSC once every timed instruction has completed. RDTSCP
+ * waits for earlier instructions, the LFENCE keeps later ones from
+ * starting before the read.
+ */
+static inline __attribute__((always_inline))
+uint64_t bench_tsc_stop(void)
+{
+	uint32_t lo, hi;
+	if (bench_have_rdtscp)
+	{
+		__asm__ volatile("rdtscp\n\tlfence"
+				: "=a"(lo), "=d"(hi) :: "rcx", "memory");
+	}
+	else
+	{
+		__asm__ volatile("lfence\n\trdtsc\n\tlfence"
+				: "=a"(lo), "=d"(hi) :: "memory");
+	}
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* Stop the clock for untimed work inside a benchmark body.
+ */
+static inline
+void bench_pause(BenchState* state)
+{
+	state->paused_at = bench_tsc_stop();
+}
+
+static inline
+void bench_resume(BenchState* state)
+{
+	state->paused_cycles += bench_tsc_start() - state->paused_at;
+}
+
+/* Run every registered benchmark and print the results.
+ */
+void bench_run_all(void);
+
+/* Exit QEMU through the isa-debug-exit device. Does nothing on real
+ * hardware or when the device is missing.
+ */
+void bench_exit_qemu(uint8_t code);
+
+#endif
@@ -0,0 +1,651 @@
+/* Benchmarks of the core kernel primitives.
+ */
+#include "bench.h"
+
+#ifdef BENCH_KERNEL
+
+#include "klib.h"
+#include "kprintf.h"
+#include "memory/defines.h"
+#include "memory/paging.h"
+#include "memory/phys_alloc.h"
+#include "interrupts/apic.h"
+#include "interrupts/defines.h"
+#include "smp/smp.h"
+#include "sync/spinlock.h"
+#include "thread/thread.h"
+#include "timer/timer.h"
+#include "trace/trace.h"
+
+// Unused kernel half address the map_page benchmark maps at
+#define BENCH_VIRT_BASE 0xFFFF800000000000ULL
+
+// Software interrupt vectors for the round trip benchmarks, through
+// the full and the fast stub
+#define BENCH_VECTOR 0x40
+#define BENCH_FAST_VECTOR 0x41
+
+// Vector the IPI benchmark sends to its own CPU
+#define BENCH_IPI_VECTOR 0x42
+
+// Kernel half address in a PML4 slot the kernel does not use, mapped
+// only in the address space of the TLB benchmarks
+#define BENCH_TLB_VIRT_BASE 0xFFFFC00000000000ULL
+#define BENCH_TLB_PML4_INDEX ((BENCH_TLB_VIRT_BASE >> 39) & 0x1FF)
+
+#define MAX_BATCH 256
+
+// Timers the timer wheel benchmarks keep armed at once
+#define BENCH_TIMERS 100000
+#define BENCH_TIMERS_PER_FRAME (_2_MIB / sizeof(Timer))
+#define BENCH_TIMER_FRAMES ((BENCH_TIMERS + BENCH_TIMERS_PER_FRAME - 1) / BENCH_TIMERS_PER_FRAME)
+
+static void* batch[MAX_BATCH];
+
+BENCH(map_page_4KIB, 64)
+{
+	static uint64_t frame = 0;
+	if (frame == 0)
+	{
+		frame = (uint64_t)phys_alloc_4KIB_safe("map_page bench");
+	}
+
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		kmap_page(BENCH_VIRT_BASE + i*_4_KIB, frame, PG_FLAG_RW, PAGE_4KIB);
+	}
+
+	bench_pause(state);
+	uint64_t phys;
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		kunmap_page(BENCH_VIRT_BASE + i*_4_KIB, &phys);
+	}
+	bench_resume(state);
+}
+
+BENCH(virt_to_phys, 256)
+{
+	uint64_t phys;
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		kvirt_to_phys(i*_2_MIB, &phys);
+	}
+}
+
+BENCH(phys_alloc_4KIB, MAX_BATCH)
+{
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		batch[i] = phys_alloc_4KIB();
+	}
+
+	bench_pause(state);
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		phys_free_4KIB(batch[i]);
+	}
+	bench_resume(state);
+}
+
+BENCH(phys_alloc_2MIB, 32)
+{
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		batch[i] = phys_alloc_2MIB();
+	}
+
+	bench_pause(state);
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		phys_free_2MIB(batch[i]);
+	}
+	bench_resume(state);
+}
+
+BENCH(memcpy_4KIB, 64)
+{
+	static uint8_t* buffer = NULL;
+	if (buffer == NULL)
+	{
+		buffer = (uint8_t*) phys_alloc_2MIB_safe("memcpy bench");
+	}
+
+	// Copy the first half into the second, one page per iteration
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		const uint64_t offset = (i % (_1_MIB / _4_KIB)) * _4_KIB;
+		memcpy(buffer + _1_MIB + offset, buffer + offset, _4_KIB);
+	}
+}
+
+static
+void bench_isr(uint64_t vector, uint64_t code)
+{
+	UNUSED(vector);
+	UNUSED(code);
+}
+
+BENCH(interrupt_round_trip, 64)
+{
+	interrupts_install_isr(BENCH_VECTOR, bench_isr);
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		__asm__ volatile("int %0" :: "i"(BENCH_VECTOR) : "memory");
+	}
+}
+
+static
+void bench_fast_isr(uint64_t vector)
+{
+	UNUSED(vector);
+}
+
+BENCH(interrupt_round_trip_fast, 64)
+{
+	interrupts_install_fast_isr(BENCH_FAST_VECTOR, bench_fast_isr);
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		__asm__ volatile("int %0" :: "i"(BENCH_FAST_VECTOR) : "memory");
+	}
+}
+
+static volatile uint64_t ipis_received = 0;
+
+static
+void bench_ipi_isr(uint64_t vector)
+{
+	UNUSED(vector);
+	++ipis_received;
+	apic_eoi();
+}
+
+/* EOI with nothing in service, the LAPIC ignores it. Measures the MSR
+ * write in x2APIC mode against the uncached store in xAPIC mode.
+ */
+BENCH(apic_eoi, 64)
+{
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		apic_eoi();
+	}
+}
+
+BENCH(apic_self_ipi, 64)
+{
+	interrupts_install_fast_isr(BENCH_IPI_VECTOR, bench_ipi_isr);
+	const uint32_t self = apic_id();
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		const uint64_t seen = ipis_received;
+		apic_send_ipi(self, BENCH_IPI_VECTOR);
+		while (ipis_received == seen)
+		{
+			__asm__ volatile("pause");
+		}
+	}
+}
+
+static Timer bench_timers[MAX_BATCH];
+
+static
+void bench_timer_callback(Timer* timer)
+{
+	*(volatile bool*)timer->data = true;
+}
+
+/* Arm timers far in the future and cancel them again, the cost of
+ * keeping the pending timers ordered.
+ */
+BENCH(timer_arm_cancel, MAX_BATCH)
+{
+	const uint64_t base = now() + 1000000000ULL;
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		// Spread the deadlines so the inserts do not all hit one end
+		timer_arm(&bench_timers[i], base + ((i * 7919) % MAX_BATCH) * 1000,
+				bench_timer_callback, NULL);
+	}
+
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		timer_cancel(&bench_timers[i]);
+	}
+}
+
+/* Arm a timer that is already due and wait for its interrupt.
+ */
+BENCH(timer_fire, 16)
+{
+	static volatile bool fired;
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		fired = false;
+		timer_arm(&bench_timers[0], now(), bench_timer_callback, (void*)&fired);
+		while (!fired)
+		{
+			__asm__ volatile("pause");
+		}
+	}
+}
+
+static Timer* many_timer_frames[BENCH_TIMER_FRAMES];
+
+static
+Timer* many_timer(uint64_t i)
+{
+	return &many_timer_frames[i / BENCH_TIMERS_PER_FRAME][i % BENCH_TIMERS_PER_FRAME];
+}
+
+/* Arm all BENCH_TIMERS timers, spread pseudo randomly from 'first' over
+ * 'spread' nanoseconds.
+ */
+static
+void arm_many(uint64_t first, uint64_t spread, TimerCallback callback)
+{
+	if (many_timer_frames[0] == NULL)
+	{
+		for (uint32_t f = 0; f < BENCH_TIMER_FRAMES; ++f)
+		{
+			many_timer_frames[f] = (Timer*) phys_alloc_2MIB_safe("timer bench");
+			memclr(many_timer_frames[f], _2_MIB);
+		}
+	}
+
+	for (uint64_t i = 0; i < BENCH_TIMERS; ++i)
+	{
+		timer_arm(many_timer(i), first + (i * 2654435761ULL) % spread, callback, NULL);
+	}
+}
+
+static
+void cancel_many(void)
+{
+	for (uint64_t i = 0; i < BENCH_TIMERS; ++i)
+	{
+		timer_cancel(many_timer(i));
+	}
+}
+
+BENCH(timer_arm_100k, BENCH_TIMERS)
+{
+	// Seconds to hours ahead, over all levels of the wheel
+	arm_many(now() + 1000000000ULL, 10000000000000ULL, bench_timer_callback);
+
+	bench_pause(state);
+	cancel_many();
+	bench_resume(state);
+}
+
+BENCH(timer_cancel_100k, BENCH_TIMERS)
+{
+	bench_pause(state);
+	arm_many(now() + 1000000000ULL, 10000000000000ULL, bench_timer_callback);
+	bench_resume(state);
+
+	cancel_many();
+}
+
+static volatile uint64_t expired = 0;
+static uint64_t lateness_sum = 0;
+static uint64_t lateness_max = 0;
+static uint64_t expiry_runs = 0;
+
+static
+void bench_lateness_callback(Timer* timer)
+{
+	const uint64_t lateness = now() - timer->deadline;
+	lateness_sum += lateness;
+	if (lateness > lateness_max)
+	{
+		lateness_max = lateness;
+	}
+	++expired;
+}
+
+/* All timers expire within 2ms, hundreds per wheel tick. The cycles are
+ * mostly waiting, the cost of expiring shows in the interrupt stats of
+ * the timer vector. How late the callbacks run is printed once all
+ * samples are done.
+ */
+BENCH(timer_expiry_100k, BENCH_TIMERS)
+{
+	UNUSED(state);
+
+	expired = 0;
+	arm_many(now() + 10000000ULL, 2000000ULL, bench_lateness_callback);
+	while (expired < BENCH_TIMERS)
+	{
+		__asm__ volatile("pause");
+	}
+
+	if (++expiry_runs == BENCH_WARMUP + BENCH_SAMPLES)
+	{
+		kprintf("bench: timer_expiry_100k lateness avg %d max %d ns\n",
+				lateness_sum / (expiry_runs * BENCH_TIMERS), lateness_max);
+	}
+}
+
+static volatile bool workers_stop = false;
+static volatile uint32_t workers_running = 0;
+
+/* Run a worker on CPUs 1 .. cpus-1 until stop_workers(). Returns once
+ * all of them have started.
+ */
+static
+void start_workers(void (*worker)(void), uint32_t cpus)
+{
+	if (cpus > cpu_count())
+	{
+		cpus = cpu_count();
+	}
+
+	workers_stop = false;
+	workers_running = 0;
+	for (uint32_t i = 1; i < cpus; ++i)
+	{
+		smp_call(i, worker);
+	}
+
+	while (workers_running < cpus - 1)
+	{
+		__asm__ volatile("pause");
+	}
+}
+
+static
+void stop_workers(void)
+{
+	workers_stop = true;
+	for (uint32_t i = 1; i < cpu_count(); ++i)
+	{
+		smp_wait(i);
+	}
+}
+
+static Spinlock bench_spinlock __attribute__((aligned(64)));
+static McsLock bench_mcs_lock __attribute__((aligned(64)));
+
+// The data the bench locks protect, on its own line
+static volatile uint64_t lock_data[8] __attribute__((aligned(64)));
+
+static
+void lock_bench_init(void)
+{
+	static bool named = false;
+	if (!named)
+	{
+		spin_init(&bench_spinlock, "bench ticket");
+		mcs_init(&bench_mcs_lock, "bench mcs");
+		named = true;
+	}
+}
+
+static inline
+void lock_critical_section(void)
+{
+	for (uint32_t i = 0; i < 8; ++i)
+	{
+		++lock_data[i];
+	}
+}
+
+static
+void spinlock_worker(void)
+{
+	__atomic_fetch_add(&workers_running, 1, __ATOMIC_RELAXED);
+	while (!workers_stop)
+	{
+		spin_lock(&bench_spinlock);
+		lock_critical_section();
+		spin_unlock(&bench_spinlock);
+	}
+}
+
+static
+void mcs_lock_worker(void)
+{
+	McsNode node;
+	__atomic_fetch_add(&workers_running, 1, __ATOMIC_RELAXED);
+	while (!workers_stop)
+	{
+		mcs_lock(&bench_mcs_lock, &node);
+		lock_critical_section();
+		mcs_unlock(&bench_mcs_lock, &node);
+	}
+}
+
+BENCH(spinlock_uncontended, 256)
+{
+	lock_bench_init();
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		spin_lock(&bench_spinlock);
+		lock_critical_section();
+		spin_unlock(&bench_spinlock);
+	}
+}
+
+BENCH(mcs_lock_uncontended, 256)
+{
+	McsNode node;
+	lock_bench_init();
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		mcs_lock(&bench_mcs_lock, &node);
+		lock_critical_section();
+		mcs_unlock(&bench_mcs_lock, &node);
+	}
+}
+
+/* Every CPU hammers the lock. A sample is the time this CPU takes per
+ * acquisition, which grows with how often the lock's line has to move
+ * between the waiters.
+ */
+BENCH(spinlock_contended, 256)
+{
+	lock_bench_init();
+
+	bench_pause(state);
+	start_workers(spinlock_worker, MAX_CPUS);
+	bench_resume(state);
+
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		spin_lock(&bench_spinlock);
+		lock_critical_section();
+		spin_unlock(&bench_spinlock);
+	}
+
+	bench_pause(state);
+	stop_workers();
+	bench_resume(state);
+}
+
+BENCH(mcs_lock_contended, 256)
+{
+	McsNode node;
+	lock_bench_init();
+
+	bench_pause(state);
+	start_workers(mcs_lock_worker, MAX_CPUS);
+	bench_resume(state);
+
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		mcs_lock(&bench_mcs_lock, &node);
+		lock_critical_section();
+		mcs_unlock(&bench_mcs_lock, &node);
+	}
+
+	bench_pause(state);
+	stop_workers();
+	bench_resume(state);
+}
+
+static PML4_Table* tlb_bench_pml4 = NULL;
+static uint64_t tlb_bench_frame = 0;
+
+/* An address space with the kernel's mappings plus the pages the
+ * benchmark unmaps. Only the workers load it, so only they are
+ * shootdown targets.
+ */
+static
+void tlb_bench_init(void)
+{
+	if (tlb_bench_pml4 != NULL)
+	{
+		return;
+	}
+
+	ASSERT(kernel_PML4.entries[BENCH_TLB_PML4_INDEX] == 0);
+	tlb_bench_pml4 = (PML4_Table*) phys_alloc_4KIB_safe("TLB bench PML4");
+	memcpy(tlb_bench_pml4, &kernel_PML4, sizeof(PML4_Table));
+	tlb_bench_frame = (uint64_t)phys_alloc_4KIB_safe("TLB bench frame");
+}
+
+static
+void tlb_worker(void)
+{
+	tlb_switch(tlb_bench_pml4);
+	__atomic_fetch_add(&workers_running, 1, __ATOMIC_RELAXED);
+	while (!workers_stop)
+	{
+		__asm__ volatile("pause");
+	}
+	tlb_switch(&kernel_PML4);
+}
+
+/* Unmap state->iterations pages while 'cpus' CPUs, including this one,
+ * have the address space active.
+ */
+static
+void tlb_unmap_bench(BenchState* state, uint32_t cpus, bool batched)
+{
+	tlb_bench_init();
+
+	bench_pause(state);
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		map_page(tlb_bench_pml4, BENCH_TLB_VIRT_BASE + i*_4_KIB, tlb_bench_frame,
+				PG_FLAG_RW, PAGE_4KIB);
+	}
+	start_workers(tlb_worker, cpus);
+	bench_resume(state);
+
+	uint64_t phys;
+	if (batched)
+	{
+		TlbBatch batch;
+		tlb_batch_init(&batch, tlb_bench_pml4);
+		for (uint64_t i = 0; i < state->iterations; ++i)
+		{
+			unmap_page_batched(&batch, BENCH_TLB_VIRT_BASE + i*_4_KIB, &phys);
+		}
+		tlb_batch_flush(&batch);
+	}
+	else
+	{
+		for (uint64_t i = 0; i < state->iterations; ++i)
+		{
+			unmap_page(tlb_bench_pml4, BENCH_TLB_VIRT_BASE + i*_4_KIB, &phys);
+		}
+	}
+
+	bench_pause(state);
+	stop_workers();
+	bench_resume(state);
+}
+
+BENCH(tlb_unmap_1cpu, TLB_BATCH_PAGES)
+{
+	tlb_unmap_bench(state, 1, true);
+}
+
+BENCH(tlb_unmap_2cpus, TLB_BATCH_PAGES)
+{
+	tlb_unmap_bench(state, 2, true);
+}
+
+BENCH(tlb_unmap_4cpus, TLB_BATCH_PAGES)
+{
+	tlb_unmap_bench(state, 4, true);
+}
+
+BENCH(tlb_unmap_all_cpus, TLB_BATCH_PAGES)
+{
+	tlb_unmap_bench(state, MAX_CPUS, true);
+}
+
+/* More pages than a batch invalidates one by one, a full flush.
+ */
+BENCH(tlb_unmap_all_cpus_full_flush, 8 * TLB_BATCH_PAGES)
+{
+	tlb_unmap_bench(state, MAX_CPUS, true);
+}
+
+/* One shootdown per page, what batching saves.
+ */
+BENCH(tlb_unmap_all_cpus_unbatched, TLB_BATCH_PAGES)
+{
+	tlb_unmap_bench(state, MAX_CPUS, false);
+}
+
+// Threads of the switch benchmark that returned
+static volatile uint32_t yield_threads_done = 0;
+
+static
+void yield_loop(void* arg)
+{
+	const uint64_t rounds = (uint64_t)arg;
+	for (uint64_t i = 0; i < rounds; ++i)
+	{
+		thread_yield();
+	}
+	__atomic_fetch_add(&yield_threads_done, 1, __ATOMIC_RELEASE);
+}
+
+/* Yield with nothing else queued, the software interrupt and the queue
+ * check without a switch.
+ */
+BENCH(thread_yield_no_switch, 256)
+{
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		thread_yield();
+	}
+}
+
+/* Two threads on this CPU yielding to each other, an op is one switch.
+ * They are queued with interrupts disabled, the wake IPI switches to
+ * them while the idle thread waits, and it runs again once both exited.
+ */
+BENCH(thread_switch, 256)
+{
+	bench_pause(state);
+	const uint64_t flags = irq_save();
+	const uint32_t cpu = cpu_index();
+	void* rounds = (void*)(state->iterations / 2);
+	yield_threads_done = 0;
+	Thread* a = thread_create("bench a", yield_loop, rounds, cpu);
+	Thread* b = thread_create("bench b", yield_loop, rounds, cpu);
+	ASSERT(a != NULL && b != NULL);
+	bench_resume(state);
+	irq_restore(flags);
+
+	while (__atomic_load_n(&yield_threads_done, __ATOMIC_ACQUIRE) < 2)
+	{
+		__asm__ volatile("pause");
+	}
+}
+
+#ifdef TRACE_KERNEL
+BENCH(trace_record, 256)
+{
+	for (uint64_t i = 0; i < state->iterations; ++i)
+	{
+		TRACE(MARK, i, i, i, i);
+	}
+}
+#endif
+#endif
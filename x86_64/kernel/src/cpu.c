@@ -0,0 +1,46 @@
+#include "cpu.h"
+#include "cpuid.h"
+#include "safety.h"
+
+static PerCPU cpus[MAX_CPUS];
+static uint32_t num_cpus = 0;
+
+void cpu_init_bsp()
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid_count(1, 0, &eax, &ebx, &ecx, &edx);
+
+	PerCPU* cpu = &cpus[0];
+	cpu->self = cpu;
+	cpu->index = 0;
+	cpu->apic_id = ebx >> 24;
+	num_cpus = 1;
+
+	const uint64_t base = (uint64_t)cpu;
+	writemsr(MSR_GS_BASE, base & 0xFFFFFFFF, base >> 32);
+}
+
+void cpu_init_ap(uint32_t index)
+{
+	ASSERT(index > 0 && index < MAX_CPUS);
+
+	PerCPU* cpu = &cpus[index];
+	cpu->self = cpu;
+	cpu->index = index;
+
+	const uint64_t base = (uint64_t)cpu;
+	writemsr(MSR_GS_BASE, base & 0xFFFFFFFF, base >> 32);
+
+	__atomic_add_fetch(&num_cpus, 1, __ATOMIC_RELEASE);
+}
+
+uint32_t cpu_count()
+{
+	return __atomic_load_n(&num_cpus, __ATOMIC_ACQUIRE);
+}
+
+PerCPU* cpu_get(uint32_t index)
+{
+	ASSERT(index < MAX_CPUS);
+	return &cpus[index];
+}
@@ -0,0 +1,103 @@
+#ifndef __X86_64_CPU_H__
+#define __X86_64_CPU_H__
+
+#include "inttypes.h"
+
+// Most CPUs the kernel keeps per-CPU state for
+#define MAX_CPUS 32
+
+#define MSR_GS_BASE 0xC0000101
+
+#define RFLAGS_IF (1 << 9)
+
+/* Per-CPU data block. Each CPU points its GS base at its own block so
+ * the current CPU can be found with a single load.
+ */
+typedef struct _PerCPU
+{
+	struct _PerCPU* self;
+	uint32_t index;   // Dense index 0 .. cpu_count()-1
+	uint32_t apic_id;
+	uint32_t node;    // NUMA node, see numa_local_node()
+
+	// Set to switch threads on the way out of the current interrupt,
+	// read by isr_save in interrupts.S
+	volatile uint32_t need_switch;
+
+	struct _Thread* thread; // Thread running on this CPU
+} PerCPU;
+
+COMPILE_ASSERT(sizeof(PerCPU) == 32);
+COMPILE_ASSERT(__builtin_offsetof(PerCPU, need_switch) == 20);
+
+/* Point the GS base of the bootstrap processor at its per-CPU block.
+ * Must be called before anything uses cpu_index().
+ */
+void cpu_init_bsp(void);
+
+/* Point the GS base of an application processor at its per-CPU block
+ * and count it. The APIC ID and node are filled in as they become
+ * known.
+ *
+ * Params:
+ *   index - Dense index of the CPU, handed out by the AP startup code
+ */
+void cpu_init_ap(uint32_t index);
+
+/* The number of CPUs that have a per-CPU block.
+ */
+uint32_t cpu_count(void);
+
+/* The per-CPU block of any CPU.
+ *
+ * Params:
+ *   index - Below cpu_count()
+ */
+PerCPU* cpu_get(uint32_t index);
+
+/* The per-CPU block of the CPU this code runs on. The caller must not
+ * be migrated to another CPU while using it.
+ */
+static inline __attribute__((always_inline))
+PerCPU* this_cpu(void)
+{
+	PerCPU* cpu;
+	__asm__ volatile("movq %%gs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+/* The dense index of the CPU this code runs on.
+ */
+static inline __attribute__((always_inline))
+uint32_t cpu_index(void)
+{
+	uint32_t index;
+	__asm__ volatile("movl %%gs:8, %0" : "=r"(index));
+	return index;
+}
+
+/* Disable interrupts on this CPU.
+ *
+ * Returns:
+ *   The previous RFLAGS, to be handed to irq_restore().
+ */
+static inline __attribute__((always_inline))
+uint64_t irq_save(void)
+{
+	uint64_t flags;
+	__asm__ volatile("pushfq; popq %0; cli" : "=r"(flags) :: "memory");
+	return flags;
+}
+
+/* Enable interrupts again if they were enabled before irq_save().
+ */
+static inline __attribute__((always_inline))
+void irq_restore(uint64_t flags)
+{
+	if (flags & RFLAGS_IF)
+	{
+		__asm__ volatile("sti" ::: "memory");
+	}
+}
+
+#endif
@@ -14,6 +14,23 @@ void cpuid(uint32_t code, uint32_t* eax, uint32_t* edx)
 					  "ecx","ebx");	// Clobbered registers
 }
 
+/* Same as cpuid(), but also selects a sub-leaf through ECX and returns
+ * all four result registers.
+ *
+ * Params:
+ *   code    - The CPUID leaf (EAX)
+ *   subleaf - The CPUID sub-leaf (ECX)
+ *   eax, ebx, ecx, edx - Out parameters for the result registers
+ */
+static inline __attribute__((always_inline))
+void cpuid_count(uint32_t code, uint32_t subleaf, uint32_t* eax,
+		uint32_t* ebx, uint32_t* ecx, uint32_t* edx)
+{
+	__asm__ volatile ("cpuid" :
+					  "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : // Outputs
+					  "a"(code), "c"(subleaf)); // Inputs
+}
+
 static inline __attribute__((always_inline))
 void writemsr(uint32_t msr_reg, uint32_t eax, uint32_t edx)
 {
@@ -1,16 +1,21 @@
 #include "apic.h"
 
+#include "cpu.h"
 #include "memory/defines.h"
 #include "memory/paging.h"
+#include "memory/mmap.h"
+#include "memory/numa.h"
 #include "cpuid.h"
 #include "panic.h"
 #include "safety.h"
-#include "kprintf.h"
+#include "log.h"
 #include "inttypes.h"
 #include "defines.h"
 #include "support.h"
 
 #define APIC_BASE_MSR 0x1B
+#define APIC_BASE_EXTD (0x400) // x2APIC mode
+#define APIC_BASE_EN (0x800)
 #define APIC_EN (0x100)
 #define LVT_MASK (0x10000)
 #define LVT_EXTINT (0x700)
@@ -25,12 +30,31 @@
 #define PERFCNT_IDX (0x340 / sizeof(uint32_t))
 #define ERROR_IDX (0x370 / sizeof(uint32_t))
 #define SPURIOUS_IDX (0xF0 / sizeof(uint32_t))
+#define TIMER_INIT_IDX (0x380 / sizeof(uint32_t))
+#define TIMER_COUNT_IDX (0x390 / sizeof(uint32_t))
+#define TIMER_DIVIDE_IDX (0x3E0 / sizeof(uint32_t))
+#define ICR_LOW_IDX (0x300 / sizeof(uint32_t))
+#define ICR_HIGH_IDX (0x310 / sizeof(uint32_t))
+
+#define ICR_DELIVERY_PENDING (0x1000)
+
+#define TIMER_DIVIDE_1 (0xB)
+#define LVT_TIMER_TSC_DEADLINE (0x40000)
+
+// In x2APIC mode register offset 0xXY0 is MSR 0x80X
+#define X2APIC_MSR(IDX) (0x800 + ((IDX) * sizeof(uint32_t) >> 4))
+#define X2APIC_EOI_MSR X2APIC_MSR(EOI_IDX)
+#define X2APIC_ICR_MSR X2APIC_MSR(ICR_LOW_IDX)
 
 #define SPURIOUS_IRQ 0x50
 
 #define APIC_PRESENCE (0x1 << 9)
+#define X2APIC_PRESENCE (0x1 << 21) // CPUID.1:ECX
 volatile uint32_t* volatile APIC_REGS;
 
+// Registers are MSRs instead of MMIO
+static bool x2apic = false;
+
 /* Read the APICs starting physical location from the machine
  * specific register.
  */
@@ -45,22 +69,157 @@ uint32_t apic_base_address()
 static
 void apic_spurious_handler(uint64_t vector, uint64_t code)
 {
-	kprintf("Spurious: 0x%x - %d\n", vector, code);
+	log_warn(APIC, "Spurious: 0x%x - %d\n", vector, code);
 
 	// According to section 10.9 of the Intel manual the spurious
 	// interrupt handler should return without an EOI.
 }
 
+/* Read or write a LAPIC register, in whichever mode the LAPIC is in.
+ *
+ * Params:
+ *   idx - Register offset divided by 4, one of the _IDX defines
+ */
+static
+uint32_t apic_read(uint32_t idx)
+{
+	if (x2apic)
+	{
+		uint32_t eax, edx;
+		readmsr(X2APIC_MSR(idx), &eax, &edx);
+		return eax;
+	}
+
+	return APIC_REGS[idx];
+}
+
+static
+void apic_write(uint32_t idx, uint32_t value)
+{
+	if (x2apic)
+	{
+		writemsr(X2APIC_MSR(idx), value, 0);
+	}
+	else
+	{
+		APIC_REGS[idx] = value;
+	}
+}
+
 inline __attribute__((always_inline))
 void apic_eoi()
 {
-	APIC_REGS[EOI_IDX] = 0;
+	if (x2apic)
+	{
+		writemsr(X2APIC_EOI_MSR, 0, 0);
+	}
+	else
+	{
+		APIC_REGS[EOI_IDX] = 0;
+	}
+}
+
+uint32_t apic_id()
+{
+	const uint32_t id = apic_read(ID_IDX);
+	return x2apic ? id : id >> 24;
+}
+
+bool apic_is_x2apic()
+{
+	return x2apic;
+}
+
+void apic_send_icr(uint32_t dest, uint32_t command)
+{
+	if (x2apic)
+	{
+		// One write, and there is no delivery status to wait on. The
+		// WRMSR does not order earlier stores, the receiver may rely on
+		// seeing them.
+		__asm__ volatile("mfence" ::: "memory");
+		writemsr(X2APIC_ICR_MSR, command, dest);
+		return;
+	}
+
+	// The two halves must not be split by an interrupt handler that
+	// sends an IPI of its own
+	const uint64_t flags = irq_save();
+	APIC_REGS[ICR_HIGH_IDX] = dest << 24;
+	APIC_REGS[ICR_LOW_IDX] = command;
+	while (APIC_REGS[ICR_LOW_IDX] & ICR_DELIVERY_PENDING)
+	{
+		__asm__ volatile("pause");
+	}
+	irq_restore(flags);
+}
+
+void apic_send_ipi(uint32_t dest, uint8_t vector)
+{
+	apic_send_icr(dest, APIC_ICR_FIXED | APIC_ICR_ASSERT | vector);
+}
+
+void apic_timer_init(uint8_t vector, bool tsc_deadline)
+{
+	apic_write(TIMER_INIT_IDX, 0);
+	apic_write(TIMER_DIVIDE_IDX, TIMER_DIVIDE_1);
+	apic_write(TIMER_IDX, vector | (tsc_deadline ? LVT_TIMER_TSC_DEADLINE : 0));
+}
+
+void apic_timer_start(uint32_t count)
+{
+	apic_write(TIMER_INIT_IDX, count);
+}
+
+uint32_t apic_timer_count()
+{
+	return apic_read(TIMER_COUNT_IDX);
 }
 
 // The bootstrap processor (BSP) ID, needed during shutdown as the BSP
 // needs to be the last processor shutdown.
 static
-int8_t bsp_id = -1;
+int64_t bsp_id = -1;
+
+uint32_t apic_bsp_id()
+{
+	ASSERT(bsp_id >= 0);
+	return bsp_id;
+}
+
+/* Switch this CPU's LAPIC to x2APIC mode. It is entered from xAPIC
+ * mode, by setting EXTD with EN.
+ */
+static
+void enable_x2apic(void)
+{
+	uint32_t base_lo, base_hi;
+	readmsr(APIC_BASE_MSR, &base_lo, &base_hi);
+	base_lo |= APIC_BASE_EN;
+	writemsr(APIC_BASE_MSR, base_lo, base_hi);
+	writemsr(APIC_BASE_MSR, base_lo | APIC_BASE_EXTD, base_hi);
+}
+
+/* Program the local vector table of this CPU and enable its LAPIC.
+ * Only the bootstrap processor takes the 8259A's ExtINT on LINT0.
+ */
+static
+void setup_local_apic(bool bsp)
+{
+	// Disable the timer interrupt
+	apic_write(TIMER_IDX, LVT_MASK);
+	// When delivery mode is EXTINT it's always level triggered
+	apic_write(LINT0_IDX, bsp ? (LVT_LEVEL_TRIG | LVT_EXTINT) : LVT_MASK);
+	// Vector information is ignored with NMI setting
+	apic_write(LINT1_IDX, LVT_NMI);
+	apic_write(PERFCNT_IDX, LVT_MASK);
+	apic_write(ERROR_IDX, LVT_MASK);
+	// Set the spurious register while also enabling the APIC
+	apic_write(SPURIOUS_IDX, SPURIOUS_IRQ | APIC_EN);
+	apic_write(TPR_IDX, 0);
+
+	this_cpu()->apic_id = apic_id();
+}
 
 // Page 33 Intel Multi-Processor Specification
 // http://download.intel.com/design/pentium/datashts/24201606.pdf
@@ -78,14 +237,21 @@ void apic_init()
 	// When CPUID is executed with an operand of 1, bit 9
 	// of the CPUID feature flags returned in EDX indicates
 	// if an LAPIC exists (1 if it does, 0 if not).
-	uint32_t eax, edx;	
-	cpuid(0x1, &eax, &edx);
+	uint32_t eax, ebx, ecx, edx;
+	cpuid_count(0x1, 0, &eax, &ebx, &ecx, &edx);
 
 	if ((edx & APIC_PRESENCE) == 0)
 	{
 		panic("No LAPIC present\n");
 	}
 
+	if (ecx & X2APIC_PRESENCE)
+	{
+		enable_x2apic();
+		x2apic = true;
+	}
+	log_info(APIC, "APIC: %s mode\n", x2apic ? "x2APIC" : "xAPIC");
+
 	const uint32_t apic_addr = apic_base_address();
 
 	if (apic_addr == 0)
@@ -93,40 +259,46 @@ void apic_init()
 		panic("No APIC present");
 	}
 
-	kprintf("APIC Physical Address: 0x%x\n", apic_addr);
+	log_debug(APIC, "APIC Physical Address: 0x%x\n", apic_addr);
 
-	// Make an identity mapping for the LAPIC
-	uint64_t dummy;
-	kunmap_page(apic_addr, &dummy);
-	if (!kmap_page(apic_addr, apic_addr, 
-			PG_FLAG_RW | PG_FLAG_PWT | PG_FLAG_PCD, PAGE_4KIB))
+	if (!mmap_reserve(apic_addr, _4_KIB))
 	{
-		panic("Failed to remap APIC");
+		panic("LAPIC overlaps usable memory");
 	}
-	APIC_REGS = (uint32_t*) (uint64_t) apic_addr;
 
-	// Try to read the APIC ID from the newly mapped address
-	kprintf("BSP APIC ID: 0x%x\n", APIC_REGS[ID_IDX]);	
-	kprintf("BSP APIC VER: 0x%x\n", APIC_REGS[0x30/4]);	
+	// Make an identity mapping for the LAPIC, the MMIO registers are
+	// not used in x2APIC mode
+	if (!x2apic)
+	{
+		uint64_t dummy;
+		kunmap_page(apic_addr, &dummy);
+		if (!kmap_page(apic_addr, apic_addr, 
+				PG_FLAG_RW | PG_FLAG_PWT | PG_FLAG_PCD, PAGE_4KIB))
+		{
+			panic("Failed to remap APIC");
+		}
+		APIC_REGS = (uint32_t*) (uint64_t) apic_addr;
+	}
 
-	// Save the bootstrap processor ID
-	bsp_id = APIC_REGS[ID_IDX];
+	log_debug(APIC, "BSP APIC ID: 0x%x\n", (uint64_t)apic_id());
+	log_debug(APIC, "BSP APIC VER: 0x%x\n", (uint64_t)apic_read(0x30/4));
 
-	// Disable the timer interrupt
-	APIC_REGS[TIMER_IDX] = LVT_MASK;
-	// When delivery mode is EXTINT it's always level triggered
-	APIC_REGS[LINT0_IDX] = LVT_LEVEL_TRIG | LVT_EXTINT;
-	// Vector information is ignored with NMI setting
-	APIC_REGS[LINT1_IDX] = LVT_NMI;
-	APIC_REGS[PERFCNT_IDX] = LVT_MASK;
-	APIC_REGS[ERROR_IDX] = LVT_MASK;
-	// Set the spurious register while also enabling the APIC
-	APIC_REGS[SPURIOUS_IDX] = SPURIOUS_IRQ | APIC_EN;
-
-	APIC_REGS[LINT0_IDX] = LVT_LEVEL_TRIG | LVT_EXTINT;
-	APIC_REGS[LINT1_IDX] = LVT_NMI;
-	APIC_REGS[TPR_IDX] = 0;
+	// Save the bootstrap processor ID, CPUID only gave its low 8 bits
+	bsp_id = apic_id();
+	setup_local_apic(true);
+	this_cpu()->node = numa_cpu_node(this_cpu()->apic_id);
 
 	// Install spurious handler
 	interrupts_install_isr(SPURIOUS_IRQ, apic_spurious_handler);
 }
+
+void apic_init_ap()
+{
+	// Same mode as the BSP, the registers are mapped already
+	if (x2apic)
+	{
+		enable_x2apic();
+	}
+
+	setup_local_apic(false);
+}
@@ -1,8 +1,73 @@
 #ifndef __X86_64_APIC_H__
 #define __X86_64_APIC_H__
 
-/* Setup the LAPIC if it exists.
+#include "inttypes.h"
+
+// Interrupt command register fields, for apic_send_icr()
+#define APIC_ICR_FIXED        0x00000
+#define APIC_ICR_INIT         0x00500
+#define APIC_ICR_STARTUP      0x00600
+#define APIC_ICR_ASSERT       0x04000
+#define APIC_ICR_LEVEL        0x08000
+#define APIC_ICR_SELF         0x40000
+#define APIC_ICR_ALL          0x80000
+#define APIC_ICR_ALL_BUT_SELF 0xC0000
+
+/* Setup the LAPIC if it exists. Uses x2APIC mode when the CPU has it,
+ * xAPIC mode otherwise.
  */
 void apic_init(void);
 
+/* Enable the LAPIC of an application processor, in the mode
+ * apic_init() picked.
+ */
+void apic_init_ap(void);
+
+/* The APIC ID of the bootstrap processor.
+ */
+uint32_t apic_bsp_id(void);
+
+/* Whether the LAPIC is accessed through MSRs.
+ */
+bool apic_is_x2apic(void);
+
+/* The full APIC ID of this CPU. 8 bits in xAPIC mode, 32 in x2APIC.
+ */
+uint32_t apic_id(void);
+
+/* Write the interrupt command register. Returns once the LAPIC has
+ * accepted the command.
+ *
+ * Params:
+ *   dest    - APIC ID of the target, ignored with a shorthand
+ *   command - Low half of the ICR, APIC_ICR_* flags and a vector
+ */
+void apic_send_icr(uint32_t dest, uint32_t command);
+
+/* Send a fixed interrupt to one CPU.
+ *
+ * Params:
+ *   dest   - APIC ID of the target
+ *   vector - The vector to raise there
+ */
+void apic_send_ipi(uint32_t dest, uint8_t vector);
+
+/* Set up this CPU's LAPIC timer to count down at the bus clock, and
+ * raise the vector once, when it reaches zero. In TSC-deadline mode it
+ * fires when the TSC passes IA32_TSC_DEADLINE instead.
+ *
+ * Params:
+ *   vector       - Vector of the timer interrupt
+ *   tsc_deadline - Use TSC-deadline mode, the CPU must support it
+ */
+void apic_timer_init(uint8_t vector, bool tsc_deadline);
+
+/* Start the one-shot countdown, 0 stops it.
+ */
+void apic_timer_start(uint32_t count);
+
+/* What is left of the countdown.
+ */
+uint32_t apic_timer_count(void);
+
 #endif
@@ -24,4 +24,32 @@ extern void pic_acknowledge(uint64_t vector);
 extern void interrupts_install_isr(uint64_t index, 
 		void handler(uint64_t, uint64_t));
 
+/* Install a fast handler for the given vector. Its stub saves only the
+ * registers a C function may clobber and calls the handler directly,
+ * without the accounting of the full path or a register frame. Meant
+ * for high rate interrupts whose handlers do little more than count or
+ * send an EOI. Calling interrupts_install_isr() for the vector later
+ * switches it back to the full path.
+ *
+ * Params:
+ *   index   - The interrupt vector, 32 or higher. Exceptions always
+ *             take the full path.
+ *   handler - The handler, called with the vector
+ */
+extern void interrupts_install_fast_isr(uint64_t index,
+		void handler(uint64_t));
+
+/* Choose whether a vector's handler runs with interrupts enabled.
+ * By default they are disabled for the whole handler. A preemptible
+ * handler can be interrupted by any vector the local APIC lets through,
+ * those of a higher priority class than the one being serviced. Meant
+ * for slow, low priority devices, which then no longer hold up the
+ * latency sensitive ones.
+ *
+ * Params:
+ *   index       - The interrupt vector
+ *   preemptible - True to leave interrupts enabled in the handler
+ */
+extern void interrupts_set_preemptible(uint64_t index, bool preemptible);
+
 #endif
@@ -6,10 +6,13 @@
 #include "panic.h"
 #include "safety.h"
 #include "ioapic.h"
+#include "stats.h"
 #include "kprintf.h"
 #include "defines.h"
 #include "inttypes.h"
-#include "mptables.h"
+#include "topology.h"
+#include "trace/trace.h"
+#include "serial.h"
 
 /* Default interrupt handler. Prints some information about
  * the interrupt, or if it's a serious interrupt halts.
@@ -17,6 +20,7 @@
 static
 void default_handler(uint64_t vector, uint64_t code)
 {
+	TRACE(INTERRUPT, vector, code);
 	kprintf("Got interrupt: 0x%x - %d\n", vector, code);
 	if (vector == 14)
 	{
@@ -41,6 +45,15 @@ void default_handler(uint64_t vector, uint64_t code)
 extern
 void setup_isr_table(void default_handler(uint64_t, uint64_t));
 
+// The IDT, shared by all CPUs, see prekernel.s
+extern uint64_t start_idt_64[512];
+
+typedef struct
+{
+	uint16_t limit;
+	uint64_t base;
+} __attribute__((packed)) IDT_Pointer;
+
 /* Initialize interrupts.
  */
 void interrupts_init()
@@ -48,16 +61,30 @@ void interrupts_init()
 	tss_init();
 
 	setup_isr_table(default_handler);
+	isr_stats_init();
 
 	// Initialize the APIC
 	// TODO fallback to 8259 if there is no APIC?
 	disable_pic();
-	// Parse the MP tables to gain information about the APIC
-	if (!find_mfp_struct())
+	// Find the CPUs and I/O APICs in the ACPI or MP tables
+	if (!topology_init())
 	{
-		panic("Failed to find the multiprocessor floating pointer structure\n");
+		panic("Failed to find the ACPI MADT or the MP tables\n");
 	}
 	apic_init();
 
 	ioapic_init();
+
+	// COM1 is routed now, stop writing to it synchronously
+	serial_enable_interrupts();
+}
+
+void interrupts_init_ap()
+{
+	IDT_Pointer pointer;
+	pointer.limit = sizeof(start_idt_64) - 1;
+	pointer.base = (uint64_t)start_idt_64;
+	__asm__ volatile("lidt %0" :: "m"(pointer));
+
+	apic_init_ap();
 }
@@ -7,4 +7,9 @@
  */
 void interrupts_init(void);
 
+/* Load the IDT and enable the LAPIC on an application processor, once
+ * interrupts_init() has run on the bootstrap processor.
+ */
+void interrupts_init_ap(void);
+
 #endif
@@ -1,4 +1,8 @@
 #include "defines.h"
+#include "stats.h"
+#include "tss.h"
+#include "support.h"
+#include "sync/spinlock.h"
 
 #define CODE_SEG_64 0x10
 #define DATA_SEG_64 0x20
@@ -12,6 +16,15 @@
 
 #define IDT_TYPE_INT_GATE (0xE << 7)
 
+// Gate flags: present, DPL 3, and an interrupt gate, which clears IF,
+// or a trap gate, which leaves it set
+#define IDT_FLAGS_INT_GATE 0xEE
+#define IDT_FLAGS_TRAP_GATE 0xEF
+
+#define VECTOR_NMI 2
+#define VECTOR_DOUBLE_FAULT 8
+#define VECTOR_MACHINE_CHECK 18
+
 typedef struct
 {
 	uint16_t offset_L;
@@ -32,8 +45,34 @@ extern IDT_Gate start_idt_64[256];
  */
 void (*isr_table[256])(uint64_t vector, uint64_t code);
 
+/* Handlers of vectors that use the fast stubs, NULL for the others.
+ */
+void (*isr_fast_table[256])(uint64_t vector);
+
+/* Serializes changes to the tables and the IDT. The stubs read the
+ * tables without it, every entry is a single pointer store.
+ */
+static Spinlock isr_lock;
+
+// First vector with a fast stub, the exceptions before it have none
+#define FIRST_FAST_VECTOR 32
+
 typedef void (*interrupt_handler)(void);
 
+/* Called by isr_save in interrupts.S for every interrupt. Runs the
+ * handler installed for the vector and records how long it took.
+ *
+ * Params:
+ *   vector - The interrupt vector
+ *   code   - The error code, or 0 for vectors without one
+ */
+void interrupts_dispatch(uint64_t vector, uint64_t code)
+{
+	const uint64_t start = _rdtsc();
+	isr_table[vector](vector, code);
+	isr_stats_record(vector, _rdtsc() - start);
+}
+
 /* Setup an entry in the interrupt descriptor table. Handling an 
  * interrupt is actually a two step process. The IDT is filled with
  * stubs that call assembly routines that make the stack uniform
@@ -61,18 +100,68 @@ static void set_idt_entry(uint64_t index, interrupt_handler fn_ih)
 
 	const uint64_t fn_loc = (uint64_t)fn_ih;
 
+	// Everything else runs on the stack it interrupted, nesting
+	uint8_t ist = 0;
+	switch (index)
+	{
+		case VECTOR_NMI: ist = IST_NMI; break;
+		case VECTOR_DOUBLE_FAULT: ist = IST_DOUBLE_FAULT; break;
+		case VECTOR_MACHINE_CHECK: ist = IST_MACHINE_CHECK; break;
+	}
+
 	start_idt_64[index].offset_L = fn_loc & 0xFFFF;
 	start_idt_64[index].segment_selector = CODE_SEG_64;
-	start_idt_64[index].ist = 0;
-	start_idt_64[index].flags = 0xEE;
+	start_idt_64[index].ist = ist;
+	start_idt_64[index].flags = IDT_FLAGS_INT_GATE;
 	start_idt_64[index].offset_H = (fn_loc >> 16) & 0xFFFF;
 	start_idt_64[index].offset_HH = (fn_loc >> 32) & 0xFFFFFFFF;
 	start_idt_64[index].reserved = 0;
 }
 
+/* Point an IDT entry at a different stub, keeping its other fields.
+ */
+static void set_idt_offset(uint64_t index, interrupt_handler fn_ih)
+{
+	const uint64_t fn_loc = (uint64_t)fn_ih;
+
+	start_idt_64[index].offset_L = fn_loc & 0xFFFF;
+	start_idt_64[index].offset_H = (fn_loc >> 16) & 0xFFFF;
+	start_idt_64[index].offset_HH = (fn_loc >> 32) & 0xFFFFFFFF;
+}
+
 void interrupts_install_isr(uint64_t index, void handler(uint64_t, uint64_t))
 {
+	extern interrupt_handler isr_stub_table[256];
+
+	const uint64_t flags = spin_lock_irqsave(&isr_lock);
 	isr_table[index] = handler;
+	if (isr_fast_table[index] != NULL)
+	{
+		set_idt_offset(index, isr_stub_table[index]);
+		isr_fast_table[index] = NULL;
+	}
+	spin_unlock_irqrestore(&isr_lock, flags);
+}
+
+void interrupts_install_fast_isr(uint64_t index, void handler(uint64_t))
+{
+	extern interrupt_handler isr_fast_stub_table[256 - FIRST_FAST_VECTOR];
+
+	ASSERT(index >= FIRST_FAST_VECTOR && index < 256);
+
+	const uint64_t flags = spin_lock_irqsave(&isr_lock);
+
+	// Install the handler before the stub that calls it
+	isr_fast_table[index] = handler;
+	__asm__ volatile("" ::: "memory");
+	set_idt_offset(index, isr_fast_stub_table[index - FIRST_FAST_VECTOR]);
+	spin_unlock_irqrestore(&isr_lock, flags);
+}
+
+void interrupts_set_preemptible(uint64_t index, bool preemptible)
+{
+	ASSERT(index < 256);
+	start_idt_64[index].flags = preemptible ? IDT_FLAGS_TRAP_GATE : IDT_FLAGS_INT_GATE;
 }
 
 /* Places assembly stubs into the IDT and then installs a dummy handler
@@ -85,6 +174,8 @@ void interrupts_install_isr(uint64_t index, void handler(uint64_t, uint64_t))
 void setup_isr_table(void default_handler(uint64_t, uint64_t))
 {
 	extern interrupt_handler isr_stub_table[256];
+
+	spin_init(&isr_lock, "isr_table");
 	for (uint16_t i = 0; i < 256; ++i)
 	{
 		set_idt_entry(i, isr_stub_table[i]);
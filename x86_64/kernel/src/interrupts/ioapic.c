@@ -1,123 +1,95 @@
 #include "ioapic.h"
 
 #include "apic.h"
+#include "cpu.h"
 #include "memory/defines.h"
 #include "memory/paging.h"
+#include "memory/mmap.h"
 #include "mptables.h"
+#include "topology.h"
 #include "inttypes.h"
-#include "kprintf.h"
+#include "klib.h"
+#include "log.h"
 #include "safety.h"
 #include "panic.h"
+#include "sync/spinlock.h"
 
-void ioapic_write32(uint32_t ioapic_idx, uint8_t reg_idx, uint32_t val);
-
-void ioapic_write64(uint32_t ioapic_idx, uint8_t reg_idx, uint64_t val);
-
-uint32_t ioapic_read32(uint32_t ioapic_idx, uint8_t reg_idx);
-
-uint64_t ioapic_read64(uint32_t ioapic_idx, uint8_t reg_idx);
-
-// The first I/O APIC is located here, subsequent ones are located
-// at 4KiB increments after this address. So the second I/O APIC is
-// located at 0xFEC0_1000. Although if an MP configuration table is
-// provided then the I/O APIC may reside at a different adress. 
+// The I/O APICs come from the ACPI MADT or the MP configuration table.
+// The first I/O APIC is usually at 0xFEC0_0000, but any of them may be
+// anywhere. The MP table lists the source of every pin, the MADT only
+// the ISA IRQs that are not identity mapped.
 //
 // Page 32 of Intel Multi-Processor Specification
 // http://download.intel.com/design/pentium/datashts/24201606.pdf
 
-static uint64_t ioapic_base_virt_address = 0;
+#define MAX_IOAPICS 8
+#define MAX_GSIS 128
+
+#define IOAPIC_REG_VER 0x01
+#define IOAPIC_REG_REDIR 0x10
 
 #define MASK_INT 0x10000
-#define LOWEST_PRIO 0x100
+#define LEVEL_TRIGGER 0x8000
 #define ACTIVE_LOW 0x2000
 
-void ioapic_init()
-{
-	// Check how many I/O APICs are present in the system
-	const uint32_t num_ioapics = get_ioapic_entry_count();
-	if (num_ioapics == 0)
-	{
-		panic("No I/O APICs found!");
-	}
+// Flags of an MP I/O interrupt assignment entry
+#define MP_INT_TYPE_INT 0
+#define MP_POLARITY_MASK 0x3
+#define MP_POLARITY_HIGH 0x1
+#define MP_POLARITY_LOW 0x3
+#define MP_TRIGGER_MASK 0xC
+#define MP_TRIGGER_EDGE 0x4
+#define MP_TRIGGER_LEVEL 0xC
+#define MP_ALL_IOAPICS 0xFF
 
-	kprintf("Found %d I/O APICs\n", num_ioapics);
+// ISA IRQ 2 is the cascade of the 8259A pair, nothing raises it
+#define ISA_CASCADE_IRQ 2
 
-	// Map the I/O APICs to a virtual address below the LAPIC
-	// All of the I/O APICs should be sequential in memory separated
-	// in 4KiB increments.
-	const IOAPICEntry* ie = get_ioapic_entries();
+#define NO_GSI 0xFF
 
-	uint32_t prev_address = ie[0].address;
-	for (uint32_t i = 1; i < num_ioapics; ++i)
-	{
-		ASSERT(ie[i].address > prev_address);
-		ASSERT(ie[i].address - prev_address == 0x1000);
+typedef struct
+{
+	uint64_t address;
+	uint32_t gsi_base;
+	uint8_t id;
+	uint8_t num_pins;
+	Spinlock lock;  // Keeps each IOREGSEL/IOWIN pair together
+} IOAPIC;
 
-		prev_address = ie[i].address;
-	}
+typedef struct
+{
+	uint8_t ioapic;  // Index into ioapics
+	uint8_t pin;
+	uint8_t vector;  // 0 if nothing is connected
+	bool masked;
+	uint32_t flags;  // Trigger mode and polarity bits of the entry
+	uint32_t dest;   // Local APIC ID
+} Route;
 
-	ioapic_base_virt_address = ie[0].address;
+// Typical interrupt IRQ priority order (highest -> lowest) is:
+// 0,1,2,8,9,10,11,12,13,14,15,3,4,5,6,7
+static const uint8_t isa_vectors[IOAPIC_ISA_IRQS] =
+{
+	0xFC, 0xF4, 0xEC, 0xA4, 0x9C, 0x94, 0x8C, 0x84,
+	0xE4, 0xDC, 0xD4, 0xCC, 0xC4, 0xBC, 0xB4, 0xAC,
+};
 
-	// Make an identity mapping for the I/O APICs
-	uint64_t dummy;
-	for (uint32_t i = 0; i < num_ioapics; ++i)
-	{
-		kunmap_page(ie[i].address, &dummy);
-		if (!kmap_page(ie[i].address, ie[i].address,
-					PG_FLAG_RW | PG_FLAG_PWT | PG_FLAG_PCD, PAGE_4KIB))
-		{
-			kprintf("I/O APIC #%d\n", i);
-			panic("Failed to map I/O APIC");
-		}
+static IOAPIC ioapics[MAX_IOAPICS];
+static uint32_t num_ioapics = 0;
+static uint32_t num_gsis = 0;
 
-		kprintf("Mapped I/O APIC: %d\n", i);
-	}
-
-	kprintf("Done mapping I/O APICs\n");
-
-	// Now the I/O APIC interrupts have to be remapped and the 8259A PIC disabled
-	// Typical interrupt IRQ priority order (highest -> lowest) is:
-	// 0,1,2,8,9,10,11,12,13,14,15,3,4,5,6,7
-	// We'll follow that until something else comes up
-	ioapic_write64(0, 0x10, 0xFC); // 0
-	ioapic_write64(0, 0x12, 0xF4); // 1
-	// Apparently IRQ 2 is something internal to the PIC. It generates a lot of
-	// interrupts, so we'll disable it for now until more information is found.
-	ioapic_write64(0, 0x14, MASK_INT);//0xEC); // 2
-	ioapic_write64(0, 0x16, 0xA4); // 3
-	ioapic_write64(0, 0x18, 0x9C); // 4
-	ioapic_write64(0, 0x1A, 0x94); // 5
-	ioapic_write64(0, 0x1C, 0x8C); // 6
-	ioapic_write64(0, 0x1E, 0x84); // 7
-	ioapic_write64(0, 0x20, 0xE4); // 8
-	ioapic_write64(0, 0x22, 0xDC); // 9
-	ioapic_write64(0, 0x24, 0xD4); // 10
-	ioapic_write64(0, 0x26, 0xCC); // 11
-	ioapic_write64(0, 0x28, 0xC4); // 12
-	ioapic_write64(0, 0x2A, 0xBC); // 13
-	ioapic_write64(0, 0x2C, 0xB4); // 14
-	ioapic_write64(0, 0x2E, 0xAC); // 15
-	ioapic_write64(0, 0x30, MASK_INT); // 16 - PCI
-	ioapic_write64(0, 0x32, MASK_INT); // 17 - PCI
-	ioapic_write64(0, 0x34, MASK_INT); // 18 - PCI
-	ioapic_write64(0, 0x36, MASK_INT); // 19 - PCI
-	ioapic_write64(0, 0x38, MASK_INT); // 20 - Motherboard
-	ioapic_write64(0, 0x3A, MASK_INT); // 21 - Motherboard
-	ioapic_write64(0, 0x3C, MASK_INT); // 22 - GPI
-	ioapic_write64(0, 0x3E, MASK_INT); // 23 - SMI special pin
-
-	kprintf("Done redirecting interrupts\n");
-	kprintf("0x%x\n", ioapic_read64(0, 0x10));
-}
+static Route routes[MAX_GSIS];
+
+// GSI each ISA IRQ is connected to
+static uint8_t isa_gsi[IOAPIC_ISA_IRQS];
+
+static uint8_t next_device_vector = IOAPIC_DEVICE_VECTOR_BASE;
 
 /* All reads/writes must be done in dwords, so 64-bit reads/writes need two
  * 32-bit reads/writes
  *
- * x = 0-Fh
- * y = 0,4,8,Ch
- *
- * FEC0 xy00h - Register select
- * FEC0 xy10h - Data value
+ * base + 0x00 - Register select
+ * base + 0x10 - Data value
  *
  * REG SEL  - 32-bits - [31:8] Reserved - [7:0] - R/W
  * DATA REG - 32-bits - All R/W
@@ -139,13 +111,13 @@ void ioapic_init()
  * Interrupt priority is independent of the physical location (unlike the 8259A)
  * Vector maps to priority, and each interrupt can be assigned a vector
  *
- * [63:56] - Destination field - When mode = physical then [59:56] = APIC ID
+ * [63:56] - Destination field - When mode = physical then [63:56] = APIC ID
  *                             - When mode = logical then [63:56] = Set of processors
  * [55:17] - Reserved
  * [16]    - Interrupt mask - 1 = masked - 0 = not masked
  * [15]    - Trigger mode - 1 = level sensitive - 0 = edge sensitive
  * [14]    - For level intrs only - Set to 1 when 
- * [13]    - Pin polarity - 1 = active high - 0 = active low
+ * [13]    - Pin polarity - 1 = active low - 0 = active high
  * [12]    - Delivery status - 1 = send pending - 0 = idle
  * [11]    - Destination Mode - 1 = logical mode - 0 = physical mode
  * [10:8]  - Delivery mode - 000 = fixed mode
@@ -158,32 +130,395 @@ void ioapic_init()
  *                         - 111 = ExtINT - must be programmed as edge triggered
  * [7:0]   - Interrupt vector - Valid range is 0x10-0xFE
  */
+/* Called with the I/O APIC's lock held, another CPU selecting a
+ * register between the two accesses would redirect them.
+ */
+static
 void ioapic_write32(uint32_t ioapic_idx, uint8_t reg_idx, uint32_t val)
 {
-	uint32_t* addr = (uint32_t*)(ioapic_base_virt_address + ioapic_idx*0x1000);
+	volatile uint32_t* addr = (volatile uint32_t*) ioapics[ioapic_idx].address;
 	*addr = reg_idx;
 	*(addr+4) = val;
 }
 
-void ioapic_write64(uint32_t ioapic_idx, uint8_t reg_idx, uint64_t val)
-{
-	ioapic_write32(ioapic_idx, reg_idx+1, (val >> 32) & 0xFFFFFFFF);
-	ioapic_write32(ioapic_idx, reg_idx, val & 0xFFFFFFFF);
-}
-
+static
 uint32_t ioapic_read32(uint32_t ioapic_idx, uint8_t reg_idx)
 {
-	uint32_t* addr = (uint32_t*)(ioapic_base_virt_address + ioapic_idx*0x1000);
+	volatile uint32_t* addr = (volatile uint32_t*) ioapics[ioapic_idx].address;
 	*addr = reg_idx;
 	return *(addr+4);
 }
 
-uint64_t ioapic_read64(uint32_t ioapic_idx, uint8_t reg_idx)
+static inline
+uint8_t redir_reg(const Route* route)
+{
+	return IOAPIC_REG_REDIR + route->pin*2;
+}
+
+static inline
+uint32_t redir_low(const Route* route)
 {
-	uint64_t out_val = ioapic_read32(ioapic_idx, reg_idx+1);
-	out_val <<= 32;
-	out_val |= ioapic_read32(ioapic_idx, reg_idx);
+	return route->vector | route->flags | (route->masked ? MASK_INT : 0);
+}
 
-	return out_val;
+/* Write a whole redirection entry. The low half goes last, it holds
+ * the mask bit.
+ */
+static
+void write_route(const Route* route)
+{
+	Spinlock* lock = &ioapics[route->ioapic].lock;
+	const uint64_t flags = spin_lock_irqsave(lock);
+	ioapic_write32(route->ioapic, redir_reg(route) + 1, route->dest << 24);
+	ioapic_write32(route->ioapic, redir_reg(route), redir_low(route));
+	spin_unlock_irqrestore(lock, flags);
 }
 
+/* Map an I/O APIC and mask all of its pins.
+ *
+ * Params:
+ *   id       - I/O APIC ID
+ *   address  - Physical address of its registers
+ *   gsi_base - GSI of its first pin, TOPOLOGY_GSI_NEXT to follow the
+ *              previous I/O APIC
+ */
+static
+void add_ioapic(uint8_t id, uint64_t address, uint32_t gsi_base)
+{
+	if (num_ioapics == MAX_IOAPICS)
+	{
+		log_warn(IOAPIC, "Ignoring I/O APIC %d, too many\n", id);
+		return;
+	}
+
+	if (!mmap_reserve(address, _4_KIB))
+	{
+		panic("I/O APIC overlaps usable memory");
+	}
+
+	// Make an identity mapping
+	uint64_t dummy;
+	kunmap_page(address, &dummy);
+	if (!kmap_page(address, address,
+				PG_FLAG_RW | PG_FLAG_PWT | PG_FLAG_PCD, PAGE_4KIB))
+	{
+		log_error(IOAPIC, "I/O APIC %d at 0x%x\n", id, address);
+		panic("Failed to map I/O APIC");
+	}
+
+	const uint32_t index = num_ioapics++;
+	IOAPIC* ioapic = &ioapics[index];
+	ioapic->address = address;
+	ioapic->id = id;
+	spin_init(&ioapic->lock, "I/O APIC");
+
+	const uint64_t flags = spin_lock_irqsave(&ioapic->lock);
+	ioapic->num_pins = ((ioapic_read32(index, IOAPIC_REG_VER) >> 16) & 0xFF) + 1;
+	for (uint8_t pin = 0; pin < ioapic->num_pins; ++pin)
+	{
+		ioapic_write32(index, IOAPIC_REG_REDIR + pin*2, MASK_INT);
+	}
+	spin_unlock_irqrestore(&ioapic->lock, flags);
+
+	if (gsi_base == TOPOLOGY_GSI_NEXT)
+	{
+		gsi_base = num_gsis;
+	}
+	ioapic->gsi_base = gsi_base;
+
+	// Pins past the routing table stay masked
+	uint32_t end = gsi_base + ioapic->num_pins;
+	if (end > MAX_GSIS)
+	{
+		log_warn(IOAPIC, "I/O APIC %d: GSIs %d-%d not routed, table ends at %d\n",
+				id, gsi_base > MAX_GSIS ? gsi_base : MAX_GSIS, end - 1, MAX_GSIS);
+		end = MAX_GSIS;
+	}
+	if (end > num_gsis)
+	{
+		num_gsis = end;
+	}
+
+	log_info(IOAPIC, "I/O APIC %d at 0x%x, GSIs %d-%d\n", id, address,
+			ioapic->gsi_base, ioapic->gsi_base + ioapic->num_pins - 1);
+}
+
+/* The index of an I/O APIC given its ID.
+ *
+ * Returns:
+ *   The index, or num_ioapics if there is no such I/O APIC.
+ */
+static
+uint32_t find_ioapic(uint8_t id)
+{
+	if (id == MP_ALL_IOAPICS)
+	{
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < num_ioapics; ++i)
+	{
+		if (ioapics[i].id == id)
+		{
+			return i;
+		}
+	}
+
+	return num_ioapics;
+}
+
+/* Whether a bus type string, padded with blanks, starts with 'type'.
+ */
+static
+bool is_bus_type(uint8_t bus_id, const char* type)
+{
+	const BusEntry* buses = get_bus_entries();
+	for (uint32_t i = 0; i < get_bus_entry_count(); ++i)
+	{
+		if (buses[i].bus_id != bus_id)
+		{
+			continue;
+		}
+
+		const char* str = buses[i].bus_type_str;
+		uint32_t c = 0;
+		for (; type[c] != '\0' && c < sizeof(buses[i].bus_type_str); ++c)
+		{
+			if (str[c] != type[c])
+			{
+				return false;
+			}
+		}
+
+		return c == sizeof(buses[i].bus_type_str) || str[c] == ' ';
+	}
+
+	return false;
+}
+
+/* Fill in the route of a GSI. A pin shared by several sources keeps the
+ * vector it already has.
+ *
+ * Params:
+ *   gsi    - Pin to route
+ *   isa    - ISA IRQ connected to it, or NO_GSI for other buses
+ *   flags  - Trigger mode and polarity of the redirection entry
+ */
+static
+void add_route(uint32_t gsi, uint8_t isa, uint32_t flags)
+{
+	Route* route = &routes[gsi];
+	if (route->vector == 0)
+	{
+		if (isa != NO_GSI)
+		{
+			route->vector = isa_vectors[isa];
+		}
+		else
+		{
+			if (next_device_vector == IOAPIC_DEVICE_VECTOR_END)
+			{
+				panic("Out of I/O APIC device vectors");
+			}
+			route->vector = next_device_vector++;
+		}
+
+		// ISA devices are serviced from boot, the rest once a driver
+		// unmasks them
+		route->masked = isa == NO_GSI;
+	}
+
+	route->flags = flags;
+	route->dest = apic_id();
+
+	for (uint32_t i = 0; i < num_ioapics; ++i)
+	{
+		const IOAPIC* ioapic = &ioapics[i];
+		if (gsi >= ioapic->gsi_base && gsi < ioapic->gsi_base + ioapic->num_pins)
+		{
+			route->ioapic = i;
+			route->pin = gsi - ioapic->gsi_base;
+		}
+	}
+
+	if (isa != NO_GSI)
+	{
+		isa_gsi[isa] = gsi;
+	}
+
+	log_debug(IOAPIC, "GSI %d: vector 0x%x, flags 0x%x, ISA IRQ %d\n",
+			gsi, route->vector, flags, isa);
+}
+
+/* Redirection entry flags of an interrupt assignment or override, where
+ * 'conforms' means the default of the source bus.
+ */
+static
+uint32_t entry_flags(uint16_t mp_flags, bool isa)
+{
+	uint32_t flags = 0;
+
+	const uint8_t polarity = mp_flags & MP_POLARITY_MASK;
+	if (polarity == MP_POLARITY_LOW || (polarity != MP_POLARITY_HIGH && !isa))
+	{
+		flags |= ACTIVE_LOW;
+	}
+
+	const uint8_t trigger = mp_flags & MP_TRIGGER_MASK;
+	if (trigger == MP_TRIGGER_LEVEL || (trigger != MP_TRIGGER_EDGE && !isa))
+	{
+		flags |= LEVEL_TRIGGER;
+	}
+
+	return flags;
+}
+
+/* Route the pins listed in the I/O interrupt assignment entries. Only
+ * vectored interrupts are routed, the 8259A is disabled so the ExtINT
+ * pin is left masked.
+ */
+static
+void route_mp_entries(void)
+{
+	const IOIntEntry* entries = get_ioint_entries();
+	for (uint32_t i = 0; i < get_ioint_entry_count(); ++i)
+	{
+		const IOIntEntry* entry = &entries[i];
+		if (entry->interrupt_type != MP_INT_TYPE_INT)
+		{
+			continue;
+		}
+
+		const uint32_t index = find_ioapic(entry->dst_ioapic_id);
+		if (index == num_ioapics || entry->dst_ioapic_int >= ioapics[index].num_pins)
+		{
+			log_warn(IOAPIC, "Interrupt entry for unknown I/O APIC %d pin %d\n",
+					entry->dst_ioapic_id, entry->dst_ioapic_int);
+			continue;
+		}
+
+		const uint32_t gsi = ioapics[index].gsi_base + entry->dst_ioapic_int;
+		if (gsi >= num_gsis)
+		{
+			continue;
+		}
+
+		const bool isa = (is_bus_type(entry->src_bus_id, "ISA") ||
+				is_bus_type(entry->src_bus_id, "EISA")) &&
+			entry->src_bus_irq < IOAPIC_ISA_IRQS;
+
+		add_route(gsi, isa ? entry->src_bus_irq : NO_GSI, entry_flags(entry->flags, isa));
+	}
+}
+
+/* Route the ISA IRQs the MADT overrides.
+ */
+static
+void route_overrides(const Topology* topo)
+{
+	for (uint32_t i = 0; i < topo->num_overrides; ++i)
+	{
+		const TopologyOverride* o = &topo->overrides[i];
+		if (o->gsi >= num_gsis || o->isa_irq >= IOAPIC_ISA_IRQS)
+		{
+			log_warn(IOAPIC, "Ignoring override of IRQ %d to GSI %d\n", o->isa_irq, o->gsi);
+			continue;
+		}
+
+		add_route(o->gsi, o->isa_irq, entry_flags(o->flags, true));
+	}
+}
+
+/* The route of an IRQ, NULL if it is not routed.
+ */
+static
+Route* find_route(uint8_t irq)
+{
+	const uint8_t gsi = irq < IOAPIC_ISA_IRQS ? isa_gsi[irq] : irq;
+	if (gsi >= num_gsis || routes[gsi].vector == 0)
+	{
+		return NULL;
+	}
+
+	return &routes[gsi];
+}
+
+void ioapic_init()
+{
+	const Topology* topo = topology();
+	for (uint32_t i = 0; i < topo->num_ioapics; ++i)
+	{
+		const TopologyIOAPIC* ti = &topo->ioapics[i];
+		add_ioapic(ti->id, ti->address, ti->gsi_base);
+	}
+
+	if (num_ioapics == 0)
+	{
+		panic("No I/O APICs found!");
+	}
+
+	memset(isa_gsi, NO_GSI, sizeof(isa_gsi));
+	if (topo->from_acpi)
+	{
+		route_overrides(topo);
+	}
+	else
+	{
+		route_mp_entries();
+	}
+
+	// ISA IRQs the tables do not mention are identity mapped, unless
+	// their pin is taken by another source
+	for (uint8_t irq = 0; irq < IOAPIC_ISA_IRQS; ++irq)
+	{
+		if (isa_gsi[irq] == NO_GSI && irq != ISA_CASCADE_IRQ &&
+				irq < num_gsis && routes[irq].vector == 0)
+		{
+			add_route(irq, irq, 0);
+		}
+	}
+
+	for (uint32_t gsi = 0; gsi < num_gsis; ++gsi)
+	{
+		if (routes[gsi].vector != 0)
+		{
+			write_route(&routes[gsi]);
+		}
+	}
+
+	log_debug(IOAPIC, "Done redirecting interrupts\n");
+}
+
+void ioapic_set_masked(uint8_t irq, bool masked)
+{
+	Route* route = find_route(irq);
+	ASSERT(route != NULL);
+
+	Spinlock* lock = &ioapics[route->ioapic].lock;
+	const uint64_t flags = spin_lock_irqsave(lock);
+	route->masked = masked;
+	ioapic_write32(route->ioapic, redir_reg(route), redir_low(route));
+	spin_unlock_irqrestore(lock, flags);
+}
+
+void ioapic_set_affinity(uint8_t irq, uint32_t apic_id)
+{
+	// Physical destination mode has 8 bits for the ID, higher x2APIC
+	// IDs need interrupt remapping
+	ASSERT(apic_id <= 0xFF);
+
+	Route* route = find_route(irq);
+	ASSERT(route != NULL);
+
+	Spinlock* lock = &ioapics[route->ioapic].lock;
+	const uint64_t flags = spin_lock_irqsave(lock);
+	route->dest = apic_id;
+	ioapic_write32(route->ioapic, redir_reg(route) + 1, apic_id << 24);
+	spin_unlock_irqrestore(lock, flags);
+}
+
+uint8_t ioapic_irq_vector(uint8_t irq)
+{
+	const Route* route = find_route(irq);
+	return route != NULL ? route->vector : 0;
+}
@@ -1,8 +1,51 @@
 #ifndef __X86_64_INTERRUPTS_IOAPIC_H__
 #define __X86_64_INTERRUPTS_IOAPIC_H__
 
-/* Initialize the I/O APIC
+#include "inttypes.h"
+
+/* IRQ numbers below IOAPIC_ISA_IRQS are ISA IRQs, which the firmware
+ * may connect to any I/O APIC pin. Higher IRQ numbers are global system
+ * interrupts (GSIs), the I/O APIC pins numbered across all I/O APICs.
+ *
+ * ISA IRQs get fixed vectors in the usual priority order, other pins
+ * get vectors from IOAPIC_DEVICE_VECTOR_BASE up and stay masked until
+ * a driver unmasks them.
+ */
+#define IOAPIC_ISA_IRQS 16
+
+#define IOAPIC_DEVICE_VECTOR_BASE 0x60
+#define IOAPIC_DEVICE_VECTOR_END 0x80
+
+/* Initialize the I/O APICs found by topology_init() and route the
+ * interrupts the firmware describes. Every route targets the bootstrap
+ * processor.
  */
 void ioapic_init(void);
 
+/* Mask or unmask an IRQ.
+ *
+ * Params:
+ *   irq    - ISA IRQ or GSI, must be routed
+ *   masked - True to stop the IRQ from being delivered
+ */
+void ioapic_set_masked(uint8_t irq, bool masked);
+
+/* Deliver an IRQ to another CPU.
+ *
+ * Params:
+ *   irq     - ISA IRQ or GSI, must be routed
+ *   apic_id - Local APIC ID of the CPU, below 256
+ */
+void ioapic_set_affinity(uint8_t irq, uint32_t apic_id);
+
+/* The vector an IRQ is delivered on.
+ *
+ * Params:
+ *   irq - ISA IRQ or GSI
+ *
+ * Returns:
+ *   The vector, 0 if the IRQ is not routed.
+ */
+uint8_t ioapic_irq_vector(uint8_t irq);
+
 #endif
@@ -1,6 +1,7 @@
 #include "mptables.h"
 
 #include "panic.h"
+#include "log.h"
 
 static MFPStruct* mfp_struct = NULL;
 
@@ -43,7 +44,7 @@ void parse_mct(const MPConfigTable* mct)
 	const uint8_t* type_ptr = (uint8_t*) (mct + 1);
 	for (uint32_t i = 0; i < entries; ++i)
 	{
-		kprintf("\nEntry: %d - Type: %d\n", i, *type_ptr);
+		log_debug(MPTABLES, "\nEntry: %d - Type: %d\n", i, *type_ptr);
 		switch (*type_ptr)
 		{
 			case PROC_ENT_TYPE:
@@ -54,11 +55,11 @@ void parse_mct(const MPConfigTable* mct)
 						proc_entries = pe;
 					}
 					++proc_entry_count;
-					kprintf("Processor\n");
-					kprintf("LAPIC: %d - VER: %d\n", pe->lapic_id, pe->lapic_ver);
-					kprintf("CPU FLAGS: 0x%x\n", pe->cpu_flags);
-					kprintf("CPU SIG: 0x%x\n", pe->cpu_signature);
-					kprintf("Feature Flags: 0x%x\n", pe->feature_flags);
+					log_debug(MPTABLES, "Processor\n");
+					log_debug(MPTABLES, "LAPIC: %d - VER: %d\n", pe->lapic_id, pe->lapic_ver);
+					log_debug(MPTABLES, "CPU FLAGS: 0x%x\n", pe->cpu_flags);
+					log_debug(MPTABLES, "CPU SIG: 0x%x\n", pe->cpu_signature);
+					log_debug(MPTABLES, "Feature Flags: 0x%x\n", pe->feature_flags);
 					type_ptr += sizeof(ProcEntry);
 				}
 				break;
@@ -70,8 +71,8 @@ void parse_mct(const MPConfigTable* mct)
 						bus_entries = be;
 					}
 					++bus_entry_count;
-					kprintf("BUS Entry\n");
-					kprintf("Bus ID: %d - %l6s\n", be->bus_id, be->bus_type_str);
+					log_debug(MPTABLES, "BUS Entry\n");
+					log_debug(MPTABLES, "Bus ID: %d - %l6s\n", be->bus_id, be->bus_type_str);
 					type_ptr += sizeof(BusEntry);
 				}
 				break;
@@ -83,9 +84,9 @@ void parse_mct(const MPConfigTable* mct)
 						ioapic_entries = ie;
 					}
 					++ioapic_entry_count;
-					kprintf("IOAPIC Entry\n");
-					kprintf("ID: %d - VER: %d - Flags: 0x%x\n", ie->id, ie->version, ie->flags);
-					kprintf("ADDR: 0x%x\n", ie->address);
+					log_debug(MPTABLES, "IOAPIC Entry\n");
+					log_debug(MPTABLES, "ID: %d - VER: %d - Flags: 0x%x\n", ie->id, ie->version, ie->flags);
+					log_debug(MPTABLES, "ADDR: 0x%x\n", ie->address);
 					type_ptr += sizeof(IOAPICEntry);
 				}
 				break;
@@ -97,10 +98,10 @@ void parse_mct(const MPConfigTable* mct)
 						ioint_entries = ie;
 					}
 					++ioint_entry_count;
-					kprintf("IOInt Entry\n");
-					kprintf("Int Type: %d - Flags: 0x%x\n", ie->interrupt_type, ie->flags);
-					kprintf("SRC BUS: %d - SRC BUS IRQ: %d\n", ie->src_bus_id, ie->src_bus_irq);
-					kprintf("DST IO APIC: %d - DST IO INT: %d\n", ie->dst_ioapic_id, ie->dst_ioapic_int);
+					log_debug(MPTABLES, "IOInt Entry\n");
+					log_debug(MPTABLES, "Int Type: %d - Flags: 0x%x\n", ie->interrupt_type, ie->flags);
+					log_debug(MPTABLES, "SRC BUS: %d - SRC BUS IRQ: %d\n", ie->src_bus_id, ie->src_bus_irq);
+					log_debug(MPTABLES, "DST IO APIC: %d - DST IO INT: %d\n", ie->dst_ioapic_id, ie->dst_ioapic_int);
 					type_ptr += sizeof(IOIntEntry);
 				}
 				break;
@@ -112,10 +113,10 @@ void parse_mct(const MPConfigTable* mct)
 						lapicint_entries = le;
 					}
 					++lapicint_entry_count;
-					kprintf("LAPIC Entry\n");
-					kprintf("INT type: %d - Flags: 0x%x\n", le->int_type, le->flags);
-					kprintf("SRC BUS: %d - SRC BUS IRQ: %d\n", le->src_bus_id, le->src_bus_irq);
-					kprintf("DST LAPIC: %d - DST LAPIC INT: %d\n", le->dst_lapic_id, le->dst_lapic_int);
+					log_debug(MPTABLES, "LAPIC Entry\n");
+					log_debug(MPTABLES, "INT type: %d - Flags: 0x%x\n", le->int_type, le->flags);
+					log_debug(MPTABLES, "SRC BUS: %d - SRC BUS IRQ: %d\n", le->src_bus_id, le->src_bus_irq);
+					log_debug(MPTABLES, "DST LAPIC: %d - DST LAPIC INT: %d\n", le->dst_lapic_id, le->dst_lapic_int);
 					type_ptr += sizeof(LAPICIntEntry);
 				}
 				break;
@@ -133,15 +134,16 @@ bool find_mfp_struct()
 	// the EDBA base address needs to be found, this is
 	// typically in address 0x40E
 	volatile const uint16_t* bda = (uint16_t*) 0x40E;
-	kprintf("EDBA Address: 0x%x\n", *bda);
+	log_debug(MPTABLES, "EDBA Address: 0x%x\n", *bda);
 	volatile const uint32_t* edba = (uint32_t*) ((uint64_t)*bda << 4);
-	kprintf("EDBA adjusted: 0x%x\n", edba);
+	log_debug(MPTABLES, "EDBA adjusted: 0x%x\n", edba);
 
 	//assert((uint64_t)edba == 0x9FC00);
 	mfp_struct = NULL;
 
-	// Scan the first 1KiB for the signature
-	for (uint32_t i = 0; i < 256; ++i)
+	// Scan the first 1KiB for the signature, the structure is always
+	// on a 16-byte boundary
+	for (uint32_t i = 0; i < 256; i += 4)
 	{
 		if (edba[i] == MP_SIG)
 		{
@@ -155,7 +157,7 @@ bool find_mfp_struct()
 		// TODO - Hopefully this case isn't all that common
 		// We need to check the top of system physical memory
 		volatile uint16_t* base_mem = (uint16_t*) 0x413;
-		kprintf("Base Memory: 0x%x\n", *base_mem);
+		log_debug(MPTABLES, "Base Memory: 0x%x\n", *base_mem);
 	}
 
 	// TODO if EDBA is undefined, check top of system base memory
@@ -165,7 +167,7 @@ bool find_mfp_struct()
 	{
 		// Need to check the BIOS read-only memory between 0xE0000 and 0xFFFFF
 		volatile const uint32_t* read_only = (uint32_t*) 0xE0000;
-		for (uint32_t i = 0; i < 32768; ++i)
+		for (uint32_t i = 0; i < 32768; i += 4)
 		{
 			if (read_only[i] == MP_SIG)
 			{
@@ -177,14 +179,14 @@ bool find_mfp_struct()
 
 	if (mfp_struct != NULL)
 	{
-		kprintf("Found MP Sig: 0x%x\n", mfp_struct);
-		kprintf("Sig: 0x%x\n", mfp_struct->signature);
-		kprintf("PA Ptr: 0x%x\n", mfp_struct->phys_addr_ptr);
-		kprintf("Len: %d\n", mfp_struct->length);
-		kprintf("Spec Rev: %d\n", mfp_struct->spec_rev);
-		kprintf("Checksum: 0x%x\n", mfp_struct->checksum);
-		kprintf("Feature Info 1: 0x%x\n", mfp_struct->feature_info1);
-		kprintf("Feature Info 2: 0x%x\n", mfp_struct->feature_info2);
+		log_debug(MPTABLES, "Found MP Sig: 0x%x\n", mfp_struct);
+		log_debug(MPTABLES, "Sig: 0x%x\n", mfp_struct->signature);
+		log_debug(MPTABLES, "PA Ptr: 0x%x\n", mfp_struct->phys_addr_ptr);
+		log_debug(MPTABLES, "Len: %d\n", mfp_struct->length);
+		log_debug(MPTABLES, "Spec Rev: %d\n", mfp_struct->spec_rev);
+		log_debug(MPTABLES, "Checksum: 0x%x\n", mfp_struct->checksum);
+		log_debug(MPTABLES, "Feature Info 1: 0x%x\n", mfp_struct->feature_info1);
+		log_debug(MPTABLES, "Feature Info 2: 0x%x\n", mfp_struct->feature_info2);
 
 		// If the phys_addr_ptr field is non-zero then there is a 
 		// configuration table present. Also if the feature_info1
@@ -192,25 +194,25 @@ bool find_mfp_struct()
 		if (mfp_struct->phys_addr_ptr != 0)
 		{
 			MPConfigTable* mct = (MPConfigTable*) (uint64_t) mfp_struct->phys_addr_ptr;
-			kprintf("\n\nSig: 0x%x\n", mct->signature);
-			kprintf("Tbl Len: %d\n", mct->base_length);
-			kprintf("Spec Rev: %d\n", mct->spec_rev);
-			kprintf("Checksum: 0x%x\n", mct->checksum);
-			kprintf("OEM ID: %l8s\n", mct->oem_id);
-			kprintf("PROD ID: %l12s\n", mct->product_id);
-			kprintf("OEM Tbl Ptr: 0x%x\n", mct->oem_table_ptr);
-			kprintf("OEM Tbl Size: %d\n", mct->oem_table_size);
-			kprintf("Entry Count: %d\n", mct->entry_count);
-			kprintf("Apic Loc: 0x%x\n", mct->lapic_addr);
-			kprintf("Ext Tbl Len: %d\n", mct->ext_table_length);
-			kprintf("Ext Tbl Check: %d\n", mct->ext_table_checksum);
+			log_debug(MPTABLES, "\n\nSig: 0x%x\n", mct->signature);
+			log_debug(MPTABLES, "Tbl Len: %d\n", mct->base_length);
+			log_debug(MPTABLES, "Spec Rev: %d\n", mct->spec_rev);
+			log_debug(MPTABLES, "Checksum: 0x%x\n", mct->checksum);
+			log_debug(MPTABLES, "OEM ID: %l8s\n", mct->oem_id);
+			log_debug(MPTABLES, "PROD ID: %l12s\n", mct->product_id);
+			log_debug(MPTABLES, "OEM Tbl Ptr: 0x%x\n", mct->oem_table_ptr);
+			log_debug(MPTABLES, "OEM Tbl Size: %d\n", mct->oem_table_size);
+			log_debug(MPTABLES, "Entry Count: %d\n", mct->entry_count);
+			log_debug(MPTABLES, "Apic Loc: 0x%x\n", mct->lapic_addr);
+			log_debug(MPTABLES, "Ext Tbl Len: %d\n", mct->ext_table_length);
+			log_debug(MPTABLES, "Ext Tbl Check: %d\n", mct->ext_table_checksum);
 			parse_mct(mct);
 
 			return true;
 		}
 		else
 		{
-			kprintf("Failed to find configuration table!\n");
+			log_error(MPTABLES, "Failed to find configuration table!\n");
 		}
 	}
 
@@ -0,0 +1,110 @@
+#include "stats.h"
+
+#include "safety.h"
+#include "support.h"
+#include "kprintf.h"
+#include "klib.h"
+#include "memory/defines.h"
+#include "memory/phys_alloc.h"
+
+COMPILE_ASSERT(sizeof(ISRStats) * MAX_CPUS <= _2_MIB);
+
+ISRStats* isr_stats = NULL;
+
+// TSC at the last reset
+static uint64_t stats_start;
+
+void isr_stats_init()
+{
+	ISRStats* stats = (ISRStats*) phys_alloc_2MIB_safe("Interrupt stats");
+	memclr(stats, sizeof(ISRStats) * MAX_CPUS);
+
+	stats_start = _rdtsc();
+	isr_stats = stats;
+}
+
+void isr_stats_reset()
+{
+	if (isr_stats != NULL)
+	{
+		memclr(isr_stats, sizeof(ISRStats) * MAX_CPUS);
+	}
+	stats_start = _rdtsc();
+}
+
+/* The upper bound of the bucket holding the given percentile.
+ */
+static
+uint64_t percentile(const uint64_t* buckets, uint64_t count, uint32_t pct)
+{
+	const uint64_t rank = (count * pct + 99) / 100;
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < ISR_STATS_BUCKETS; ++i)
+	{
+		seen += buckets[i];
+		if (seen >= rank)
+		{
+			return 2ULL << i;
+		}
+	}
+
+	return 2ULL << (ISR_STATS_BUCKETS - 1);
+}
+
+void isr_stats_dump()
+{
+	if (isr_stats == NULL)
+	{
+		kprintf("ISR stats: not initialized\n");
+		return;
+	}
+
+	const uint64_t elapsed = _rdtsc() - stats_start;
+	kprintf("ISR stats: %d Mcycles\n", elapsed / 1000000);
+
+	for (uint32_t vector = 0; vector < NUM_VECTORS; ++vector)
+	{
+		uint64_t buckets[ISR_STATS_BUCKETS];
+		uint64_t total = 0;
+		for (uint32_t i = 0; i < ISR_STATS_BUCKETS; ++i)
+		{
+			buckets[i] = 0;
+		}
+
+		for (uint32_t cpu = 0; cpu < cpu_count(); ++cpu)
+		{
+			const VectorStats* stats = &isr_stats[cpu].vectors[vector];
+			total += stats->count;
+			for (uint32_t i = 0; i < ISR_STATS_BUCKETS; ++i)
+			{
+				buckets[i] += stats->buckets[i];
+			}
+		}
+
+		if (total == 0)
+		{
+			continue;
+		}
+
+		// Interrupts per million cycles
+		const uint64_t rate = elapsed > 0 ? total * 1000000 / elapsed : 0;
+		kprintf("vector 0x%x: %d total, %d/Mcycle, p50 <%d p99 <%d max <%d cycles\n",
+				(uint64_t)vector, total, rate, percentile(buckets, total, 50),
+				percentile(buckets, total, 99), percentile(buckets, total, 100));
+
+		kprintf("  cpus:");
+		for (uint32_t cpu = 0; cpu < cpu_count(); ++cpu)
+		{
+			kprintf(" %d", isr_stats[cpu].vectors[vector].count);
+		}
+		kprintf("\n  histogram:");
+		for (uint32_t i = 0; i < ISR_STATS_BUCKETS; ++i)
+		{
+			if (buckets[i] > 0)
+			{
+				kprintf(" 2^%d:%d", (int64_t)i, buckets[i]);
+			}
+		}
+		kprintf("\n");
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef __X86_64_INTERRUPTS_STATS_H__
+#define __X86_64_INTERRUPTS_STATS_H__
+
+#include "inttypes.h"
+#include "cpu.h"
+
+/* Per-CPU, per-vector interrupt accounting. Every interrupt that goes
+ * through the common stub path is counted, and the TSC cycles its
+ * handler took are added to a histogram with power of two buckets.
+ */
+
+#define NUM_VECTORS 256
+
+// Bucket n counts handlers that took [2^n, 2^(n+1)) cycles
+#define ISR_STATS_BUCKETS 32
+
+typedef struct
+{
+	uint64_t count;
+	uint32_t buckets[ISR_STATS_BUCKETS];
+} VectorStats;
+
+typedef struct
+{
+	VectorStats vectors[NUM_VECTORS];
+} ISRStats;
+
+// One ISRStats per CPU, NULL until isr_stats_init()
+extern ISRStats* isr_stats;
+
+/* Account one interrupt on the current CPU.
+ *
+ * Params:
+ *   vector - The interrupt vector
+ *   cycles - TSC cycles the handler ran for
+ */
+static inline __attribute__((always_inline))
+void isr_stats_record(uint64_t vector, uint64_t cycles)
+{
+	if (isr_stats == NULL)
+	{
+		return;
+	}
+
+	uint32_t bucket = 63 - __builtin_clzll(cycles | 1);
+	if (bucket >= ISR_STATS_BUCKETS)
+	{
+		bucket = ISR_STATS_BUCKETS - 1;
+	}
+
+	// Only this CPU writes its counters, but an NMI or a nested
+	// interrupt can land between the load and the store of a plain
+	// increment. A single INC with a memory operand cannot be split by
+	// an interrupt and needs no LOCK.
+	VectorStats* stats = &isr_stats[cpu_index()].vectors[vector];
+	__asm__ volatile("incq %0" : "+m"(stats->count));
+	__asm__ volatile("incl %0" : "+m"(stats->buckets[bucket]));
+}
+
+/* Allocate the counters for all MAX_CPUS CPUs and start counting.
+ */
+void isr_stats_init(void);
+
+/* Zero all counters and restart the rate measurement.
+ */
+void isr_stats_reset(void);
+
+/* Print, for every vector that fired since the last reset, its count
+ * per CPU, its rate and the 50th/99th percentile and maximum handler
+ * latency, followed by the non-empty histogram buckets.
+ */
+void isr_stats_dump(void);
+
+#endif
@@ -0,0 +1,184 @@
+#include "topology.h"
+
+#include "acpi/acpi.h"
+#include "mptables.h"
+#include "klib.h"
+#include "log.h"
+
+#define MP_CPU_ENABLED 0x1
+#define MP_IOAPIC_ENABLED 0x1
+
+static Topology topo;
+
+static
+void add_cpu(uint32_t apic_id)
+{
+	for (uint32_t i = 0; i < topo.num_cpus; ++i)
+	{
+		if (topo.apic_ids[i] == apic_id)
+		{
+			return;
+		}
+	}
+
+	if (topo.num_cpus == TOPOLOGY_MAX_CPUS)
+	{
+		log_warn(APIC, "Ignoring CPU with APIC ID %d, too many\n", apic_id);
+		return;
+	}
+
+	topo.apic_ids[topo.num_cpus++] = apic_id;
+}
+
+static
+void add_ioapic(uint8_t id, uint64_t address, uint32_t gsi_base)
+{
+	if (topo.num_ioapics == TOPOLOGY_MAX_IOAPICS)
+	{
+		log_warn(IOAPIC, "Ignoring I/O APIC %d, too many\n", id);
+		return;
+	}
+
+	TopologyIOAPIC* ioapic = &topo.ioapics[topo.num_ioapics++];
+	ioapic->address = address;
+	ioapic->gsi_base = gsi_base;
+	ioapic->id = id;
+}
+
+/* Only enabled processors are brought up. Online capable ones are
+ * disabled until hot-added and are only counted.
+ */
+static
+void add_madt_cpu(uint32_t apic_id, uint32_t flags)
+{
+	if (flags & MADT_ENABLED)
+	{
+		add_cpu(apic_id);
+	}
+	else if (flags & MADT_ONLINE_CAPABLE)
+	{
+		++topo.num_online_capable;
+	}
+}
+
+/* Walk the MADT entries.
+ *
+ * Returns:
+ *   True if the MADT exists.
+ */
+static
+bool parse_madt(void)
+{
+	const MADTHeader* madt = (const MADTHeader*)acpi_find_table(MADT_SIG);
+	if (madt == NULL)
+	{
+		return false;
+	}
+
+	const uint8_t* entry = (const uint8_t*)(madt + 1);
+	const uint8_t* end = (const uint8_t*)madt + madt->header.length;
+	while (entry + 2 <= end && entry[1] >= 2 && entry + entry[1] <= end)
+	{
+		switch (entry[0])
+		{
+			case MADT_LAPIC_TYPE:
+				{
+					const MADTLapicEntry* le = (const MADTLapicEntry*)entry;
+					add_madt_cpu(le->apic_id, le->flags);
+				}
+				break;
+			case MADT_X2APIC_TYPE:
+				{
+					const MADTX2apicEntry* xe = (const MADTX2apicEntry*)entry;
+					add_madt_cpu(xe->x2apic_id, xe->flags);
+				}
+				break;
+			case MADT_IOAPIC_TYPE:
+				{
+					const MADTIOAPICEntry* ie = (const MADTIOAPICEntry*)entry;
+					add_ioapic(ie->id, ie->address, ie->gsi_base);
+				}
+				break;
+			case MADT_OVERRIDE_TYPE:
+				{
+					const MADTOverrideEntry* oe = (const MADTOverrideEntry*)entry;
+					if (topo.num_overrides == TOPOLOGY_MAX_OVERRIDES)
+					{
+						log_warn(IOAPIC, "Ignoring override of IRQ %d, too many\n", oe->source);
+						break;
+					}
+
+					TopologyOverride* o = &topo.overrides[topo.num_overrides++];
+					o->gsi = oe->gsi;
+					o->flags = oe->flags;
+					o->isa_irq = oe->source;
+				}
+				break;
+			default:
+				break;
+		}
+
+		entry += entry[1];
+	}
+
+	return true;
+}
+
+static
+bool parse_mp(void)
+{
+	if (!find_mfp_struct())
+	{
+		return false;
+	}
+
+	const ProcEntry* pe = get_proc_entries();
+	for (uint32_t i = 0; i < get_proc_entry_count(); ++i)
+	{
+		if (pe[i].cpu_flags & MP_CPU_ENABLED)
+		{
+			add_cpu(pe[i].lapic_id);
+		}
+	}
+
+	const IOAPICEntry* ie = get_ioapic_entries();
+	for (uint32_t i = 0; i < get_ioapic_entry_count(); ++i)
+	{
+		if (ie[i].flags & MP_IOAPIC_ENABLED)
+		{
+			add_ioapic(ie[i].id, ie[i].address, TOPOLOGY_GSI_NEXT);
+		}
+	}
+
+	return true;
+}
+
+bool topology_init()
+{
+	topo.from_acpi = parse_madt();
+	if (topo.from_acpi && (topo.num_cpus == 0 || topo.num_ioapics == 0))
+	{
+		log_warn(APIC, "MADT lists no CPUs or I/O APICs, trying the MP tables\n");
+		memclr(&topo, sizeof(topo));
+	}
+
+	if (!topo.from_acpi && !parse_mp())
+	{
+		return false;
+	}
+
+	log_info(APIC, "Topology from %s: %d CPUs, %d I/O APICs, %d overrides\n",
+			topo.from_acpi ? "ACPI MADT" : "MP tables", topo.num_cpus,
+			topo.num_ioapics, topo.num_overrides);
+	if (topo.num_online_capable > 0)
+	{
+		log_info(APIC, "%d online capable CPUs not started\n", topo.num_online_capable);
+	}
+
+	return true;
+}
+
+const Topology* topology()
+{
+	return &topo;
+}
@@ -0,0 +1,67 @@
+#ifndef __X86_64_INTERRUPTS_TOPOLOGY_H__
+#define __X86_64_INTERRUPTS_TOPOLOGY_H__
+
+#include "inttypes.h"
+
+// Limits of the firmware description, not of what the kernel runs on
+#define TOPOLOGY_MAX_CPUS 256
+#define TOPOLOGY_MAX_IOAPICS 8
+#define TOPOLOGY_MAX_OVERRIDES 16
+
+// The I/O APIC's GSIs follow the previous one's, the MP tables do not
+// give a base
+#define TOPOLOGY_GSI_NEXT 0xFFFFFFFF
+
+typedef struct
+{
+	uint64_t address;
+	uint32_t gsi_base;
+	uint8_t id;
+} TopologyIOAPIC;
+
+/* An ISA IRQ that is not wired to the GSI of the same number, or not
+ * with ISA polarity and trigger mode. The flags use the encoding of the
+ * MP interrupt assignment entries.
+ */
+typedef struct
+{
+	uint32_t gsi;
+	uint16_t flags;
+	uint8_t isa_irq;
+} TopologyOverride;
+
+/* Interrupt controllers and CPUs, from the ACPI MADT or, when there is
+ * none, the MP configuration table.
+ */
+typedef struct
+{
+	bool from_acpi;
+
+	// Local APIC IDs of the usable CPUs, in firmware order
+	uint32_t num_cpus;
+	uint32_t apic_ids[TOPOLOGY_MAX_CPUS];
+
+	// Disabled MADT processors that could be hot-added, not in apic_ids
+	uint32_t num_online_capable;
+
+	uint32_t num_ioapics;
+	TopologyIOAPIC ioapics[TOPOLOGY_MAX_IOAPICS];
+
+	// Only from the MADT, the MP tables route every pin explicitly
+	uint32_t num_overrides;
+	TopologyOverride overrides[TOPOLOGY_MAX_OVERRIDES];
+} Topology;
+
+/* Find the CPUs and interrupt controllers. The ACPI MADT is preferred,
+ * the MP tables are used when it is missing.
+ *
+ * Returns:
+ *   True if either table was found.
+ */
+bool topology_init(void);
+
+/* The topology found by topology_init().
+ */
+const Topology* topology(void);
+
+#endif
@@ -1,10 +1,16 @@
 #include "tss.h"
+#include "cpu.h"
 #include "klib.h"
 #include "safety.h"
 #include "inttypes.h"
+#include "memory/defines.h"
+#include "memory/phys_alloc.h"
 
 #define TSS_SEG_64 0x50
 
+// Quadwords in the GDT, see prekernel.s
+#define GDT_QUADS ((TSS_SEG_64 / 8) + 2)
+
 extern uint64_t __KERNEL_STACK_START;
 
 typedef struct
@@ -32,7 +38,13 @@ typedef struct
 	uint16_t io_map_base;
 } __attribute__((packed)) TSS;
 
-static TSS kernel_TSS;
+COMPILE_ASSERT(sizeof(TSS) == 104);
+
+typedef struct
+{
+	uint16_t limit;
+	uint64_t base;
+} __attribute__((packed)) GDT_Pointer;
 
 #define TSS_DESC_DPL0 (0x00 << 1)
 #define TSS_DESC_DPL1 (0x01 << 1)
@@ -42,29 +54,69 @@ static TSS kernel_TSS;
 #define TSS_DESC_P 0x80
 #define TSS_DESC_TYPE_AVAIL 0x9
 
-extern TSS_Descriptor tss_seg_64;
+// The boot GDT, copied for every CPU
+extern uint64_t start_gdt_64[GDT_QUADS];
 
-void tss_init()
+static uint64_t cpu_gdt[MAX_CPUS][GDT_QUADS] __attribute__((aligned(16)));
+static TSS cpu_tss[MAX_CPUS] __attribute__((aligned(16)));
+
+// IST stacks of every CPU, IST_COUNT per CPU, from one 2MiB frame
+static uint8_t* ist_stacks = NULL;
+
+COMPILE_ASSERT(MAX_CPUS * IST_COUNT * IST_STACK_SIZE <= _2_MIB);
+
+void tss_init_cpu(uint64_t kernel_stack)
 {
-	// Setup the kernel TSS
-	const uint64_t tss_base = (uint64_t)&kernel_TSS;
-	const uint64_t tss_limit = sizeof(TSS);
-
-	tss_seg_64.limit = tss_limit & 0xFF;
-	tss_seg_64.base1 = tss_base & 0xFFFF;
-	tss_seg_64.base2 = (tss_base & 0xFF0000) >> 16;
-	tss_seg_64.flags = TSS_DESC_P | TSS_DESC_DPL0 | TSS_DESC_TYPE_AVAIL;
-	tss_seg_64.limit2 = (tss_limit & 0xF0000) >> 16;
-	tss_seg_64.base3 = (tss_base & 0xFF000000) >> 24;
-	tss_seg_64.base4 = (tss_base & 0xFFFFFFFF00000000) >> 32;
-	tss_seg_64.reserved = 0;
-
-	memclr(&kernel_TSS, sizeof(kernel_TSS));
-	kernel_TSS.io_map_base = 104;
-	kernel_TSS.rsp[0] = (uint64_t)&__KERNEL_STACK_START;
-	kernel_TSS.ist[0] = (uint64_t)&__KERNEL_STACK_START;
+	const uint32_t index = cpu_index();
+
+	if (ist_stacks == NULL)
+	{
+		ist_stacks = (uint8_t*) phys_alloc_2MIB_safe("IST stacks");
+	}
+
+	TSS* tss = &cpu_tss[index];
+	memclr(tss, sizeof(TSS));
+	tss->io_map_base = sizeof(TSS);
+	tss->rsp[0] = kernel_stack;
+
+	uint8_t* stacks = ist_stacks + index * IST_COUNT * IST_STACK_SIZE;
+	for (uint32_t i = 0; i < IST_COUNT; ++i)
+	{
+		// ist[0] is IST1
+		tss->ist[i] = (uint64_t)(stacks + (i + 1) * IST_STACK_SIZE);
+	}
+
+	uint64_t* gdt = cpu_gdt[index];
+	for (uint32_t i = 0; i < GDT_QUADS; ++i)
+	{
+		gdt[i] = start_gdt_64[i];
+	}
+
+	const uint64_t tss_base = (uint64_t)tss;
+	const uint64_t tss_limit = sizeof(TSS) - 1;
+
+	TSS_Descriptor* desc = (TSS_Descriptor*)&gdt[TSS_SEG_64 / 8];
+	desc->limit = tss_limit & 0xFFFF;
+	desc->base1 = tss_base & 0xFFFF;
+	desc->base2 = (tss_base & 0xFF0000) >> 16;
+	desc->flags = TSS_DESC_P | TSS_DESC_DPL0 | TSS_DESC_TYPE_AVAIL;
+	desc->limit2 = (tss_limit & 0xF0000) >> 16;
+	desc->base3 = (tss_base & 0xFF000000) >> 24;
+	desc->base4 = (tss_base & 0xFFFFFFFF00000000) >> 32;
+	desc->reserved = 0;
+
+	// The other descriptors are the same as before, so the segment
+	// registers (and the GS base) can stay as they are
+	GDT_Pointer pointer;
+	pointer.limit = sizeof(cpu_gdt[0]) - 1;
+	pointer.base = (uint64_t)gdt;
+	__asm__ volatile("lgdt %0" :: "m"(pointer));
 
 	// Load the TSS
-	__asm__ volatile ("movw $" SX(TSS_SEG_64)  ", %ax");
-	__asm__ volatile ("ltr %ax");
+	__asm__ volatile("ltr %w0" :: "r"(TSS_SEG_64));
+}
+
+void tss_init()
+{
+	tss_init_cpu((uint64_t)&__KERNEL_STACK_START);
 }
@@ -1,11 +1,31 @@
 #ifndef __X86_64_INTERRUPTS_TSS_H__
 #define __X86_64_INTERRUPTS_TSS_H__
 
-/* Initialize the Task-State-Segment needed for 64-bit operation.
- * There will only be one used, and will most likely not be changed
- * after this initialization process as different privilege levels
- * won't be used.
+#include "inttypes.h"
+
+/* Interrupt stack table slots. Vectors that can arrive at any moment,
+ * even in the middle of switching stacks or while the current stack is
+ * bad, always run on a known good stack of their own. Every CPU has
+ * its own set of these stacks in its own TSS.
+ */
+#define IST_NMI 1
+#define IST_DOUBLE_FAULT 2
+#define IST_MACHINE_CHECK 3
+#define IST_COUNT 3
+
+#define IST_STACK_SIZE 0x4000
+
+/* Give the bootstrap processor its own GDT and Task-State-Segment.
  */
 void tss_init(void);
 
+/* Set up a GDT and TSS for the CPU this runs on, with its IST stacks,
+ * and load them. Privilege levels are not used, so the TSS is only
+ * needed for the IST.
+ *
+ * Params:
+ *   kernel_stack - Top of the CPU's kernel stack, used as RSP0
+ */
+void tss_init_cpu(uint64_t kernel_stack);
+
 #endif
@@ -1,9 +1,228 @@
 #include "klib.h"
+#include "cpuid.h"
+#include "kprintf.h"
+#include "log.h"
+#include "support.h"
+
+#ifdef BENCH_KLIB
+#include "memory/phys_alloc.h"
+#include "memory/defines.h"
+#endif
+
+// Smallest size the vector variants accept
+#define VECTOR_MIN_SIZE 128
+
+// Without FSRM rep movsb has a startup cost that only pays off above this
+#define ERMS_MIN_SIZE 128
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+#define CR4_OSXSAVE (1 << 18)
+
+// XCR0 bits for x87, SSE and AVX state
+#define XCR0_AVX_STATE 0x7
+
+// CPUID feature bits
+#define CPUID_1_EDX_SSE2 (1 << 26)
+#define CPUID_1_ECX_XSAVE (1 << 26)
+#define CPUID_1_ECX_AVX (1 << 28)
+#define CPUID_7_EBX_AVX2 (1 << 5)
+#define CPUID_7_EBX_ERMS (1 << 9)
+#define CPUID_7_EDX_FSRM (1 << 4)
+
+// Defined in memops.S
+extern void* memcpy_erms(void* dst, const void* src, uint64_t size);
+extern void memset_erms(void* ptr, uint8_t val, uint64_t size);
+extern void* memcpy_sse2(void* dst, const void* src, uint64_t size);
+extern void memset_sse2(void* ptr, uint8_t val, uint64_t size);
+extern void* memcpy_avx2(void* dst, const void* src, uint64_t size);
+extern void memset_avx2(void* ptr, uint8_t val, uint64_t size);
+
+/* One set of memory routines. Sizes below min_size always use the
+ * generic code.
+ */
+typedef struct
+{
+	const char* name;
+	void* (*copy)(void*, const void*, uint64_t);
+	void (*set)(void*, uint8_t, uint64_t);
+	uint64_t min_size;
+} MemOps;
+
+static void memclr_generic(void* ptr, uint64_t size);
+static void memset_generic(void* ptr, uint8_t val, uint64_t size);
+static void* memcpy_generic(void* dst, const void* src, uint64_t size);
+
+enum { OPS_GENERIC, OPS_ERMS, OPS_SSE2, OPS_AVX2, NUM_OPS };
+
+static MemOps ops_table[NUM_OPS] =
+{
+	{ "generic", memcpy_generic, memset_generic, (uint64_t)-1 },
+	{ "erms",    memcpy_erms,    memset_erms,    ERMS_MIN_SIZE },
+	{ "sse2",    memcpy_sse2,    memset_sse2,    VECTOR_MIN_SIZE },
+	{ "avx2",    memcpy_avx2,    memset_avx2,    VECTOR_MIN_SIZE },
+};
+
+// Which variants this CPU can run
+static bool ops_supported[NUM_OPS] = { true, false, false, false };
+
+static const MemOps* ops = &ops_table[OPS_GENERIC];
+
+static inline
+uint64_t read_cr0(void)
+{
+	uint64_t cr0;
+	__asm__ volatile("movq %%cr0, %0" : "=r"(cr0));
+	return cr0;
+}
+
+static inline
+uint64_t read_cr4(void)
+{
+	uint64_t cr4;
+	__asm__ volatile("movq %%cr4, %0" : "=r"(cr4));
+	return cr4;
+}
+
+/* SSE instructions fault until the OS says it saves their state.
+ */
+static
+void enable_sse(void)
+{
+	uint64_t cr0 = read_cr0();
+	cr0 = (cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP;
+	__asm__ volatile("movq %0, %%cr0" :: "r"(cr0));
+
+	const uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+	__asm__ volatile("movq %0, %%cr4" :: "r"(cr4));
+}
+
+/* AVX also needs XSAVE enabled and the AVX state turned on in XCR0.
+ */
+static
+void enable_avx(void)
+{
+	const uint64_t cr4 = read_cr4() | CR4_OSXSAVE;
+	__asm__ volatile("movq %0, %%cr4" :: "r"(cr4));
+	__asm__ volatile("xsetbv" :: "c"(0), "a"(XCR0_AVX_STATE), "d"(0));
+}
+
+void klib_init()
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid_count(0, 0, &eax, &ebx, &ecx, &edx);
+	const uint32_t max_leaf = eax;
+
+	cpuid_count(1, 0, &eax, &ebx, &ecx, &edx);
+	const uint32_t features_ecx = ecx;
+	const uint32_t features_edx = edx;
+
+	uint32_t ext_ebx = 0, ext_edx = 0;
+	if (max_leaf >= 7)
+	{
+		cpuid_count(7, 0, &eax, &ext_ebx, &ecx, &ext_edx);
+	}
+
+	if (ext_ebx & CPUID_7_EBX_ERMS)
+	{
+		ops_supported[OPS_ERMS] = true;
+		if (ext_edx & CPUID_7_EDX_FSRM)
+		{
+			ops_table[OPS_ERMS].min_size = 0;
+		}
+	}
+
+	if (features_edx & CPUID_1_EDX_SSE2)
+	{
+		enable_sse();
+		ops_supported[OPS_SSE2] = true;
+	}
+
+	if (ops_supported[OPS_SSE2] && (ext_ebx & CPUID_7_EBX_AVX2) &&
+			(features_ecx & CPUID_1_ECX_XSAVE) && (features_ecx & CPUID_1_ECX_AVX))
+	{
+		cpuid_count(0xD, 0, &eax, &ebx, &ecx, &edx);
+		if ((eax & XCR0_AVX_STATE) == XCR0_AVX_STATE)
+		{
+			enable_avx();
+			ops_supported[OPS_AVX2] = true;
+		}
+	}
+
+	// rep movsb is as fast as the vector loops on ERMS parts, and needs
+	// no registers saved
+	if (ops_supported[OPS_ERMS])
+	{
+		ops = &ops_table[OPS_ERMS];
+	}
+	else if (ops_supported[OPS_AVX2])
+	{
+		ops = &ops_table[OPS_AVX2];
+	}
+	else if (ops_supported[OPS_SSE2])
+	{
+		ops = &ops_table[OPS_SSE2];
+	}
+
+	log_info(KLIB, "klib: %s memory routines\n", ops->name);
+}
+
+void klib_init_cpu()
+{
+	if (ops_supported[OPS_SSE2])
+	{
+		enable_sse();
+	}
+
+	if (ops_supported[OPS_AVX2])
+	{
+		enable_avx();
+	}
+}
 
 void memclr(void* ptr, uint64_t size)
+{
+	if (size >= ops->min_size)
+	{
+		ops->set(ptr, 0, size);
+	}
+	else
+	{
+		memclr_generic(ptr, size);
+	}
+}
+
+void memset(void* ptr, const uint8_t val, uint64_t size)
+{
+	if (size >= ops->min_size)
+	{
+		ops->set(ptr, val, size);
+	}
+	else
+	{
+		memset_generic(ptr, val, size);
+	}
+}
+
+void* memcpy(void* dst, const void* src, uint64_t size)
+{
+	if (size >= ops->min_size)
+	{
+		return ops->copy(dst, src, size);
+	}
+
+	return memcpy_generic(dst, src, size);
+}
+
+
+static
+void memclr_generic(void* ptr, uint64_t size)
 {
 	uint8_t* p8 = (uint8_t*)ptr;
-	while (((uint64_t)p8 & 0x7) != 0)
+	while (size > 0 && ((uint64_t)p8 & 0x7) != 0)
 	{
 		*p8++ = 0;
 		--size;
@@ -27,17 +246,18 @@ void memclr(void* ptr, uint64_t size)
 	}
 }
 
-void memset(void* ptr, const uint8_t val, uint64_t size)
+static
+void memset_generic(void* ptr, uint8_t val, uint64_t size)
 {
 	uint8_t* p8 = (uint8_t*)ptr;
-	while (((uint64_t)p8 & 0x7) != 0)
+	while (size > 0 && ((uint64_t)p8 & 0x7) != 0)
 	{
 		*p8++ = val;
 		--size;
 	}
 
 	uint64_t* p64 = (uint64_t*)p8;
-	uint64_t value = (val << 8) | val;
+	uint64_t value = ((uint64_t)val << 8) | val;
 	value |= value << 16;
 	value |= value << 32;
 	while (size >= 8)
@@ -57,11 +277,12 @@ void memset(void* ptr, const uint8_t val, uint64_t size)
 	}
 }
 
-void* memcpy(void* dst, const void* src, uint64_t size)
+static
+void* memcpy_generic(void* dst, const void* src, uint64_t size)
 {
 	uint8_t* d8 = (uint8_t*)dst;
 	const uint8_t* s8 = (const uint8_t*)src;
-	while (((uint64_t)d8 & 0x7) != 0)
+	while (size > 0 && ((uint64_t)d8 & 0x7) != 0)
 	{
 		*d8++ = *s8++;
 		--size;
@@ -88,3 +309,55 @@ void* memcpy(void* dst, const void* src, uint64_t size)
 
 	return dst;
 }
+
+#ifdef BENCH_KLIB
+// Bytes moved per size and variant, so every size runs for a while
+#define BENCH_BYTES (8 * _1_MIB)
+
+void klib_benchmark()
+{
+	static const uint64_t sizes[] =
+	{
+		16, 64, 256, _1_KIB, 4*_1_KIB, 16*_1_KIB, 64*_1_KIB, 256*_1_KIB, _2_MIB
+	};
+
+	uint8_t* src = (uint8_t*) phys_alloc_2MIB_safe("klib bench src");
+	uint8_t* dst = (uint8_t*) phys_alloc_2MIB_safe("klib bench dst");
+
+	for (uint32_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i)
+	{
+		const uint64_t size = sizes[i];
+		const uint64_t iterations = size < BENCH_BYTES / 8 ? BENCH_BYTES / size : 8;
+
+		kprintf("klib bench %dB:", size);
+		for (uint32_t v = 0; v < NUM_OPS; ++v)
+		{
+			const MemOps* bench_ops = &ops_table[v];
+			if (!ops_supported[v] || (v != OPS_GENERIC && size < bench_ops->min_size))
+			{
+				continue;
+			}
+
+			uint64_t start = _rdtsc();
+			for (uint64_t it = 0; it < iterations; ++it)
+			{
+				bench_ops->copy(dst, src, size);
+			}
+			const uint64_t copy_cycles = (_rdtsc() - start) / iterations;
+
+			start = _rdtsc();
+			for (uint64_t it = 0; it < iterations; ++it)
+			{
+				bench_ops->set(dst, (uint8_t)it, size);
+			}
+			const uint64_t set_cycles = (_rdtsc() - start) / iterations;
+
+			kprintf(" %s cpy %d set %d", bench_ops->name, copy_cycles, set_cycles);
+		}
+		kprintf(" cycles\n");
+	}
+
+	phys_free_2MIB(src);
+	phys_free_2MIB(dst);
+}
+#endif
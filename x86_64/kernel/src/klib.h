@@ -22,6 +22,17 @@ uint64_t clamp(uint64_t val, uint64_t min, uint64_t max)
 	return val;
 }
 
+/* Pick the fastest memclr/memset/memcpy variants for this CPU from
+ * CPUID, and enable SSE/AVX if the chosen variants need them. Until it
+ * is called the generic versions are used.
+ */
+void klib_init(void);
+
+/* Enable on an application processor what klib_init() enabled on the
+ * bootstrap processor, so it can run the same variants.
+ */
+void klib_init_cpu(void);
+
 /* Zero out a region of memory
  *
  * Parameters:
@@ -52,4 +63,11 @@ void memset(void* ptr, uint8_t val, uint64_t size);
  */
 void* memcpy(void* dst, const void* src, uint64_t size);
 
+#ifdef BENCH_KLIB
+/* Time every supported variant across sizes from 16B to 2MiB. Needs the
+ * physical allocator.
+ */
+void klib_benchmark(void);
+#endif
+
 #endif
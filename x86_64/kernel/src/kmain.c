@@ -1,22 +1,75 @@
+#include "cpu.h"
+#include "memory/color.h"
 #include "memory/init.h"
+#include "memory/objcache.h"
+#include "memory/tlb.h"
 #include "interrupts/init.h"
 #include "textmode.h"
-#include "kprintf.h"
+#include "log.h"
+#include "klib.h"
+#include "serial.h"
+#include "bench/bench.h"
+#include "trace/trace.h"
+#include "interrupts/stats.h"
+#include "timer/timer.h"
+#include "smp/smp.h"
+#include "sync/spinlock.h"
+#include "thread/thread.h"
 
 extern int __KERNEL_ALL_LO;
 extern int __KERNEL_ALL_HI;
 
 void kmain(void)
 {
+	cpu_init_bsp();
+	init_serial_debug();
+
 	clear_screen();
-	kprintf("Entered kmain\n");
-	kprintf("KERNEL ALL LO: 0x%x\n", &__KERNEL_ALL_LO);
-	kprintf("KERNEL ALL HI: 0x%x\n", &__KERNEL_ALL_HI);
+	klib_init();
+	log_info(KERNEL, "Entered kmain\n");
+	log_debug(KERNEL, "KERNEL ALL LO: 0x%x\n", &__KERNEL_ALL_LO);
+	log_debug(KERNEL, "KERNEL ALL HI: 0x%x\n", &__KERNEL_ALL_HI);
 
 	memory_init();
+#ifdef TRACE_KERNEL
+	trace_init();
+#endif
+#ifdef BENCH_KLIB
+	klib_benchmark();
+#endif
 	interrupts_init();
+	tlb_init();
+	timer_init();
+	thread_init();
+	smp_init();
+#ifdef TRACE_KERNEL
+	// Rings for the CPUs that just came online
+	trace_init();
+#endif
+#ifdef BENCH_OBJCACHE
+	objcache_benchmark();
+#endif
+#ifdef BENCH_PAGE_COLORING
+	color_benchmark();
+#endif
 
 	__asm__("sti");
 
-	while(1) { __asm__("hlt"); }
+#ifdef BENCH_KERNEL
+	bench_run_all();
+	isr_stats_dump();
+	lock_stats_dump();
+	bench_exit_qemu(0);
+#endif
+
+	// Output since the last line break only reaches the screen on a
+	// flush. Interrupts wake the idle loop, anything they printed is
+	// flushed before halting again. STI holds off interrupts for one
+	// more instruction, so none slips in between.
+	for (;;)
+	{
+		__asm__ volatile("cli" ::: "memory");
+		text_mode_flush();
+		__asm__ volatile("sti\n\thlt" ::: "memory");
+	}
 }
@@ -4,6 +4,7 @@
 #include "inttypes.h"
 #include "serial.h"
 #include "textmode.h"
+#include "sync/spinlock.h"
 
 #define BUFFER_LEN 21
 
@@ -13,12 +14,57 @@ static int64_t  convert_radix(char buf[static BUFFER_LEN], uint8_t radix, uint64
 static int64_t  convert_decimal(char buf[static BUFFER_LEN], int64_t value);
 static uint64_t string_length(const char* str);
 
+#ifndef HOST_BUILD
+#define NO_OWNER ((uint32_t)-1)
+
+// Keeps the messages of different CPUs from interleaving, and covers
+// the text console
+static Spinlock print_lock;
+
+// CPU holding print_lock, so a panic or fault in the middle of a
+// message can still print
+static volatile uint32_t print_owner = NO_OWNER;
+#endif
+
+ConsoleLock console_lock()
+{
+	ConsoleLock state;
+	state.flags = lock_irq_save();
+#ifdef HOST_BUILD
+	state.nested = true;
+#else
+	state.nested = print_owner == cpu_index();
+	if (!state.nested)
+	{
+		spin_lock(&print_lock);
+		print_owner = cpu_index();
+	}
+#endif
+	return state;
+}
+
+void console_unlock(ConsoleLock state)
+{
+#ifndef HOST_BUILD
+	if (!state.nested)
+	{
+		print_owner = NO_OWNER;
+		spin_unlock(&print_lock);
+	}
+#endif
+	lock_irq_restore(state.flags);
+}
+
 void kprintf(const char* format, ...)
 {
+	const ConsoleLock state = console_lock();
+
 	va_list ap;
 	va_start(ap, format);
 	_kprintf(format, ap);
 	va_end(ap);
+
+	console_unlock(state);
 }
 
 static void write_char(char c)
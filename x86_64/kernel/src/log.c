@@ -0,0 +1,12 @@
+#include "log.h"
+#include "safety.h"
+
+#define LOG_DEFAULT(SUBSYSTEM) LOG_MAX_##SUBSYSTEM,
+uint8_t log_levels[LOG_NUM_SUBSYSTEMS] = { LOG_SUBSYSTEMS(LOG_DEFAULT) };
+#undef LOG_DEFAULT
+
+void log_set_level(LogSubsystem subsystem, uint8_t level)
+{
+	ASSERT(subsystem < LOG_NUM_SUBSYSTEMS && level <= LOG_LEVEL_DEBUG);
+	log_levels[subsystem] = level;
+}
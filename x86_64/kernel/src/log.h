@@ -0,0 +1,126 @@
+#ifndef __X86_64_LOG_H__
+#define __X86_64_LOG_H__
+
+#include "inttypes.h"
+#include "kprintf.h"
+
+/* Leveled logging on top of kprintf(), filtered per subsystem.
+ *
+ *   log_info(NUMA, "NUMA: %d node(s)\n", count);
+ *
+ * Each subsystem has a build-time level, LOG_MAX_<SUBSYSTEM>, which
+ * defaults to LOG_MAX. Messages above it are compiled out together
+ * with their format strings. The rest are checked against the runtime
+ * level of the subsystem, one load and branch, and only formatted when
+ * they pass. The runtime level starts at the build-time level and can
+ * be lowered with log_set_level().
+ *
+ * For example to see the MP table dump build with
+ *
+ *   -DLOG_MAX_MPTABLES=LOG_LEVEL_DEBUG
+ */
+
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_MAX
+#define LOG_MAX LOG_LEVEL_INFO
+#endif
+
+// Every subsystem, each needs a LOG_MAX_ default below
+#define LOG_SUBSYSTEMS(X) \
+	X(KERNEL) \
+	X(KLIB) \
+	X(MMAP) \
+	X(PAGING) \
+	X(PHYS_ALLOC) \
+	X(NUMA) \
+	X(COLOR) \
+	X(ACPI) \
+	X(MPTABLES) \
+	X(APIC) \
+	X(IOAPIC) \
+	X(TIMER) \
+	X(SMP)
+
+#ifndef LOG_MAX_KERNEL
+#define LOG_MAX_KERNEL LOG_MAX
+#endif
+#ifndef LOG_MAX_KLIB
+#define LOG_MAX_KLIB LOG_MAX
+#endif
+#ifndef LOG_MAX_MMAP
+#define LOG_MAX_MMAP LOG_MAX
+#endif
+#ifndef LOG_MAX_PAGING
+#define LOG_MAX_PAGING LOG_MAX
+#endif
+#ifndef LOG_MAX_PHYS_ALLOC
+#define LOG_MAX_PHYS_ALLOC LOG_MAX
+#endif
+#ifndef LOG_MAX_NUMA
+#define LOG_MAX_NUMA LOG_MAX
+#endif
+#ifndef LOG_MAX_COLOR
+#define LOG_MAX_COLOR LOG_MAX
+#endif
+#ifndef LOG_MAX_ACPI
+#define LOG_MAX_ACPI LOG_MAX
+#endif
+#ifndef LOG_MAX_MPTABLES
+#define LOG_MAX_MPTABLES LOG_MAX
+#endif
+#ifndef LOG_MAX_APIC
+#define LOG_MAX_APIC LOG_MAX
+#endif
+#ifndef LOG_MAX_IOAPIC
+#define LOG_MAX_IOAPIC LOG_MAX
+#endif
+#ifndef LOG_MAX_TIMER
+#define LOG_MAX_TIMER LOG_MAX
+#endif
+#ifndef LOG_MAX_SMP
+#define LOG_MAX_SMP LOG_MAX
+#endif
+
+#define LOG_ID(SUBSYSTEM) LOG_SUB_##SUBSYSTEM,
+typedef enum
+{
+	LOG_SUBSYSTEMS(LOG_ID)
+	LOG_NUM_SUBSYSTEMS
+} LogSubsystem;
+#undef LOG_ID
+
+// Runtime level of each subsystem, indexed by LogSubsystem
+extern uint8_t log_levels[LOG_NUM_SUBSYSTEMS];
+
+/* Print a message if LEVEL passes both thresholds of SUBSYSTEM. The
+ * build-time test is a constant, so a failing message leaves no code.
+ */
+#define LOG(SUBSYSTEM, LEVEL, ...) \
+	do { \
+		if ((LEVEL) <= LOG_MAX_##SUBSYSTEM && \
+				(LEVEL) <= log_levels[LOG_SUB_##SUBSYSTEM]) \
+		{ \
+			kprintf(__VA_ARGS__); \
+		} \
+	} while (0)
+
+#define log_error(SUBSYSTEM, ...) LOG(SUBSYSTEM, LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(SUBSYSTEM, ...)  LOG(SUBSYSTEM, LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(SUBSYSTEM, ...)  LOG(SUBSYSTEM, LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(SUBSYSTEM, ...) LOG(SUBSYSTEM, LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/* Change the runtime level of a subsystem. Levels above its build-time
+ * level have no effect, those messages are not in the kernel.
+ *
+ * Params:
+ *   subsystem - LOG_SUB_<name>
+ *   level     - LOG_LEVEL_NONE to LOG_LEVEL_DEBUG
+ */
+void log_set_level(LogSubsystem subsystem, uint8_t level);
+
+#endif
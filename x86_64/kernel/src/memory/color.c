@@ -0,0 +1,441 @@
+#include "color.h"
+
+#include "defines.h"
+#include "phys_alloc.h"
+#include "cpuid.h"
+#include "safety.h"
+#include "support.h"
+#include "kprintf.h"
+#include "log.h"
+#include "sync/spinlock.h"
+
+#ifdef BENCH_PAGE_COLORING
+#include "cpu.h"
+#include "smp/smp.h"
+#endif
+
+// Written to the first page of every 2MiB frame handed to the colored
+// allocator, so frees can tell colored pages from pool pages.
+#define COLOR_FRAME_MAGIC 0xC0104ED0C0104ED0ULL
+
+// Pages of a frame that hold memory, the first one is its ColorFrame
+#define COLOR_FRAME_PAGES (_2_MIB / _4_KIB - 1)
+
+#define CACHE_TYPE_NULL 0
+
+/* Header in the first page of a colored frame.
+ */
+typedef struct
+{
+	uint64_t magic;
+	uint64_t free;  // Pages of the frame in the buckets
+} ColorFrame;
+
+/* A free page, linked both ways so a frame's pages can be taken out of
+ * the middle of their buckets when the whole frame is returned.
+ */
+typedef struct _ColorPage
+{
+	struct _ColorPage* next;
+	struct _ColorPage* prev;
+} ColorPage;
+
+static uint32_t num_colors = 1;
+static uint64_t llc_size = 0;
+static bool enabled = false;
+
+// Protects reserved_colors, the buckets and the frame headers
+static Spinlock color_lock;
+
+// Colors that belong to some ColorSet
+static uint64_t reserved_colors = 0;
+
+// Free pages bucketed by color
+static ColorPage* buckets[COLOR_MAX_COLORS];
+
+void color_init()
+{
+	spin_init(&color_lock, "page colors");
+	for (uint32_t i = 0; i < COLOR_MAX_COLORS; ++i)
+	{
+		buckets[i] = NULL;
+	}
+
+	num_colors = 1;
+	llc_size = 0;
+	reserved_colors = 0;
+
+	uint32_t eax, ebx, ecx, edx;
+	cpuid_count(0, 0, &eax, &ebx, &ecx, &edx);
+	const uint32_t max_leaf = eax;
+
+	// Leaf 4 enumerates one cache per sub-leaf until a null cache type.
+	// The highest level found is the last level cache.
+	uint32_t llc_level = 0;
+	uint64_t way_size = 0;
+	for (uint32_t sub = 0; max_leaf >= 4; ++sub)
+	{
+		cpuid_count(4, sub, &eax, &ebx, &ecx, &edx);
+		if ((eax & 0x1F) == CACHE_TYPE_NULL)
+		{
+			break;
+		}
+
+		const uint32_t level = (eax >> 5) & 0x7;
+		const uint64_t ways = (ebx >> 22) + 1;
+		const uint64_t partitions = ((ebx >> 12) & 0x3FF) + 1;
+		const uint64_t line_size = (ebx & 0xFFF) + 1;
+		const uint64_t sets = (uint64_t)ecx + 1;
+
+		if (level > llc_level)
+		{
+			llc_level = level;
+			way_size = partitions * line_size * sets;
+			llc_size = ways * way_size;
+		}
+	}
+
+	// Every page sized slice of one cache way is a color
+	uint64_t colors = way_size / _4_KIB;
+	if (colors > COLOR_MAX_COLORS)
+	{
+		colors = COLOR_MAX_COLORS;
+	}
+
+	// Round down to a power of two so color_of() can mask
+	while (num_colors*2 <= colors)
+	{
+		num_colors *= 2;
+	}
+
+#ifdef PHYS_ALLOC_COLORING
+	enabled = num_colors > 1;
+#endif
+
+	log_info(COLOR, "Color: L%d cache %dKiB - %d colors\n",
+			llc_level, llc_size / _1_KIB, num_colors);
+}
+
+uint32_t color_count()
+{
+	return num_colors;
+}
+
+uint64_t color_llc_size()
+{
+	return llc_size;
+}
+
+void color_set_enabled(bool enable)
+{
+	enabled = enable && num_colors > 1;
+}
+
+bool color_reserve(ColorSet* set, uint32_t count)
+{
+	set->colors = 0;
+	set->next = 0;
+
+	const uint64_t flags = spin_lock_irqsave(&color_lock);
+	for (uint32_t c = 0; c < num_colors && count > 0; ++c)
+	{
+		const uint64_t bit = 1ULL << c;
+		if ((reserved_colors & bit) == 0)
+		{
+			set->colors |= bit;
+			--count;
+		}
+	}
+
+	if (count > 0)
+	{
+		set->colors = 0;
+		spin_unlock_irqrestore(&color_lock, flags);
+		return false;
+	}
+
+	reserved_colors |= set->colors;
+	spin_unlock_irqrestore(&color_lock, flags);
+	return true;
+}
+
+void color_release(ColorSet* set)
+{
+	const uint64_t flags = spin_lock_irqsave(&color_lock);
+	reserved_colors &= ~set->colors;
+	spin_unlock_irqrestore(&color_lock, flags);
+	set->colors = 0;
+}
+
+/* Bucket operations, called with color_lock held.
+ */
+static
+void bucket_push(uint64_t page)
+{
+	ColorPage** bucket = &buckets[color_of(page)];
+	ColorPage* node = (ColorPage*)page;
+	node->prev = NULL;
+	node->next = *bucket;
+	if (*bucket != NULL)
+	{
+		(*bucket)->prev = node;
+	}
+	*bucket = node;
+}
+
+static
+void bucket_remove(ColorPage* node)
+{
+	if (node->prev != NULL)
+	{
+		node->prev->next = node->next;
+	}
+	else
+	{
+		buckets[color_of((uint64_t)node)] = node->next;
+	}
+
+	if (node->next != NULL)
+	{
+		node->next->prev = node->prev;
+	}
+}
+
+/* Split a fresh 2MiB frame into the color buckets. The first page holds
+ * the frame header, the other 511 pages are spread evenly across colors.
+ * Called with color_lock held.
+ */
+static
+bool refill_buckets(void)
+{
+	ColorFrame* frame = (ColorFrame*) phys_alloc_2MIB();
+	if (frame == NULL)
+	{
+		return false;
+	}
+
+	frame->magic = COLOR_FRAME_MAGIC;
+	frame->free = COLOR_FRAME_PAGES;
+
+	const uint64_t base = (uint64_t)frame;
+	for (uint64_t page = base + _4_KIB; page < base + _2_MIB; page += _4_KIB)
+	{
+		bucket_push(page);
+	}
+
+	return true;
+}
+
+void* color_alloc_4KIB(ColorSet* set)
+{
+	if (!enabled || set == NULL || set->colors == 0)
+	{
+		return phys_alloc_4KIB();
+	}
+
+	const uint64_t flags = spin_lock_irqsave(&color_lock);
+	for (uint32_t attempt = 0; attempt < 2; ++attempt)
+	{
+		// Find the next color in the set that has a free page
+		for (uint32_t i = 0; i < num_colors; ++i)
+		{
+			const uint32_t c = (set->next + i) % num_colors;
+			ColorPage* page = buckets[c];
+			if ((set->colors & (1ULL << c)) && page != NULL)
+			{
+				set->next = c + 1;
+				bucket_remove(page);
+				--((ColorFrame*)MASK_2MIB((uint64_t)page))->free;
+				spin_unlock_irqrestore(&color_lock, flags);
+				return page;
+			}
+		}
+
+		if (!refill_buckets())
+		{
+			break;
+		}
+	}
+
+	spin_unlock_irqrestore(&color_lock, flags);
+	return NULL;
+}
+
+void color_free_4KIB(void* ptr)
+{
+	const uint64_t address = MASK_4KIB(ptr);
+	ColorFrame* frame = (ColorFrame*)MASK_2MIB(address);
+	if (frame->magic != COLOR_FRAME_MAGIC)
+	{
+		phys_free_4KIB(ptr);
+		return;
+	}
+
+	const uint64_t flags = spin_lock_irqsave(&color_lock);
+	bucket_push(address);
+	if (++frame->free < COLOR_FRAME_PAGES)
+	{
+		spin_unlock_irqrestore(&color_lock, flags);
+		return;
+	}
+
+	// Every page is free again, give the frame back to the pool
+	const uint64_t base = (uint64_t)frame;
+	for (uint64_t page = base + _4_KIB; page < base + _2_MIB; page += _4_KIB)
+	{
+		bucket_remove((ColorPage*)page);
+	}
+	frame->magic = 0;
+	spin_unlock_irqrestore(&color_lock, flags);
+
+	phys_free_2MIB(frame);
+}
+
+#ifdef BENCH_PAGE_COLORING
+#define BENCH_ROUNDS 16
+#define CACHE_LINE 64
+
+/* Write one word in every cache line of a set of pages.
+ */
+static
+void touch_pages(uint64_t** pages, uint64_t count)
+{
+	for (uint64_t p = 0; p < count; ++p)
+	{
+		volatile uint64_t* page = pages[p];
+		for (uint64_t off = 0; off < _4_KIB / 8; off += CACHE_LINE / 8)
+		{
+			page[off] = off;
+		}
+	}
+}
+
+// The polluter's pages, it runs on another CPU until told to stop
+static uint64_t** bench_polluter;
+static uint64_t bench_num_polluter;
+static volatile uint32_t bench_running;
+static volatile uint32_t bench_stop;
+
+static
+void polluter_worker(void)
+{
+	__atomic_store_n(&bench_running, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&bench_stop, __ATOMIC_ACQUIRE))
+	{
+		touch_pages(bench_polluter, bench_num_polluter);
+	}
+}
+
+/* Two workloads share the last level cache from two CPUs. The polluter
+ * streams through four times the LLC on CPU 1, the hot workload on
+ * this CPU reuses half of the LLC. Only the hot workload is timed.
+ *
+ * Returns:
+ *   Average cycles per cache line touched by the hot workload.
+ */
+static
+uint64_t run_workloads(uint64_t** polluter, uint64_t num_polluter,
+		uint64_t** hot, uint64_t num_hot, ColorSet* polluter_set, ColorSet* hot_set)
+{
+	for (uint64_t i = 0; i < num_polluter; ++i)
+	{
+		polluter[i] = color_alloc_4KIB(polluter_set);
+		ASSERT(polluter[i] != NULL);
+	}
+
+	for (uint64_t i = 0; i < num_hot; ++i)
+	{
+		hot[i] = color_alloc_4KIB(hot_set);
+		ASSERT(hot[i] != NULL);
+	}
+
+	bench_polluter = polluter;
+	bench_num_polluter = num_polluter;
+	bench_running = 0;
+	bench_stop = 0;
+	smp_call(1, polluter_worker);
+	while (!__atomic_load_n(&bench_running, __ATOMIC_ACQUIRE))
+	{
+		__asm__ volatile("pause");
+	}
+
+	uint64_t cycles = 0;
+	touch_pages(hot, num_hot);
+	for (uint32_t round = 0; round < BENCH_ROUNDS; ++round)
+	{
+		const uint64_t start = _rdtsc();
+		touch_pages(hot, num_hot);
+		cycles += _rdtsc() - start;
+	}
+
+	__atomic_store_n(&bench_stop, 1, __ATOMIC_RELEASE);
+	smp_wait(1);
+
+	for (uint64_t i = 0; i < num_polluter; ++i)
+	{
+		color_free_4KIB(polluter[i]);
+	}
+
+	for (uint64_t i = 0; i < num_hot; ++i)
+	{
+		color_free_4KIB(hot[i]);
+	}
+
+	return cycles / (BENCH_ROUNDS * num_hot * (_4_KIB / CACHE_LINE));
+}
+
+void color_benchmark()
+{
+	if (num_colors < 4)
+	{
+		kprintf("Color bench: skipped, %d colors\n", num_colors);
+		return;
+	}
+
+	if (cpu_count() < 2)
+	{
+		kprintf("Color bench: skipped, %d CPU online\n", cpu_count());
+		return;
+	}
+
+	uint64_t num_polluter = (4 * llc_size) / _4_KIB;
+	uint64_t num_hot = (llc_size / 2) / _4_KIB;
+
+	// The page lists hold (num_polluter + num_hot) pointers in one 2MiB
+	// frame. A larger LLC keeps the 8:1 ratio with fewer pages.
+	const uint64_t max_pages = _2_MIB / sizeof(uint64_t*);
+	if (num_polluter + num_hot > max_pages)
+	{
+		num_hot = max_pages / 9;
+		num_polluter = 8 * num_hot;
+	}
+
+	uint64_t** lists = (uint64_t**) phys_alloc_2MIB_safe("Color bench");
+	uint64_t** polluter = lists;
+	uint64_t** hot = lists + num_polluter;
+
+	const bool was_enabled = enabled;
+
+	color_set_enabled(false);
+	const uint64_t plain = run_workloads(polluter, num_polluter,
+			hot, num_hot, NULL, NULL);
+
+	// Give the polluter a quarter of the cache and the hot set the rest
+	ColorSet polluter_set, hot_set;
+	color_set_enabled(true);
+	const bool polluter_reserved = color_reserve(&polluter_set, num_colors / 4);
+	ASSERT(polluter_reserved);
+	const bool hot_reserved = color_reserve(&hot_set, num_colors - num_colors / 4);
+	ASSERT(hot_reserved);
+	const uint64_t colored = run_workloads(polluter, num_polluter,
+			hot, num_hot, &polluter_set, &hot_set);
+	color_release(&polluter_set);
+	color_release(&hot_set);
+
+	color_set_enabled(was_enabled);
+	phys_free_2MIB(lists);
+
+	kprintf("Color bench: hot workload %d cycles/line uncolored, %d colored\n",
+			plain, colored);
+}
+#endif
@@ -0,0 +1,85 @@
+#ifndef __X86_64_MEMORY_COLOR_H__
+#define __X86_64_MEMORY_COLOR_H__
+
+#include "inttypes.h"
+
+// Upper bound on the number of page colors, one bit per color in a
+// ColorSet.
+#define COLOR_MAX_COLORS 64
+
+/* A set of page colors handed to an address space. Pages allocated
+ * through the set only come from its colors, so two address spaces
+ * with disjoint sets never compete for the same last level cache sets.
+ */
+typedef struct
+{
+	uint64_t colors; // Bit N set means color N belongs to this set
+	uint32_t next;   // Round robin position within the set
+} ColorSet;
+
+/* Read the last level cache geometry from CPUID leaf 4 and work out
+ * how many page colors there are. Colored allocation is enabled when
+ * the kernel is built with PHYS_ALLOC_COLORING.
+ */
+void color_init(void);
+
+/* Number of page colors, 1 if the cache geometry is unknown.
+ */
+uint32_t color_count(void);
+
+/* Size in bytes of the last level cache, 0 if unknown.
+ */
+uint64_t color_llc_size(void);
+
+/* Turn colored allocation on or off. When off color_alloc_4KIB()
+ * behaves like phys_alloc_4KIB().
+ */
+void color_set_enabled(bool enabled);
+
+/* Get the color of a physical address.
+ */
+static inline
+uint32_t color_of(uint64_t phys_addr)
+{
+	return (phys_addr >> 12) & (color_count() - 1);
+}
+
+/* Reserve colors that no other set has reserved.
+ *
+ * Params:
+ *   set   - Out parameter, the set to initialize
+ *   count - How many colors the set should have
+ *
+ * Returns:
+ *   True if enough free colors were available, false otherwise.
+ */
+bool color_reserve(ColorSet* set, uint32_t count);
+
+/* Return a set's colors so they can be reserved again. Pages still
+ * allocated from the set are unaffected.
+ */
+void color_release(ColorSet* set);
+
+/* Allocate a 4KiB page whose color is in the set. Cycles through the
+ * set's colors so a range of allocations spreads across them.
+ *
+ * Returns:
+ *   The physical address of the page, or NULL when out of memory.
+ */
+void* color_alloc_4KIB(ColorSet* set);
+
+/* Free a page from color_alloc_4KIB(). Once all pages of a 2MiB frame
+ * the colored allocator split are free, the frame goes back to the
+ * physical allocator.
+ */
+void color_free_4KIB(void* ptr);
+
+#ifdef BENCH_PAGE_COLORING
+/* Time a workload that reuses half of the last level cache while
+ * another CPU streams through it, with and without page coloring.
+ * Needs the application processors started.
+ */
+void color_benchmark(void);
+#endif
+
+#endif
@@ -1,11 +1,22 @@
 #include "init.h"
 #include "mmap.h"
+#include "numa.h"
+#include "color.h"
+#include "slab.h"
 #include "paging.h"
+#include "page.h"
 #include "phys_alloc.h"
 
 void memory_init()
 {
 	mmap_init();
 	paging_init();
+	numa_init();
 	setup_physical_allocator();
+	color_init();
+	slab_init();
+
+#ifdef BENCH_PAGE_OPS
+	page_benchmark();
+#endif
 }
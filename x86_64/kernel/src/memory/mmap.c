@@ -1,7 +1,8 @@
 #include "mmap.h"
+#include "defines.h"
 #include "panic.h"
 #include "safety.h"
-#include "kprintf.h"
+#include "log.h"
 
 // Symbol placed by the linker
 // We assume that these two locations will encompass all code
@@ -16,13 +17,19 @@ const uint64_t KERNEL_ALL_HI_ADDR = (uint64_t)&__KERNEL_ALL_HI;
 // The maximum possible number of mmap entries
 #define MMAP_MAX_ENTRIES ((0x7C00 - 0x2D04) / 24)
 
-// Location of the MMapEntry array
+// Location of the MMapEntry array, the host build supplies its own
+#ifndef MMAP_ADDRESS
 #define MMAP_ADDRESS 0x2D04
+#endif
 
 // Location of the MMapEntry array length
+#ifndef MMAP_COUNT_ADDRESS
 #define MMAP_COUNT_ADDRESS 0x2D00
+#endif
 
-#define kprintf(...)
+// Extra room on top of the BIOS entry count. Every reservation or NUMA
+// boundary can split one entry into two.
+#define MMAP_SPARE_ENTRIES 64
 
 // Constants for the type field in the MMapEntry structure
 #define TYPE_USABLE 1
@@ -48,112 +55,287 @@ typedef struct
 
 COMPILE_ASSERT(sizeof(MMapEntry) == 24);
 
-// TODO - dynamically allocate this somewhere, not hard code the number of entries
-#define MAX_ENTRIES 10
-MemoryMap mmap_array[MAX_ENTRIES];
+// Placed directly after the kernel image by mmap_init(), sized from
+// the number of entries the BIOS returned.
+MemoryMap* mmap_array = NULL;
 int32_t mmap_length = 0;
+static int32_t mmap_capacity = 0;
+
+// First address after the kernel and the mmap_array storage
+static uint64_t boot_end = 0;
+
+// Set once the physical allocator owns the usable regions
+static bool sealed = false;
+
+/* Remove an entry by moving down all of the entries after it.
+ */
+static
+void remove_entry(int32_t index)
+{
+	for (int32_t j = index; j < mmap_length-1; ++j)
+	{
+		mmap_array[j] = mmap_array[j+1];
+	}
+	--mmap_length;
+}
+
+/* Find the first entry that ends after an address.
+ *
+ * Returns:
+ *   The index of the entry, or mmap_length if every entry ends at or
+ *   before the address.
+ */
+static
+int32_t first_ending_after(uint64_t phys_addr)
+{
+	int32_t lo = 0;
+	int32_t hi = mmap_length;
+	while (lo < hi)
+	{
+		const int32_t mid = lo + (hi - lo) / 2;
+		if (mmap_array[mid].base + mmap_array[mid].length <= phys_addr)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/* Sort the entries by base address and merge the ones that overlap or
+ * touch. Insertion sort, as the BIOS returns entries nearly sorted.
+ */
+static
+void sort_and_merge(void)
+{
+	for (int32_t i = 1; i < mmap_length; ++i)
+	{
+		const MemoryMap entry = mmap_array[i];
+		int32_t j = i - 1;
+		while (j >= 0 && mmap_array[j].base > entry.base)
+		{
+			mmap_array[j+1] = mmap_array[j];
+			--j;
+		}
+		mmap_array[j+1] = entry;
+	}
+
+	int32_t out = 0;
+	for (int32_t i = 1; i < mmap_length; ++i)
+	{
+		const uint64_t end = mmap_array[out].base + mmap_array[out].length;
+		if (mmap_array[i].base <= end)
+		{
+			const uint64_t new_end = mmap_array[i].base + mmap_array[i].length;
+			if (new_end > end)
+			{
+				mmap_array[out].length = new_end - mmap_array[out].base;
+			}
+		}
+		else
+		{
+			mmap_array[++out] = mmap_array[i];
+		}
+	}
+
+	if (mmap_length > 0)
+	{
+		mmap_length = out + 1;
+	}
+}
+
+/* Check that a range lies in one of the BIOS's usable entries. Used
+ * before the mmap_array exists.
+ */
+static
+bool bios_range_usable(const MMapEntry* mmap, uint32_t count,
+		uint64_t base, uint64_t end)
+{
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		if (mmap[i].type == TYPE_USABLE && mmap[i].base <= base &&
+				mmap[i].base + mmap[i].length >= end)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
 
 void mmap_init()
 {
-	kprintf("Entering MMAP\n");
+	log_debug(MMAP, "Entering MMAP\n");
 
 	const MMapEntry* mmap = (MMapEntry*)MMAP_ADDRESS;
 	const uint32_t mmap_count = *(uint32_t*)MMAP_COUNT_ADDRESS;
 
+	// The bootloader stores -1 when the BIOS call is not supported
+	if (mmap_count == 0 || mmap_count > MMAP_MAX_ENTRIES)
+	{
+		panic("No BIOS memory map");
+	}
+
 	for (uint32_t i = 0; i < mmap_count; ++i)
 	{
-		kprintf("(%d) Base: 0x%x Length: %d type: %d ACPI: %d\n", 
-				i, mmap[i].base, mmap[i].length, mmap[i].type, mmap[i].ACPI);	
+		log_debug(MMAP, "(%d) Base: 0x%x Length: %d type: %d ACPI: %d\n",
+				i, mmap[i].base, mmap[i].length, mmap[i].type, mmap[i].ACPI);
 	}
 
-	// This is checked by the assert above
-	const uint64_t reserved_lo = KERNEL_ALL_LO_ADDR;
-	const uint64_t reserved_hi = KERNEL_ALL_HI_ADDR;
+	// Place the array right after the kernel, this memory is reserved
+	// below along with the kernel itself.
+	mmap_capacity = mmap_count + MMAP_SPARE_ENTRIES;
+	const uint64_t storage = ALIGN_4KIB(KERNEL_ALL_HI_ADDR);
+	boot_end = ALIGN_4KIB(storage + mmap_capacity*sizeof(MemoryMap));
+
+	if (!bios_range_usable(mmap, mmap_count, KERNEL_ALL_LO_ADDR, boot_end))
+	{
+		panic("Kernel is not in usable memory");
+	}
 
-	// Need to fix the MMAP entries
+	mmap_array = (MemoryMap*)storage;
 	mmap_length = 0;
-	for (uint32_t i = 0; i < mmap_count && mmap_length < MAX_ENTRIES; ++i)
+	sealed = false;
+
+	for (uint32_t i = 0; i < mmap_count; ++i)
 	{
-		if (mmap[i].type != TYPE_USABLE) continue;
+		if (mmap[i].type != TYPE_USABLE || mmap[i].length == 0) continue;
 
-		// We have some (possibly invalid) assumptions about the memory map
-		// given by the BIOS. The first is that every region is unique, no
-		// duplicate or overlapping regions. Second is that the type fields
-		// are accurate.
-		
 		mmap_array[mmap_length].base = mmap[i].base;
 		mmap_array[mmap_length].length = mmap[i].length;
+		mmap_array[mmap_length].node = 0;
 		++mmap_length;
 	}
 
-	for (int32_t i = 0; i < mmap_length; ++i)
+	sort_and_merge();
+
+	// The BIOS may report reserved regions that overlap usable ones,
+	// the reserved type always wins.
+	for (uint32_t i = 0; i < mmap_count; ++i)
 	{
-		kprintf("0x%x - %d\n", mmap_array[i].base, mmap_array[i].length);
+		if (mmap[i].type != TYPE_USABLE && mmap[i].length > 0)
+		{
+			mmap_reserve(mmap[i].base, mmap[i].length);
+		}
 	}
 
+	// Everything below the end of the kernel: BIOS data, the bootloader,
+	// the kernel's stacks and image, and the mmap_array itself.
+	mmap_reserve(0, boot_end);
+
 	if (mmap_length == 0)
 	{
-		panic("Failed to find suitable usable memory region.");	
+		panic("Failed to find suitable usable memory region.");
 	}
 
-	kprintf("Res Lo: 0x%x - Res Hi: 0x%x\n", reserved_lo, reserved_hi);
-	kprintf("MMAP Entries: %d\n", mmap_length);
-
-	// Fix all the found regions
 	for (int32_t i = 0; i < mmap_length; ++i)
 	{
-		// Fix the region in case it intersects the kernel's memory
-		uint64_t base = mmap_array[i].base;
-		uint64_t end = base + mmap_array[i].length;
+		log_debug(MMAP, "Region: 0x%x - %d - %dMiB\n",
+				mmap_array[i].base, mmap_array[i].length,
+				mmap_array[i].length / 1024 / 1024);
+	}
+
+	log_debug(MMAP, "MMAP Entries: %d\n", mmap_length);
+}
+
+bool mmap_reserve(uint64_t base, uint64_t length)
+{
+	const uint64_t end = base + length;
+	int32_t i = first_ending_after(base);
+
+	if (sealed)
+	{
+		// Too late to take memory from the allocator, only succeed
+		// if the range was never usable.
+		return i >= mmap_length || mmap_array[i].base >= end;
+	}
 
-		kprintf("Region: 0x%x - 0x%x\n", base, end);
+	while (i < mmap_length && mmap_array[i].base < end)
+	{
+		const uint64_t e_base = mmap_array[i].base;
+		const uint64_t e_end = e_base + mmap_array[i].length;
 
-		if (base < reserved_lo && end > reserved_hi)
-		{
-			// TODO split region, but maybe not because it intersects kernel?
-			base = reserved_hi;
-		}
-		else if (base < reserved_hi && end > reserved_hi)
+		if (base <= e_base && end >= e_end)
 		{
-			base = reserved_hi;
+			// Covers the whole entry
+			remove_entry(i);
+			continue;
 		}
-		else if ((base >= reserved_lo && end <= reserved_hi) ||
- 				 // Don't allow regions below the kernel
-				 (base < reserved_lo && end <= reserved_hi))
+
+		if (base > e_base && end < e_end)
 		{
-			kprintf("case 3\n");
-			// Remove this entry by moving down all other entries
-			for (int32_t j = i; j < mmap_length-1; ++j)
+			// Inside the entry, keep both sides
+			if (!mmap_split(i, end - e_base))
 			{
-				mmap_array[j] = mmap_array[j+1];
+				panic("mmap_array full");
 			}
-			--mmap_length;
-			--i; // We want start at this new moved entry
-			continue; // Skip the assignment below
+			mmap_array[i].length = base - e_base;
+			return true;
 		}
 
-		// Perform some more sanity checks
-		if (base <= reserved_lo || end <= reserved_lo)
+		if (base > e_base)
 		{
-			panic("Base region is too low");
+			// Overlaps the end of the entry
+			mmap_array[i].length = base - e_base;
 		}
-
-		if (end <= base)
+		else
 		{
-			panic("Region does not exist");
+			// Overlaps the start of the entry
+			mmap_array[i].base = end;
+			mmap_array[i].length = e_end - end;
 		}
+		++i;
+	}
 
-		// Region does not intersect kernel
-		mmap_array[i].base = base;
-		mmap_array[i].length = end - base;
+	return true;
+}
 
-		kprintf("Fixed region: 0x%x - %d - %dMiB\n", 
-				mmap_array[i].base, mmap_array[i].length,
-				mmap_array[i].length / 1024 / 1024);
+void mmap_seal()
+{
+	sealed = true;
+}
+
+int32_t mmap_find(uint64_t phys_addr)
+{
+	const int32_t i = first_ending_after(phys_addr);
+	if (i < mmap_length && mmap_array[i].base <= phys_addr)
+	{
+		return i;
 	}
 
-	if (mmap_length == 0)
+	return -1;
+}
+
+uint64_t mmap_boot_end()
+{
+	return boot_end;
+}
+
+bool mmap_split(int32_t index, uint64_t offset)
+{
+	ASSERT(index >= 0 && index < mmap_length);
+	ASSERT(offset > 0 && offset < mmap_array[index].length);
+
+	if (mmap_length >= mmap_capacity)
+	{
+		return false;
+	}
+
+	// Make room directly after the entry being split
+	for (int32_t j = mmap_length; j > index + 1; --j)
 	{
-		panic("No suitable regions after fixing");
+		mmap_array[j] = mmap_array[j-1];
 	}
+	++mmap_length;
+
+	mmap_array[index+1].base = mmap_array[index].base + offset;
+	mmap_array[index+1].length = mmap_array[index].length - offset;
+	mmap_array[index+1].node = mmap_array[index].node;
+	mmap_array[index].length = offset;
+
+	return true;
 }
@@ -8,16 +8,73 @@ typedef struct
 {
 	uint64_t base;
 	uint64_t length;
+	uint32_t node; // NUMA node, filled in by numa_init()
 } MemoryMap;
 
-// Stores all of the usable regions of memory
-extern MemoryMap mmap_array[];
+// Stores all of the usable regions of memory, sorted by base address.
+// No two entries overlap.
+extern MemoryMap* mmap_array;
 extern int32_t mmap_length;
 
 /* Read the memory map provided by the BIOS and populate
  * the mmap_array. The mmap_array will contain usable
- * regions of physical memory.
+ * regions of physical memory. The array is sized from
+ * the number of BIOS entries and stored right after the
+ * kernel image.
  */
 void mmap_init(void);
 
+/* Remove a range of physical memory from the usable regions, for
+ * example memory mapped devices or memory taken for early page tables.
+ *
+ * Once mmap_seal() has been called the usable regions belong to the
+ * physical allocator and can no longer shrink. Reservations then only
+ * succeed for ranges that were never usable.
+ *
+ * Params:
+ *   base   - The physical start of the range
+ *   length - The length of the range in bytes
+ *
+ * Returns:
+ *   True if no part of the range is usable memory anymore.
+ */
+bool mmap_reserve(uint64_t base, uint64_t length);
+
+/* Called by the physical allocator once it has taken the usable regions.
+ */
+void mmap_seal(void);
+
+/* Find the region containing a physical address. Binary search.
+ *
+ * Returns:
+ *   The index into mmap_array, or -1 if the address is not usable.
+ */
+int32_t mmap_find(uint64_t phys_addr);
+
+/* Check if a physical address is usable memory.
+ */
+static inline
+bool mmap_is_usable(uint64_t phys_addr)
+{
+	return mmap_find(phys_addr) >= 0;
+}
+
+/* The first address after the kernel image and the mmap_array storage.
+ * Everything below this is reserved.
+ */
+uint64_t mmap_boot_end(void);
+
+/* Split an mmap_array entry in two. The new entry is placed directly
+ * after the original and inherits its node.
+ *
+ * Params:
+ *   index  - The entry to split
+ *   offset - Where to split, relative to the entry's base. Must be
+ *            greater than 0 and less than the entry's length.
+ *
+ * Returns:
+ *   True if the entry was split, false if the array is full.
+ */
+bool mmap_split(int32_t index, uint64_t offset);
+
 #endif
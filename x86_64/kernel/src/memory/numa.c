@@ -0,0 +1,323 @@
+#include "numa.h"
+
+#include "mmap.h"
+#include "acpi/acpi.h"
+#include "cpu.h"
+#include "safety.h"
+#include "log.h"
+
+#define NUMA_MAX_RANGES 32
+#define NUMA_MAX_CPUS 64
+
+typedef struct
+{
+	uint64_t base;
+	uint64_t end;
+	uint32_t node;
+} NumaRange;
+
+typedef struct
+{
+	uint32_t apic_id;
+	uint32_t node;
+} NumaCpu;
+
+static uint32_t node_count = 1;
+// Proximity domain that each node was created from
+static uint32_t node_domain[NUMA_MAX_NODES];
+
+static NumaRange ranges[NUMA_MAX_RANGES];
+static uint32_t range_count = 0;
+
+static NumaCpu cpus[NUMA_MAX_CPUS];
+static uint32_t srat_cpu_count = 0;
+
+static uint8_t distance[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static uint8_t fallback[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+// Node of the BSP, the host build has no per-CPU blocks
+static uint32_t bsp_node = 0;
+
+/* Map an ACPI proximity domain to a dense node number, creating a new
+ * node the first time a domain is seen.
+ */
+static
+uint32_t domain_to_node(uint32_t domain)
+{
+	for (uint32_t i = 0; i < node_count; ++i)
+	{
+		if (node_domain[i] == domain)
+		{
+			return i;
+		}
+	}
+
+	if (node_count >= NUMA_MAX_NODES)
+	{
+		log_warn(NUMA, "NUMA: Too many proximity domains, folding %d into node 0\n", domain);
+		return 0;
+	}
+
+	node_domain[node_count] = domain;
+	return node_count++;
+}
+
+static
+void add_cpu(uint32_t apic_id, uint32_t domain)
+{
+	if (srat_cpu_count >= NUMA_MAX_CPUS)
+	{
+		return;
+	}
+
+	cpus[srat_cpu_count].apic_id = apic_id;
+	cpus[srat_cpu_count].node = domain_to_node(domain);
+	++srat_cpu_count;
+}
+
+static
+void parse_srat(const SRATHeader* srat)
+{
+	// Node 0 is created lazily from the first domain seen, so the domain
+	// number does not matter until then.
+	node_count = 0;
+
+	const uint8_t* ptr = (const uint8_t*)(srat + 1);
+	const uint8_t* end = (const uint8_t*)srat + srat->header.length;
+	while (ptr < end && ptr[1] != 0)
+	{
+		switch (ptr[0])
+		{
+			case SRAT_LAPIC_TYPE:
+				{
+					const SRATLapicEntry* e = (const SRATLapicEntry*)ptr;
+					if (e->flags & SRAT_ENABLED)
+					{
+						const uint32_t domain = e->proximity_lo |
+							(e->proximity_hi[0] << 8) |
+							(e->proximity_hi[1] << 16) |
+							(e->proximity_hi[2] << 24);
+						add_cpu(e->apic_id, domain);
+					}
+				}
+				break;
+			case SRAT_X2APIC_TYPE:
+				{
+					const SRATX2apicEntry* e = (const SRATX2apicEntry*)ptr;
+					if (e->flags & SRAT_ENABLED)
+					{
+						add_cpu(e->x2apic_id, e->proximity);
+					}
+				}
+				break;
+			case SRAT_MEMORY_TYPE:
+				{
+					const SRATMemoryEntry* e = (const SRATMemoryEntry*)ptr;
+					const uint64_t base = ((uint64_t)e->base_hi << 32) | e->base_lo;
+					const uint64_t length = ((uint64_t)e->length_hi << 32) | e->length_lo;
+					if ((e->flags & SRAT_ENABLED) && length > 0 &&
+							range_count < NUMA_MAX_RANGES)
+					{
+						ranges[range_count].base = base;
+						ranges[range_count].end = base + length;
+						ranges[range_count].node = domain_to_node(e->proximity);
+						++range_count;
+					}
+				}
+				break;
+			default:
+				// Other affinity structures (GICC, etc.) are ignored
+				break;
+		}
+
+		ptr += ptr[1];
+	}
+
+	if (node_count == 0)
+	{
+		node_count = 1;
+	}
+}
+
+static
+void parse_slit(const SLITHeader* slit)
+{
+	const uint64_t count = slit->locality_count;
+	const uint8_t* matrix = (const uint8_t*)(slit + 1);
+
+	for (uint32_t from = 0; from < node_count; ++from)
+	{
+		for (uint32_t to = 0; to < node_count; ++to)
+		{
+			const uint64_t d_from = node_domain[from];
+			const uint64_t d_to = node_domain[to];
+			if (d_from < count && d_to < count)
+			{
+				distance[from][to] = matrix[d_from*count + d_to];
+			}
+		}
+	}
+}
+
+/* Build the fallback order of every node, nearest nodes first. Ties are
+ * broken by node number so that the order is stable.
+ */
+static
+void build_fallback_order(void)
+{
+	for (uint32_t node = 0; node < node_count; ++node)
+	{
+		uint8_t* order = fallback[node];
+		for (uint32_t i = 0; i < node_count; ++i)
+		{
+			order[i] = i;
+		}
+
+		// Insertion sort, there are only a handful of nodes
+		for (uint32_t i = 1; i < node_count; ++i)
+		{
+			const uint8_t n = order[i];
+			int32_t j = i - 1;
+			while (j >= 0 && distance[node][order[j]] > distance[node][n])
+			{
+				order[j+1] = order[j];
+				--j;
+			}
+			order[j+1] = n;
+		}
+	}
+}
+
+/* Tag each mmap_array entry with its node, splitting entries that cross
+ * the boundary of an SRAT memory range.
+ */
+static
+void tag_mmap(void)
+{
+	for (int32_t i = 0; i < mmap_length; ++i)
+	{
+		const uint64_t base = mmap_array[i].base;
+		const uint64_t end = base + mmap_array[i].length;
+
+		uint64_t split_at = end;
+		uint32_t node = 0;
+		for (uint32_t r = 0; r < range_count; ++r)
+		{
+			if (base >= ranges[r].base && base < ranges[r].end)
+			{
+				node = ranges[r].node;
+				if (ranges[r].end < split_at)
+				{
+					split_at = ranges[r].end;
+				}
+			}
+			else if (ranges[r].base > base && ranges[r].base < split_at)
+			{
+				split_at = ranges[r].base;
+			}
+		}
+
+		mmap_array[i].node = node;
+
+		if (split_at < end && !mmap_split(i, split_at - base))
+		{
+			log_warn(NUMA, "NUMA: mmap_array full, 0x%x - 0x%x left on node %d\n",
+					split_at, end, node);
+		}
+	}
+}
+
+void numa_init()
+{
+	node_count = 1;
+	node_domain[0] = 0;
+	range_count = 0;
+	srat_cpu_count = 0;
+
+	const SRATHeader* srat = (const SRATHeader*)acpi_find_table(SRAT_SIG);
+	if (srat != NULL)
+	{
+		parse_srat(srat);
+	}
+
+	for (uint32_t from = 0; from < NUMA_MAX_NODES; ++from)
+	{
+		for (uint32_t to = 0; to < NUMA_MAX_NODES; ++to)
+		{
+			distance[from][to] = (from == to) ?
+				NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+		}
+	}
+
+	const SLITHeader* slit = (const SLITHeader*)acpi_find_table(SLIT_SIG);
+	if (slit != NULL)
+	{
+		parse_slit(slit);
+	}
+
+	build_fallback_order();
+	tag_mmap();
+
+	// Looked up by the same APIC ID as the APs. apic_init() looks it
+	// up again once x2APIC mode gives all of its bits.
+	bsp_node = 0;
+#ifndef HOST_BUILD
+	bsp_node = numa_cpu_node(this_cpu()->apic_id);
+	this_cpu()->node = bsp_node;
+#endif
+
+	log_info(NUMA, "NUMA: %d node(s), %d memory range(s), BSP on node %d\n",
+			node_count, range_count, bsp_node);
+}
+
+uint32_t numa_cpu_node(uint32_t apic_id)
+{
+	for (uint32_t i = 0; i < srat_cpu_count; ++i)
+	{
+		if (cpus[i].apic_id == apic_id)
+		{
+			return cpus[i].node;
+		}
+	}
+
+	return 0;
+}
+
+uint32_t numa_node_count()
+{
+	return node_count;
+}
+
+uint32_t numa_node_of(uint64_t phys_addr)
+{
+	for (uint32_t r = 0; r < range_count; ++r)
+	{
+		if (phys_addr >= ranges[r].base && phys_addr < ranges[r].end)
+		{
+			return ranges[r].node;
+		}
+	}
+
+	return 0;
+}
+
+uint32_t numa_local_node()
+{
+#ifdef HOST_BUILD
+	return bsp_node;
+#else
+	return this_cpu()->node;
+#endif
+}
+
+uint32_t numa_distance(uint32_t from, uint32_t to)
+{
+	ASSERT(from < node_count && to < node_count);
+	return distance[from][to];
+}
+
+const uint8_t* numa_fallback_order(uint32_t node)
+{
+	ASSERT(node < node_count);
+	return fallback[node];
+}
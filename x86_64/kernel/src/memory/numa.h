@@ -0,0 +1,65 @@
+#ifndef __X86_64_MEMORY_NUMA_H__
+#define __X86_64_MEMORY_NUMA_H__
+
+#include "inttypes.h"
+
+// The maximum number of NUMA nodes that are tracked. Proximity
+// domains beyond this are folded into node 0.
+#define NUMA_MAX_NODES 8
+
+// Relative distances as defined by the SLIT. Used when the firmware
+// does not provide a SLIT.
+#define NUMA_LOCAL_DISTANCE 10
+#define NUMA_REMOTE_DISTANCE 20
+
+/* Parse the ACPI SRAT and SLIT, then tag every mmap_array entry with the
+ * node it belongs to. Entries that straddle two nodes are split. Must be
+ * called after paging_init() so the ACPI tables are mapped, and before
+ * setup_physical_allocator().
+ *
+ * If there is no SRAT the system is treated as a single node.
+ */
+void numa_init(void);
+
+/* The number of NUMA nodes, always at least 1.
+ */
+uint32_t numa_node_count(void);
+
+/* Find the node a physical address belongs to.
+ *
+ * Params:
+ *   phys_addr - The physical address
+ *
+ * Returns:
+ *   The node, or 0 if the address is not covered by the SRAT.
+ */
+uint32_t numa_node_of(uint64_t phys_addr);
+
+/* The node of the processor this is called on.
+ */
+uint32_t numa_local_node(void);
+
+/* The node of a processor, 0 if the SRAT does not list it.
+ *
+ * Params:
+ *   apic_id - Local APIC ID of the processor
+ */
+uint32_t numa_cpu_node(uint32_t apic_id);
+
+/* Relative distance between two nodes, NUMA_LOCAL_DISTANCE when they
+ * are the same node.
+ */
+uint32_t numa_distance(uint32_t from, uint32_t to);
+
+/* Nodes ordered by distance from a given node, the node itself first.
+ * Allocators walk this list when the local node runs out of memory.
+ *
+ * Params:
+ *   node - The node to get the fallback order for
+ *
+ * Returns:
+ *   An array of numa_node_count() node numbers.
+ */
+const uint8_t* numa_fallback_order(uint32_t node);
+
+#endif
@@ -0,0 +1,413 @@
+#include "objcache.h"
+
+#include "defines.h"
+#include "phys_alloc.h"
+#include "slab.h"
+#include "safety.h"
+#include "support.h"
+#include "klib.h"
+#include "kprintf.h"
+#include "trace/trace.h"
+
+#ifdef BENCH_OBJCACHE
+#include "smp/smp.h"
+#endif
+
+typedef struct _Magazine
+{
+	struct _Magazine* next; // Depot list link
+	uint64_t rounds;        // Objects held
+	void* objects[OBJCACHE_MAGAZINE_SIZE];
+} Magazine;
+
+// Magazines come from kmalloc(), keep them one size class exactly
+COMPILE_ASSERT(sizeof(Magazine) == 128);
+COMPILE_ASSERT(sizeof(ObjCache) <= _4_KIB);
+
+static inline
+void swap_magazines(ObjCacheCPU* cc)
+{
+	Magazine* tmp = cc->loaded;
+	cc->loaded = cc->previous;
+	cc->previous = tmp;
+}
+
+/* Get an empty magazine from the depot, or make a new one. The depot
+ * lock must be held.
+ */
+static
+Magazine* depot_pop_empty(ObjCache* cache)
+{
+	Magazine* mag = cache->empty;
+	if (mag != NULL)
+	{
+		cache->empty = mag->next;
+		--cache->empty_count;
+	}
+	else
+	{
+		mag = (Magazine*) kmalloc(sizeof(Magazine));
+		if (mag == NULL)
+		{
+			return NULL;
+		}
+		++cache->magazines;
+	}
+
+	mag->next = NULL;
+	mag->rounds = 0;
+	return mag;
+}
+
+static
+void depot_push(Magazine** head, Magazine* mag)
+{
+	mag->next = *head;
+	*head = mag;
+}
+
+/* Fill a magazine with new objects carved from pages of the physical
+ * allocator. The depot lock must be held.
+ *
+ * Returns:
+ *   A magazine holding at least one object, or NULL when out of memory.
+ */
+static
+Magazine* depot_carve(ObjCache* cache)
+{
+	Magazine* mag = depot_pop_empty(cache);
+	if (mag == NULL)
+	{
+		return NULL;
+	}
+
+	while (mag->rounds < OBJCACHE_MAGAZINE_SIZE)
+	{
+		if (cache->carve_next + cache->stride > cache->carve_end)
+		{
+			uint8_t* page = (uint8_t*) phys_alloc_4KIB();
+			if (page == NULL)
+			{
+				break;
+			}
+
+			++cache->pages;
+			cache->carve_next = page;
+			cache->carve_end = page + _4_KIB;
+		}
+
+		mag->objects[mag->rounds++] = cache->carve_next;
+		cache->carve_next += cache->stride;
+	}
+
+	if (mag->rounds == 0)
+	{
+		depot_push(&cache->empty, mag);
+		++cache->empty_count;
+		return NULL;
+	}
+
+	return mag;
+}
+
+/* Both magazines of a CPU are empty. Trade the previous one for a full
+ * magazine from the depot.
+ */
+static
+bool depot_exchange_full(ObjCache* cache, ObjCacheCPU* cc)
+{
+	McsNode node;
+	mcs_lock(&cache->depot_lock, &node);
+
+	Magazine* full = cache->full;
+	if (full != NULL)
+	{
+		cache->full = full->next;
+		--cache->full_count;
+	}
+	else
+	{
+		full = depot_carve(cache);
+		if (full == NULL)
+		{
+			mcs_unlock(&cache->depot_lock, &node);
+			return false;
+		}
+	}
+
+	if (cc->previous != NULL)
+	{
+		depot_push(&cache->empty, cc->previous);
+		++cache->empty_count;
+	}
+	++cache->exchanges;
+	TRACE(OBJCACHE_REFILL, cache, cache->full_count, cache->empty_count);
+
+	mcs_unlock(&cache->depot_lock, &node);
+
+	cc->previous = cc->loaded;
+	cc->loaded = full;
+	return true;
+}
+
+/* Both magazines of a CPU are full. Trade the previous one for an empty
+ * magazine from the depot.
+ */
+static
+void depot_exchange_empty(ObjCache* cache, ObjCacheCPU* cc)
+{
+	McsNode node;
+	mcs_lock(&cache->depot_lock, &node);
+
+	Magazine* empty = depot_pop_empty(cache);
+	if (empty == NULL)
+	{
+		// Objects cannot go back to their pages, there is nowhere to
+		// put this one.
+		panic("objcache: out of memory for magazines");
+	}
+
+	if (cc->previous != NULL)
+	{
+		depot_push(&cache->full, cc->previous);
+		++cache->full_count;
+	}
+	++cache->exchanges;
+	TRACE(OBJCACHE_FLUSH, cache, cache->full_count, cache->empty_count);
+
+	mcs_unlock(&cache->depot_lock, &node);
+
+	cc->previous = cc->loaded;
+	cc->loaded = empty;
+}
+
+ObjCache* objcache_create(const char* name, uint32_t size, uint32_t align)
+{
+	ASSERT(size > 0 && size <= _4_KIB);
+	ASSERT((align & (align - 1)) == 0);
+
+	if (align < 8)
+	{
+		align = 8;
+	}
+
+	ObjCache* cache = (ObjCache*) phys_alloc_4KIB();
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+
+	memclr(cache, sizeof(ObjCache));
+	mcs_init(&cache->depot_lock, name);
+	cache->name = name;
+	cache->object_size = size;
+	cache->stride = (size + align - 1) & ~(align - 1);
+
+	return cache;
+}
+
+void* objcache_alloc(ObjCache* cache)
+{
+	const uint64_t flags = irq_save();
+	ObjCacheCPU* cc = &cache->cpu[cpu_index()];
+
+	void* obj = NULL;
+	for (;;)
+	{
+		if (cc->loaded != NULL && cc->loaded->rounds > 0)
+		{
+			obj = cc->loaded->objects[--cc->loaded->rounds];
+			++cc->allocs;
+			break;
+		}
+
+		if (cc->previous != NULL && cc->previous->rounds > 0)
+		{
+			swap_magazines(cc);
+			continue;
+		}
+
+		if (!depot_exchange_full(cache, cc))
+		{
+			break;
+		}
+	}
+
+	irq_restore(flags);
+	return obj;
+}
+
+void objcache_free(ObjCache* cache, void* obj)
+{
+	const uint64_t flags = irq_save();
+	ObjCacheCPU* cc = &cache->cpu[cpu_index()];
+
+	for (;;)
+	{
+		if (cc->loaded != NULL && cc->loaded->rounds < OBJCACHE_MAGAZINE_SIZE)
+		{
+			cc->loaded->objects[cc->loaded->rounds++] = obj;
+			++cc->frees;
+			break;
+		}
+
+		if (cc->previous != NULL && cc->previous->rounds == 0)
+		{
+			swap_magazines(cc);
+			continue;
+		}
+
+		depot_exchange_empty(cache, cc);
+	}
+
+	irq_restore(flags);
+}
+
+void objcache_dump_stats(const ObjCache* cache)
+{
+	uint64_t allocs = 0, frees = 0;
+	for (uint32_t i = 0; i < cpu_count(); ++i)
+	{
+		allocs += cache->cpu[i].allocs;
+		frees += cache->cpu[i].frees;
+	}
+
+	kprintf("%s-%d: %d allocs, %d frees, %d pages, %d magazines "
+			"(%d full, %d empty in depot), %d exchanges\n",
+			cache->name, cache->object_size, allocs, frees, cache->pages,
+			cache->magazines, cache->full_count, cache->empty_count,
+			cache->exchanges);
+}
+
+#ifdef BENCH_OBJCACHE
+#define BENCH_BATCH  32
+#define BENCH_ROUNDS 4096
+#define BENCH_SIZE   64
+
+// Concurrent CPUs of each run
+static const uint32_t bench_counts[] = {1, 2, 4};
+
+// State of the run in progress, set by the bootstrap processor
+static ObjCache* bench_cache = NULL;
+static uint32_t bench_cpus = 0;
+static volatile uint32_t bench_arrived[2];
+static uint64_t bench_cycles[2][MAX_CPUS];
+
+/* Wait until every CPU of the run reached the barrier, so the timed
+ * loops start together.
+ */
+static
+void bench_barrier(volatile uint32_t* arrived)
+{
+	__atomic_fetch_add(arrived, 1, __ATOMIC_ACQ_REL);
+	while (__atomic_load_n(arrived, __ATOMIC_ACQUIRE) < bench_cpus)
+	{
+		__asm__ volatile("pause");
+	}
+}
+
+/* Allocate and free BENCH_BATCH objects per round, from the shared
+ * cache and then from kmalloc(). The batch is larger than two
+ * magazines, so the timed loop includes depot exchanges.
+ */
+static
+void bench_worker(void)
+{
+	void* objects[BENCH_BATCH];
+	const uint32_t cpu = cpu_index();
+
+	// Warm up so the timed loops do not include carving pages
+	for (uint32_t i = 0; i < BENCH_BATCH; ++i)
+	{
+		objects[i] = objcache_alloc(bench_cache);
+	}
+	for (uint32_t i = 0; i < BENCH_BATCH; ++i)
+	{
+		objcache_free(bench_cache, objects[i]);
+	}
+
+	bench_barrier(&bench_arrived[0]);
+	const uint64_t start_cache = _rdtsc();
+	for (uint32_t round = 0; round < BENCH_ROUNDS; ++round)
+	{
+		for (uint32_t i = 0; i < BENCH_BATCH; ++i)
+		{
+			objects[i] = objcache_alloc(bench_cache);
+		}
+		for (uint32_t i = 0; i < BENCH_BATCH; ++i)
+		{
+			objcache_free(bench_cache, objects[i]);
+		}
+	}
+	bench_cycles[0][cpu] = _rdtsc() - start_cache;
+
+	bench_barrier(&bench_arrived[1]);
+	const uint64_t start_slab = _rdtsc();
+	for (uint32_t round = 0; round < BENCH_ROUNDS; ++round)
+	{
+		for (uint32_t i = 0; i < BENCH_BATCH; ++i)
+		{
+			objects[i] = kmalloc(BENCH_SIZE);
+		}
+		for (uint32_t i = 0; i < BENCH_BATCH; ++i)
+		{
+			kfree(objects[i]);
+		}
+	}
+	bench_cycles[1][cpu] = _rdtsc() - start_slab;
+}
+
+/* Pairs per million cycles of all CPUs of a run together, bounded by
+ * the slowest of them.
+ */
+static
+uint64_t bench_throughput(const uint64_t* cycles, uint32_t cpus)
+{
+	uint64_t slowest = 1;
+	for (uint32_t i = 0; i < cpus; ++i)
+	{
+		if (cycles[i] > slowest)
+		{
+			slowest = cycles[i];
+		}
+	}
+
+	const uint64_t pairs = (uint64_t)BENCH_ROUNDS * BENCH_BATCH * cpus;
+	return pairs * 1000000 / slowest;
+}
+
+void objcache_benchmark()
+{
+	for (uint32_t run = 0; run < sizeof(bench_counts) / sizeof(bench_counts[0]); ++run)
+	{
+		const uint32_t cpus = bench_counts[run];
+		if (cpus > cpu_count())
+		{
+			kprintf("Objcache bench %d CPUs: skipped, %d online\n", cpus, cpu_count());
+			continue;
+		}
+
+		bench_cache = objcache_create("objcache bench", BENCH_SIZE, 0);
+		ASSERT(bench_cache != NULL);
+		bench_cpus = cpus;
+		bench_arrived[0] = 0;
+		bench_arrived[1] = 0;
+
+		// This CPU is one of the run
+		for (uint32_t i = 1; i < cpus; ++i)
+		{
+			smp_call(i, bench_worker);
+		}
+		bench_worker();
+		for (uint32_t i = 1; i < cpus; ++i)
+		{
+			smp_wait(i);
+		}
+
+		kprintf("Objcache bench %d CPUs: %d alloc/free pairs per Mcycle, kmalloc %d\n",
+				cpus, bench_throughput(bench_cycles[0], cpus),
+				bench_throughput(bench_cycles[1], cpus));
+		objcache_dump_stats(bench_cache);
+	}
+}
+#endif
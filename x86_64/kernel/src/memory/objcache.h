@@ -0,0 +1,97 @@
+#ifndef __X86_64_MEMORY_OBJCACHE_H__
+#define __X86_64_MEMORY_OBJCACHE_H__
+
+#include "inttypes.h"
+#include "cpu.h"
+#include "sync/spinlock.h"
+
+// Objects held by one magazine
+#define OBJCACHE_MAGAZINE_SIZE 14
+
+struct _Magazine;
+
+/* The magazines of one CPU. Only touched by that CPU with interrupts
+ * disabled, so no atomics are needed. Padded to a cache line so CPUs
+ * do not share lines.
+ */
+typedef struct
+{
+	struct _Magazine* loaded;
+	struct _Magazine* previous;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t reserved[4];
+} __attribute__((aligned(64))) ObjCacheCPU;
+
+COMPILE_ASSERT(sizeof(ObjCacheCPU) == 64);
+
+/* A per-CPU cache of fixed size objects (Bonwick style magazines).
+ *
+ * Every CPU allocates from and frees to its own two magazines. When
+ * both are exhausted a whole magazine is exchanged with the depot,
+ * which is shared between CPUs and refills itself by carving pages
+ * from phys_alloc_4KIB(). Objects are never handed back to the physical
+ * allocator, a cache stays at its high water mark.
+ */
+typedef struct
+{
+	const char* name;
+	uint32_t object_size;
+	uint32_t stride;
+
+	// Depot, protected by depot_lock. Every CPU that runs out of
+	// magazines at once queues here, so it is an MCS lock. Taken with
+	// interrupts already disabled.
+	McsLock depot_lock;
+	struct _Magazine* full;
+	struct _Magazine* empty;
+	uint8_t* carve_next; // Uncarved part of the newest page
+	uint8_t* carve_end;
+
+	// Depot statistics
+	uint64_t full_count;
+	uint64_t empty_count;
+	uint64_t magazines;
+	uint64_t pages;
+	uint64_t exchanges;
+
+	ObjCacheCPU cpu[MAX_CPUS];
+} ObjCache;
+
+/* Create an object cache. The cache itself takes one page.
+ *
+ * Params:
+ *   name  - Name used when printing statistics
+ *   size  - Size of each object in bytes, at most 4KiB
+ *   align - Alignment of each object, a power of two. 0 means 8 bytes.
+ *
+ * Returns:
+ *   The new cache, or NULL when out of memory.
+ */
+ObjCache* objcache_create(const char* name, uint32_t size, uint32_t align);
+
+/* Allocate an object. Safe to call from interrupt handlers.
+ *
+ * Returns:
+ *   The object, or NULL when out of memory.
+ */
+void* objcache_alloc(ObjCache* cache);
+
+/* Return an object to the cache it was allocated from. Safe to call
+ * from interrupt handlers, and from a different CPU than the one that
+ * allocated the object.
+ */
+void objcache_free(ObjCache* cache, void* obj);
+
+/* Print the statistics of a cache.
+ */
+void objcache_dump_stats(const ObjCache* cache);
+
+#ifdef BENCH_OBJCACHE
+/* Time alloc/free pairs on 1, 2 and 4 CPUs sharing one cache, against
+ * kmalloc()/kfree(). Needs the application processors started.
+ */
+void objcache_benchmark(void);
+#endif
+
+#endif
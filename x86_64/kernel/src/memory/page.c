@@ -0,0 +1,294 @@
+#include "page.h"
+
+#include "color.h"
+#include "defines.h"
+#include "klib.h"
+#include "safety.h"
+
+#ifdef BENCH_PAGE_OPS
+#include "cpuid.h"
+#include "support.h"
+#include "kprintf.h"
+#include "phys_alloc.h"
+#endif
+
+// Bypass the cache once a page is at least 1/(1 << shift) of the LLC
+#define PAGE_NT_LLC_SHIFT 2
+
+// Used when the LLC size is unknown
+#define PAGE_NT_DEFAULT_THRESHOLD _1_MIB
+
+bool page_use_nt(uint64_t size)
+{
+	const uint64_t llc = color_llc_size();
+	const uint64_t threshold = llc > 0 ? llc >> PAGE_NT_LLC_SHIFT :
+		PAGE_NT_DEFAULT_THRESHOLD;
+
+	return size >= threshold;
+}
+
+void page_clear_nt(void* page, uint64_t size)
+{
+	ASSERT((MASK_4KIB(page) == (uint64_t)page) && (size & (_4_KIB - 1)) == 0);
+
+	const uint64_t zero = 0;
+	uint8_t* p = (uint8_t*)page;
+	for (uint8_t* end = p + size; p < end; p += 64)
+	{
+		__asm__ volatile(
+			"movnti %1, 0(%0)\n\t"
+			"movnti %1, 8(%0)\n\t"
+			"movnti %1, 16(%0)\n\t"
+			"movnti %1, 24(%0)\n\t"
+			"movnti %1, 32(%0)\n\t"
+			"movnti %1, 40(%0)\n\t"
+			"movnti %1, 48(%0)\n\t"
+			"movnti %1, 56(%0)"
+			:: "r"(p), "r"(zero) : "memory");
+	}
+
+	__asm__ volatile("sfence" ::: "memory");
+}
+
+void page_clear_cached(void* page, uint64_t size)
+{
+	ASSERT((MASK_4KIB(page) == (uint64_t)page) && (size & (_4_KIB - 1)) == 0);
+	memclr(page, size);
+}
+
+void page_clear(void* page, uint64_t size)
+{
+	if (page_use_nt(size))
+	{
+		page_clear_nt(page, size);
+	}
+	else
+	{
+		page_clear_cached(page, size);
+	}
+}
+
+void page_copy_nt(void* dst, const void* src, uint64_t size)
+{
+	ASSERT((MASK_4KIB(dst) == (uint64_t)dst) && (MASK_4KIB(src) == (uint64_t)src));
+	ASSERT((size & (_4_KIB - 1)) == 0);
+
+	uint8_t* d = (uint8_t*)dst;
+	const uint8_t* s = (const uint8_t*)src;
+	for (uint8_t* end = d + size; d < end; d += 64, s += 64)
+	{
+		// The source is read once, keep it out of the cache as well
+		__asm__ volatile(
+			"prefetchnta 256(%1)\n\t"
+			"movq 0(%1), %%r8\n\t"
+			"movq 8(%1), %%r9\n\t"
+			"movq 16(%1), %%r10\n\t"
+			"movq 24(%1), %%r11\n\t"
+			"movnti %%r8, 0(%0)\n\t"
+			"movnti %%r9, 8(%0)\n\t"
+			"movnti %%r10, 16(%0)\n\t"
+			"movnti %%r11, 24(%0)\n\t"
+			"movq 32(%1), %%r8\n\t"
+			"movq 40(%1), %%r9\n\t"
+			"movq 48(%1), %%r10\n\t"
+			"movq 56(%1), %%r11\n\t"
+			"movnti %%r8, 32(%0)\n\t"
+			"movnti %%r9, 40(%0)\n\t"
+			"movnti %%r10, 48(%0)\n\t"
+			"movnti %%r11, 56(%0)"
+			:: "r"(d), "r"(s) : "r8", "r9", "r10", "r11", "memory");
+	}
+
+	__asm__ volatile("sfence" ::: "memory");
+}
+
+void page_copy_cached(void* dst, const void* src, uint64_t size)
+{
+	ASSERT((MASK_4KIB(dst) == (uint64_t)dst) && (MASK_4KIB(src) == (uint64_t)src));
+	ASSERT((size & (_4_KIB - 1)) == 0);
+	memcpy(dst, src, size);
+}
+
+void page_copy(void* dst, const void* src, uint64_t size)
+{
+	if (page_use_nt(size))
+	{
+		page_copy_nt(dst, src, size);
+	}
+	else
+	{
+		page_copy_cached(dst, src, size);
+	}
+}
+
+#ifdef BENCH_PAGE_OPS
+#define BENCH_ROUNDS 16
+#define BENCH_MAX_HOT_FRAMES 16
+#define CACHE_LINE 64
+
+// Architectural performance monitoring, Intel SDM vol. 3 ch. 18
+#define MSR_PERFEVTSEL0 0x186
+#define MSR_PMC0 0xC1
+#define PERFEVT_LLC_MISSES 0x412E
+#define PERFEVT_USR (1 << 16)
+#define PERFEVT_OS (1 << 17)
+#define PERFEVT_EN (1 << 22)
+#define CPUID_A_EBX_NO_LLC_MISSES (1 << 4)
+
+static bool have_pmc = false;
+
+/* Start counting last level cache misses in PMC0, if the CPU has an
+ * architectural PMU that counts them.
+ */
+static
+void pmc_setup(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid_count(0, 0, &eax, &ebx, &ecx, &edx);
+	if (eax < 0xA)
+	{
+		return;
+	}
+
+	cpuid_count(0xA, 0, &eax, &ebx, &ecx, &edx);
+	const uint32_t version = eax & 0xFF;
+	const uint32_t num_counters = (eax >> 8) & 0xFF;
+	const uint32_t events = (eax >> 24) & 0xFF;
+	if (version == 0 || num_counters == 0 || events <= 4 ||
+			(ebx & CPUID_A_EBX_NO_LLC_MISSES))
+	{
+		return;
+	}
+
+	writemsr(MSR_PMC0, 0, 0);
+	writemsr(MSR_PERFEVTSEL0,
+			PERFEVT_LLC_MISSES | PERFEVT_USR | PERFEVT_OS | PERFEVT_EN, 0);
+	have_pmc = true;
+}
+
+static
+uint64_t pmc_read(void)
+{
+	if (!have_pmc)
+	{
+		return 0;
+	}
+
+	uint32_t lo, hi;
+	readmsr(MSR_PMC0, &lo, &hi);
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* Read one word from every cache line of the hot frames.
+ */
+static
+void touch_hot(uint8_t** frames, uint32_t num_frames)
+{
+	uint64_t sum = 0;
+	for (uint32_t f = 0; f < num_frames; ++f)
+	{
+		volatile const uint64_t* frame = (const uint64_t*)frames[f];
+		for (uint64_t off = 0; off < _2_MIB / 8; off += CACHE_LINE / 8)
+		{
+			sum += frame[off];
+		}
+	}
+	__asm__ volatile("" :: "r"(sum));
+}
+
+/* Clear or copy a page between two passes over the hot frames, and
+ * print the cost of the operation and of the pass that follows it.
+ */
+static
+void bench_one(const char* name, uint64_t size, bool copy, bool nt,
+		uint8_t* dst, const uint8_t* src, uint8_t** hot, uint32_t num_hot)
+{
+	uint64_t op_cycles = 0, work_cycles = 0, misses = 0;
+
+	for (uint32_t round = 0; round < BENCH_ROUNDS; ++round)
+	{
+		touch_hot(hot, num_hot);
+
+		const uint64_t start = _rdtsc();
+		if (copy && nt)
+		{
+			page_copy_nt(dst, src, size);
+		}
+		else if (copy)
+		{
+			page_copy_cached(dst, src, size);
+		}
+		else if (nt)
+		{
+			page_clear_nt(dst, size);
+		}
+		else
+		{
+			page_clear_cached(dst, size);
+		}
+		const uint64_t mid = _rdtsc();
+
+		const uint64_t miss_start = pmc_read();
+		touch_hot(hot, num_hot);
+		misses += pmc_read() - miss_start;
+		work_cycles += _rdtsc() - mid;
+		op_cycles += mid - start;
+	}
+
+	kprintf("Page bench %s %dKiB %s: %d cycles, next workload %d cycles %d LLC misses\n",
+			name, size / _1_KIB, nt ? "nt" : "cached", op_cycles / BENCH_ROUNDS,
+			work_cycles / BENCH_ROUNDS, misses / BENCH_ROUNDS);
+}
+
+void page_benchmark()
+{
+	pmc_setup();
+	if (!have_pmc)
+	{
+		kprintf("Page bench: no LLC miss counter, misses read as 0\n");
+	}
+
+	// The workload after each operation reuses half of the LLC
+	uint32_t num_hot = color_llc_size() / 2 / _2_MIB;
+	if (num_hot == 0)
+	{
+		num_hot = 1;
+	}
+	if (num_hot > BENCH_MAX_HOT_FRAMES)
+	{
+		num_hot = BENCH_MAX_HOT_FRAMES;
+	}
+
+	uint8_t* hot[BENCH_MAX_HOT_FRAMES];
+	for (uint32_t i = 0; i < num_hot; ++i)
+	{
+		hot[i] = (uint8_t*) phys_alloc_2MIB_safe("Page bench hot");
+	}
+
+	uint8_t* dst = (uint8_t*) phys_alloc_2MIB_safe("Page bench dst");
+	uint8_t* src = (uint8_t*) phys_alloc_2MIB_safe("Page bench src");
+
+	const uint64_t sizes[] = { _4_KIB, _2_MIB };
+	for (uint32_t s = 0; s < 2; ++s)
+	{
+		bench_one("clear", sizes[s], false, false, dst, src, hot, num_hot);
+		bench_one("clear", sizes[s], false, true, dst, src, hot, num_hot);
+		bench_one("copy", sizes[s], true, false, dst, src, hot, num_hot);
+		bench_one("copy", sizes[s], true, true, dst, src, hot, num_hot);
+		kprintf("Page bench %dKiB: heuristic picks %s\n", sizes[s] / _1_KIB,
+				page_use_nt(sizes[s]) ? "nt" : "cached");
+	}
+
+	if (have_pmc)
+	{
+		writemsr(MSR_PERFEVTSEL0, 0, 0);
+	}
+
+	phys_free_2MIB(src);
+	phys_free_2MIB(dst);
+	for (uint32_t i = 0; i < num_hot; ++i)
+	{
+		phys_free_2MIB(hot[i]);
+	}
+}
+#endif
@@ -0,0 +1,44 @@
+#ifndef __X86_64_MEMORY_PAGE_H__
+#define __X86_64_MEMORY_PAGE_H__
+
+#include "inttypes.h"
+
+/* Whole page clear and copy. The size must be a multiple of 4KiB and
+ * the addresses 4KiB aligned.
+ *
+ * page_clear() and page_copy() use non-temporal stores (movnti, which
+ * needs no SSE state) when the destination is too big to be useful in
+ * the cache, and plain cached stores otherwise. See page_use_nt().
+ * The _nt and _cached variants force one or the other.
+ *
+ * The non-temporal variants end with an sfence, so their stores are
+ * visible before the function returns.
+ */
+void page_clear(void* page, uint64_t size);
+void page_clear_nt(void* page, uint64_t size);
+void page_clear_cached(void* page, uint64_t size);
+
+void page_copy(void* dst, const void* src, uint64_t size);
+void page_copy_nt(void* dst, const void* src, uint64_t size);
+void page_copy_cached(void* dst, const void* src, uint64_t size);
+
+/* The heuristic used by page_clear() and page_copy(). Non-temporal
+ * stores win once the destination is a large share of the last level
+ * cache: caching it would evict more useful data than the caller will
+ * read back. Below that, the caller most likely touches the page right
+ * away (page tables, freshly faulted pages) and cached stores win.
+ *
+ * Returns:
+ *   True if a clear or copy of this size should bypass the cache.
+ */
+bool page_use_nt(uint64_t size);
+
+#ifdef BENCH_PAGE_OPS
+/* Time cached against non-temporal clears and copies of 4KiB and 2MiB
+ * pages, and count the last level cache misses of a workload that runs
+ * right after them.
+ */
+void page_benchmark(void);
+#endif
+
+#endif
@@ -1,9 +1,9 @@
 #include "paging.h"
 
 #include "mmap.h"
-#include "klib.h"
+#include "page.h"
 #include "safety.h"
-#include "kprintf.h"
+#include "log.h"
 #include "defines.h"
 #include "phys_alloc.h"
 
@@ -21,18 +21,11 @@
 void paging_init()
 {
 	// Find the highest address, this will be what needs to be
-	// identity mapped.
-	uint64_t max_addr = 0;
-	for (int32_t i = 0; i < mmap_length; ++i)
-	{
-		const uint64_t high_address = mmap_array[i].base + 
-			mmap_array[i].length;
-
-		if (high_address > max_addr)
-		{
-			max_addr = high_address;
-		}
-	}
+	// identity mapped. The mmap_array is sorted so it's the end
+	// of the last entry.
+	ASSERT(mmap_length > 0);
+	uint64_t max_addr = mmap_array[mmap_length-1].base +
+		mmap_array[mmap_length-1].length;
 
 	// Need to do some math to figure out how much extra space is
 	// needed for this initial mapping. The problem is if extra
@@ -43,7 +36,7 @@ void paging_init()
 	// We'll allocate as many 2MiB pages as possible
 	max_addr = ALIGN_2MIB(max_addr);
 
-	kprintf("Max Address: 0x%x\n", max_addr);
+	log_debug(PAGING, "Max Address: 0x%x\n", max_addr);
 
 	// The kernel already identity maps the first 1 GIB of RAM
 	// so no extra pages are needed, in fact some mappings can
@@ -55,103 +48,75 @@ void paging_init()
 		uint64_t paddr = 0;
 		while (phys_addr < _1_GIB)
 		{
-			kprintf("Umapping\n");
+			log_debug(PAGING, "Umapping\n");
 			kunmap_page(phys_addr, &paddr);
 			phys_addr += _2_MIB;
 		}
 	}
-	else
+	else if (max_addr > _1_GIB)
 	{
 		// Now we need to figure out how many extra page tables are
-		// needed to do this mapping.
-		max_addr -= _1_GIB; // We already have this much mapped
-		const uint64_t num_pages = max_addr / _2_MIB;
-		const uint64_t num_pd_tables = num_pages / PDT_ENTRIES;
+		// needed to do this mapping. GiB 0 is mapped by kernel_PDT,
+		// GiB N needs a PD table, and every 512 GiB past the first
+		// needs a PDP table as kernel_PDPTE covers the first.
+		const uint64_t num_pages = (max_addr - _1_GIB) / _2_MIB;
+		const uint64_t num_pd_tables = (num_pages + PDT_ENTRIES - 1) / PDT_ENTRIES;
 		const uint64_t num_pdp_tables = num_pd_tables / PDPT_ENTRIES;
 
-		// TODO - Take into account the kernel_PDPTE
-
-		kprintf("Num pages: %d - PD %d PDP %d\n", num_pages, num_pd_tables, num_pdp_tables);
+		log_debug(PAGING, "Num pages: %d - PD %d PDP %d\n", num_pages, num_pd_tables, num_pdp_tables);
 
 		// Each table is 4KiB in size, so add up the total amount of space
-		// needed and check to make sure that is available after the kernel.
+		// needed and take it from the memory right after the kernel.
 		const uint64_t total_space_needed = num_pd_tables*sizeof(PD_Table) + 
 			num_pdp_tables*sizeof(PDP_Table);
 
-		extern uint64_t* __KERNEL_ALL_HI;
-		const uint64_t start_addr = ALIGN_4KIB((uint64_t)&__KERNEL_ALL_HI);
+		const uint64_t start_addr = mmap_boot_end();
 		const uint64_t end_addr = start_addr + total_space_needed;
 
-		// Check each mmap_array entry, and then fix it as appropriate
-		for (int32_t i = 0; i < mmap_length; ++i)
+		const int32_t region = mmap_find(start_addr);
+		if (region < 0 || end_addr > mmap_array[region].base + mmap_array[region].length)
 		{
-			uint64_t base = mmap_array[i].base;
-			uint64_t end = base + mmap_array[i].length;
-			if (base <= start_addr && end >= end_addr)
-			{
-				base = end_addr;
-			}
-
-			if (end - base == 0)
-			{
-				// Remove this entry
-				for (int32_t j = i; j < mmap_length-1; ++j)
-				{
-					mmap_array[j] = mmap_array[j+1];
-				}
-				--mmap_length;
-				break;
-			}
-
-			mmap_array[i].base = base;
-			mmap_array[i].length = end - base;
+			panic("No room for the identity map page tables");
 		}
+		mmap_reserve(start_addr, total_space_needed);
 
 		// Now have to go through and fill in the tables.
 		// First we'll fill in the lowest level tables, then
 		// the next lowest, etc.
-		memclr((void*)start_addr, end_addr - start_addr);
+		page_clear((void*)start_addr, total_space_needed);
 
-		// The default mapping starts at 1GiB
+		// The PD tables are contiguous, so fill them as one array.
+		// The default mapping starts at 1GiB.
 		uint64_t phys_addr = _1_GIB;
-		PD_Table* pdt = (PD_Table*)start_addr;
+		PD_Entry* pd_entries = (PD_Entry*)start_addr;
 		for (uint64_t i = 0; i < num_pages; ++i)
 		{
-			pdt->entries[i] = phys_addr | PDT_PAGE_SIZE | PDT_WRITABLE | PDT_PRESENT;	
-			invlpg(phys_addr);
+			pd_entries[i] = phys_addr | PDT_PAGE_SIZE | PDT_WRITABLE | PDT_PRESENT;	
 			phys_addr += _2_MIB;
 		}
 
-		// Fill the first 511 entries in the existing kernel_PDP table
-		extern PDP_Table kernel_PDPTE;
-		for (uint64_t i = 0; i < num_pd_tables || i < PDPT_ENTRIES-1; ++i)
+		// PDP tables start after all the PD tables
+		PDP_Table* pdp_tables = (PDP_Table*)(start_addr + num_pd_tables*sizeof(PD_Table));
+		for (uint64_t i = 0; i < num_pd_tables; ++i)
 		{
+			const uint64_t gib = i + 1;
 			const uint64_t pdt_addr = start_addr + i*sizeof(PD_Table);
-			kernel_PDPTE.entries[i+1] = pdt_addr | PDPT_WRITABLE | PDPT_PRESENT;	
-			invlpg(pdt_addr);
-		}
-
-		// The rest will use the allocated space
-		if (num_pd_tables > PDPT_ENTRIES-1)
-		{
-			// PDP tables start after all the PD tables
-			PDP_Table* pdpt = (PDP_Table*)(start_addr + num_pd_tables*sizeof(PD_Table));
-			for (uint64_t i = PDPT_ENTRIES-1; i < num_pd_tables; ++i)
-			{
-				const uint64_t pdt_addr = start_addr + i*sizeof(PD_Table);
-				pdpt->entries[i] = pdt_addr | PDPT_WRITABLE | PDPT_PRESENT;
-				invlpg(pdt_addr);
-			}
+			PDP_Table* pdpt = (gib < PDPT_ENTRIES) ? &kernel_PDPTE :
+				&pdp_tables[gib / PDPT_ENTRIES - 1];
+			pdpt->entries[gib % PDPT_ENTRIES] = pdt_addr | PDPT_WRITABLE | PDPT_PRESENT;
 		}
 
 		// Fill in the PML4 table
-		const uint64_t pdpt_start_offset = start_addr + num_pd_tables*sizeof(PD_Table);
 		for (uint64_t i = 0; i < num_pdp_tables; ++i)
 		{
-			const uint64_t pdpt_addr = pdpt_start_offset + i*sizeof(PDP_Table);
+			const uint64_t pdpt_addr = (uint64_t)&pdp_tables[i];
 			kernel_PML4.entries[i+1] = pdpt_addr | PML4_WRITABLE | PML4_PRESENT;
-			invlpg(pdpt_addr);
 		}
+
+		// Only not-present entries changed, but flush anyway to be safe
+#ifndef HOST_BUILD
+		__asm__ volatile ("mov %%cr3, %%rax\n\tmov %%rax, %%cr3" ::: "rax", "memory");
+#endif
 	}
 
 	// Now all of physical RAM is identity mapped
@@ -179,7 +144,7 @@ uint8_t map_page(PML4_Table* pml4, uint64_t virt_addr, uint64_t phys_addr,
 		PDP_Table* pdp = (PDP_Table*) phys_alloc_4KIB();
 		if (pdp == NULL) { return 0; }
 
-		memclr(pdp, sizeof(PDP_Table));
+		page_clear(pdp, sizeof(PDP_Table));
 
 		pml4->entries[pml4_index] = (uint64_t)pdp | PML4_WRITABLE | PML4_PRESENT;
 
@@ -193,7 +158,7 @@ uint8_t map_page(PML4_Table* pml4, uint64_t virt_addr, uint64_t phys_addr,
 		PD_Table* pd = (PD_Table*) phys_alloc_4KIB();
 		if (pd == NULL) { return 0; }
 
-		memclr(pd, sizeof(PD_Table));
+		page_clear(pd, sizeof(PD_Table));
 		pdp->entries[pdpt_index] = (uint64_t)pd | PDPT_WRITABLE | PDPT_PRESENT;
 
 		// TODO - is this necessary here?
@@ -208,8 +173,8 @@ uint8_t map_page(PML4_Table* pml4, uint64_t virt_addr, uint64_t phys_addr,
 	if ((pd->entries[pdt_index] & PDT_PAGE_SIZE) > 0 &&
 			(pd->entries[pdt_index] & PDT_PRESENT) > 0)
 	{
-		kprintf("VA: 0x%x - PA: 0x%x\n", virt_addr, phys_addr);
-		kprintf("PD Entry: 0x%x\n", pd->entries[pdt_index]);
+		log_error(PAGING, "VA: 0x%x - PA: 0x%x\n", virt_addr, phys_addr);
+		log_error(PAGING, "PD Entry: 0x%x\n", pd->entries[pdt_index]);
 		panic("Double mapping");
 	}
 
@@ -225,7 +190,7 @@ uint8_t map_page(PML4_Table* pml4, uint64_t virt_addr, uint64_t phys_addr,
 			P_Table* pt = (P_Table*) phys_alloc_4KIB();
 			if (pt == NULL) { return 0; }
 
-			memclr(pt, sizeof(P_Table));
+			page_clear(pt, sizeof(P_Table));
 			pd->entries[pdt_index] = (uint64_t)pt | PDT_WRITABLE | PDT_PRESENT | flags;
 
 			// TODO - is this necessary here?
@@ -235,8 +200,8 @@ uint8_t map_page(PML4_Table* pml4, uint64_t virt_addr, uint64_t phys_addr,
 		P_Table* pt = PDTE_TO_PT(pd->entries[pdt_index]);
 		if ((pt->entries[pt_index] & PT_PRESENT) > 0)
 		{
-			kprintf("VA: 0x%x - PA: 0x%x\n", virt_addr, phys_addr);
-			kprintf("PT Entry: 0x%x\n", pt->entries[pt_index]);
+			log_error(PAGING, "VA: 0x%x - PA: 0x%x\n", virt_addr, phys_addr);
+			log_error(PAGING, "PT Entry: 0x%x\n", pt->entries[pt_index]);
 			panic("Double mapping");
 		}
 
@@ -277,11 +242,13 @@ void map_page_auto(PML4_Table* pml4, uint64_t virt_addr, uint64_t flags,
 	if (page_size == PAGE_4KIB)
 	{
 		const uint64_t phys_addr = (uint64_t)phys_alloc_4KIB_safe("map_page_auto_4KIB");
+		page_clear((void*)phys_addr, _4_KIB);
 		ret = map_page(pml4, virt_addr, phys_addr, flags, page_size);
 	}
 	else if (page_size == PAGE_2MIB)
 	{
 		const uint64_t phys_addr = (uint64_t)phys_alloc_2MIB_safe("map_page_auto_2MIB");
+		page_clear((void*)phys_addr, _2_MIB);
 		ret = map_page(pml4, virt_addr, phys_addr, flags, page_size);
 	}
 	else
@@ -295,9 +262,12 @@ void map_page_auto(PML4_Table* pml4, uint64_t virt_addr, uint64_t flags,
 	}
 }
 
+/* Clear the entry of a virtual address. The TLB entry is queued on
+ * the batch, or shot down right away when there is none.
+ */
 static 
 uint8_t private_unmap_page(PML4_Table* pml4, uint64_t virt_addr, 
-			uint64_t* phys_addr, uint64_t* page_type)
+			uint64_t* phys_addr, uint64_t* page_type, TlbBatch* batch)
 {
 	// Calculate the entries
 	const uint64_t pml4_index = PML4_INDEX(virt_addr);
@@ -340,12 +310,18 @@ uint8_t private_unmap_page(PML4_Table* pml4, uint64_t virt_addr,
 		}
 
 		*phys_addr = ENTRY_TO_ADDR(pt->entries[pt_index]);
-		*page_type = PAGE_2MIB;
+		*page_type = PAGE_4KIB;
 		pt->entries[pt_index] = 0;
 	}
 
-	// TODO need to do more than this?
-	invlpg(virt_addr);
+	if (batch != NULL)
+	{
+		tlb_batch_add(batch, virt_addr);
+	}
+	else
+	{
+		tlb_flush_page(pml4, virt_addr);
+	}
 
 	return 1;
 }
@@ -353,14 +329,20 @@ uint8_t private_unmap_page(PML4_Table* pml4, uint64_t virt_addr,
 uint8_t unmap_page(PML4_Table* pml4, uint64_t virt_addr, uint64_t* phys_addr)
 {
 	uint64_t page_type = 0;
-	return private_unmap_page(pml4, virt_addr, phys_addr, &page_type);
+	return private_unmap_page(pml4, virt_addr, phys_addr, &page_type, NULL);
+}
+
+uint8_t unmap_page_batched(TlbBatch* batch, uint64_t virt_addr, uint64_t* phys_addr)
+{
+	uint64_t page_type = 0;
+	return private_unmap_page(batch->pml4, virt_addr, phys_addr, &page_type, batch);
 }
 
 void unmap_page_auto(PML4_Table* pml4, uint64_t virt_addr)
 {
 	uint64_t phys_addr = 0;
 	uint64_t page_type = 0;
-	const uint8_t ret = private_unmap_page(pml4, virt_addr, &phys_addr, &page_type);
+	const uint8_t ret = private_unmap_page(pml4, virt_addr, &phys_addr, &page_type, NULL);
 	if (!ret) { return; }
 
 	if (page_type == PAGE_2MIB)
@@ -400,7 +382,7 @@ uint8_t virt_to_phys(PML4_Table* pml4, uint64_t virt_addr, uint64_t* out_phys)
 			{
 				if ((pdt_entry & PDT_PAGE_SIZE) > 0)
 				{
-					*out_phys = ENTRY_TO_ADDR(pdt_entry) + (virt_addr & 0xFFF);
+					*out_phys = MASK_2MIB(ENTRY_TO_ADDR(pdt_entry)) + (virt_addr & 0x1FFFFF);
 					return 1;
 				}
 				else
@@ -1,6 +1,7 @@
 #ifndef __X86_64_MEMORY_PAGING__
 #define __X86_64_MEMORY_PAGING__
 
+#include "tlb.h"
 #include "types.h"
 #include "inttypes.h"
 
@@ -16,9 +17,13 @@ extern PDP_Table kernel_PDPTE;
  */
 extern PD_Table kernel_PDT;
 
-/* Invalidate a virtual address
+/* Invalidate a virtual address. The host build has no TLB to flush.
  */
+#ifdef HOST_BUILD
+#define invlpg(X) ((void)(X))
+#else
 #define invlpg(X) __asm__ volatile("invlpg %0" :: "m" (X))
+#endif
 
 /* Identity maps from the start of memory 0x00000000 to end of
  * physical RAM. The end if physical RAM is determined from the
@@ -88,7 +93,8 @@ void map_page_auto(PML4_Table* pml4, uint64_t virt_addr, uint64_t flags,
 	map_page_auto(&kernel_PML4, (VADDR), (FLAGS), (PSIZE))
 
 /* Unmaps a virtual address. Does not free the physical backing store,
- * only clears the entry in the table structure.
+ * only clears the entry in the table structure and invalidates it in the
+ * TLB of every CPU that may have it cached.
  *
  * Params:
  *   pml4      - Top most page table structure, the PML4 table
@@ -105,6 +111,21 @@ uint8_t unmap_page(PML4_Table* pml4, uint64_t virt_addr, uint64_t* phys_addr);
 /* Same as map_page_auto, but substitutes kernel_PML4 for the pml4 parameter */
 #define kunmap_page(VADDR, PADDR) unmap_page(&kernel_PML4, (VADDR), (PADDR))
 
+/* Same as unmap_page, but only queues the TLB invalidation on a batch
+ * instead of interrupting the other CPUs for every page. Stale entries
+ * may still reach the page until tlb_batch_flush(), the physical page
+ * must not be reused before then.
+ *
+ * Params:
+ *   batch     - Batch of the address space to unmap from
+ *   virt_addr - The virtual address
+ *   phys_addr - Out parameter, contains the physical address
+ *
+ * Returns:
+ *   Same as unmap_page.
+ */
+uint8_t unmap_page_batched(TlbBatch* batch, uint64_t virt_addr, uint64_t* phys_addr);
+
 /* Similar to unmap_page(), but will use the physical allocator to
  * free the physical location. Should only be used when the page was
  * mapped with map_page_auto(). Causes a kernel panic if the virtual
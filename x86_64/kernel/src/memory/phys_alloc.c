@@ -1,16 +1,14 @@
 #include "mmap.h"
+#include "numa.h"
 #include "defines.h"
 #include "phys_alloc.h"
 #include "inttypes.h"
 #include "stack.h"
 #include "safety.h"
-#include "kprintf.h"
-
-#ifndef DEBUG_PHYS_ALLOC
-#define kprintf(...)
-#endif
-
-static Stack stack_2MIB;
+#include "log.h"
+#include "trace/trace.h"
+#include "klib.h"
+#include "sync/spinlock.h"
 
 typedef struct _Pool
 {
@@ -22,9 +20,21 @@ typedef struct _Pool
 	struct _Pool* prev;
 
 	uint8_t on_list;
+	uint32_t node;
 } Pool;
 
-static Pool* pool_4KIB;
+// Every NUMA node has its own free lists, so memory is only handed out
+// from a remote node once the local one is exhausted. The lock covers
+// the free lists and the statistics.
+typedef struct
+{
+	Spinlock lock;
+	Stack stack_2MIB;
+	Pool* pool_4KIB;
+	PhysNodeStats stats;
+} PhysNode;
+
+static PhysNode phys_nodes[NUMA_MAX_NODES];
 
 #ifdef TEST_PHYS_ALLOC_2MIB
 #ifdef TEST_PHYS_ALLOC_4KIB
@@ -52,8 +62,16 @@ void setup_physical_allocator()
 	// address space. Therefore in order to get a physical address the kernel's
 	// base address needs to be added to it.
 	
-	stack_init(&stack_2MIB);
-	pool_4KIB = NULL;
+	for (uint32_t n = 0; n < NUMA_MAX_NODES; ++n)
+	{
+		spin_init(&phys_nodes[n].lock, "phys_alloc");
+		stack_init(&phys_nodes[n].stack_2MIB);
+		phys_nodes[n].pool_4KIB = NULL;
+		memclr(&phys_nodes[n].stats, sizeof(PhysNodeStats));
+	}
+
+	// The usable regions belong to the allocator from here on
+	mmap_seal();
 
 	uint64_t wasted_ram = 0;
 	uint64_t allocatable_ram = 0;
@@ -79,12 +97,15 @@ void setup_physical_allocator()
 			continue;
 		}
 
-		// Okay we can place something here
+		// Okay we can place something here, numa_init() has already split
+		// the regions so that each one lies within a single node.
+		PhysNode* pn = &phys_nodes[mmap_array[i].node];
 		uint64_t count = 0;
 		do
 		{
 			StackNode* node = (StackNode*) base;
-			stack_push(&stack_2MIB, node);
+			stack_push(&pn->stack_2MIB, node);
+			++pn->stats.frames_2MIB;
 			++count;
 			allocatable_ram += _2_MIB;
 
@@ -96,7 +117,7 @@ void setup_physical_allocator()
 		wasted_ram += length;
 	}
 
-	kprintf("PhysAlloc: Total wasted ram: %d\n", wasted_ram);
+	log_debug(PHYS_ALLOC, "PhysAlloc: Total wasted ram: %d\n", wasted_ram);
 
 #ifdef TEST_PHYS_ALLOC_2MIB
 	test_2MIB_alloc();
@@ -110,24 +131,25 @@ void setup_physical_allocator()
 #ifdef TEST_PHYS_ALLOC_2MIB
 void test_2MIB_alloc()
 {
-	kprintf("Stack Size: %u  \n", stack_size(&stack_2MIB));
+	Stack* stack_2MIB = &phys_nodes[numa_local_node()].stack_2MIB;
+	log_debug(PHYS_ALLOC, "Stack Size: %u  \n", stack_size(stack_2MIB));
 	uint64_t total_allocated = 0;
 
 	void* ptr = phys_alloc_2MIB();
-	kprintf("Address: 0x%x - Left: %u   \n", ptr, stack_size(&stack_2MIB));
+	log_debug(PHYS_ALLOC, "Address: 0x%x - Left: %u   \n", ptr, stack_size(stack_2MIB));
 	while (ptr != NULL)
 	{
 		uint64_t* p = (uint64_t*)ptr;
-		kprintf("Address: 0x%x - Left: %u   \n", p, stack_size(&stack_2MIB));
+		log_debug(PHYS_ALLOC, "Address: 0x%x - Left: %u   \n", p, stack_size(stack_2MIB));
 		*p = 10;
 		ptr = phys_alloc_2MIB();
 		total_allocated += 2;
 	}
 
-	kprintf("Next: 0x%x \n", ptr);
+	log_debug(PHYS_ALLOC, "Next: 0x%x \n", ptr);
 
-	kprintf("Passed 2MiB Test            \n");
-	kprintf("Successfully allocated %dMiB\n");
+	log_debug(PHYS_ALLOC, "Passed 2MiB Test            \n");
+	log_debug(PHYS_ALLOC, "Successfully allocated %dMiB\n", total_allocated);
 	__asm__("hlt");
 }
 #endif
@@ -136,36 +158,70 @@ void test_2MIB_alloc()
 void test_4KIB_alloc()
 {
 	void* ptr = phys_alloc_4KIB();
-	kprintf("Start: 0x%x  \n", ptr);
+	log_debug(PHYS_ALLOC, "Start: 0x%x  \n", ptr);
 	uint64_t total_allocated = 0;
 	while (ptr != NULL)
 	{
 		uint64_t* p = (uint64_t*)ptr;
-		kprintf("Address: 0x%x\n", p);
+		log_debug(PHYS_ALLOC, "Address: 0x%x\n", p);
 		*p = 10;
 		ptr = phys_alloc_4KIB();
 		total_allocated += 4;
 	}
 
-	kprintf("Passed 4KiB Test            \n");
-	kprintf("Successfully allocated %dMiB\n", total_allocated / 1024);
+	log_debug(PHYS_ALLOC, "Passed 4KiB Test            \n");
+	log_debug(PHYS_ALLOC, "Successfully allocated %dMiB\n", total_allocated / 1024);
 	__asm__("hlt");
 }
 #endif
 
-void* phys_alloc_2MIB()
+/* Take a 2MiB frame from one node only, NULL if the node has none left.
+ *
+ * Params:
+ *   node      - Node to take the frame from
+ *   requester - Node the caller asked for, for the statistics
+ */
+static void* node_alloc_2MIB(uint32_t node, uint32_t requester)
 {
-	void* retVal = stack_pop(&stack_2MIB);
-	if (retVal == 0)
+	PhysNode* pn = &phys_nodes[node];
+	const uint64_t flags = spin_lock_irqsave(&pn->lock);
+
+	void* retVal = stack_pop(&pn->stack_2MIB);
+	if (retVal != NULL)
 	{
-		return NULL;
+		++pn->stats.alloc_2MIB;
+		if (node != requester)
+		{
+			++pn->stats.remote_alloc;
+		}
 	}
 
-	void* final_value = retVal;
+	spin_unlock_irqrestore(&pn->lock, flags);
+	return retVal;
+}
 
-	kprintf("2MIB: 0x%x \n", final_value);
+void* phys_alloc_2MIB_node(uint32_t node)
+{
+	// Walk the nodes from nearest to furthest
+	const uint8_t* order = numa_fallback_order(node);
+	const uint32_t count = numa_node_count();
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		void* retVal = node_alloc_2MIB(order[i], node);
+		if (retVal != NULL)
+		{
+			log_debug(PHYS_ALLOC, "2MIB: 0x%x \n", retVal);
+			TRACE(PHYS_ALLOC_2MIB, retVal, order[i]);
+			return retVal;
+		}
+	}
+
+	return NULL;
+}
 
-	return final_value;
+void* phys_alloc_2MIB()
+{
+	return phys_alloc_2MIB_node(numa_local_node());
 }
 
 void* phys_alloc_2MIB_safe(const char* error)
@@ -181,11 +237,18 @@ void* phys_alloc_2MIB_safe(const char* error)
 
 void phys_free_2MIB(void* ptr)
 {
-	const uint64_t address = (uint64_t)ptr;
-	stack_push(&stack_2MIB, (void*)MASK_2MIB(address));
+	const uint64_t address = MASK_2MIB((uint64_t)ptr);
+	PhysNode* pn = &phys_nodes[numa_node_of(address)];
+
+	TRACE(PHYS_FREE_2MIB, address, numa_node_of(address));
+
+	const uint64_t flags = spin_lock_irqsave(&pn->lock);
+	++pn->stats.free_2MIB;
+	stack_push(&pn->stack_2MIB, (void*)address);
+	spin_unlock_irqrestore(&pn->lock, flags);
 }
 
-static void pool_init(Pool* pool)
+static void pool_init(Pool* pool, uint32_t node)
 {
 	stack_init(&pool->free_stack);	
 	pool->implicit_next = (void*) ((uint64_t)pool + _4_KIB);
@@ -193,13 +256,14 @@ static void pool_init(Pool* pool)
 	pool->next = NULL;
 	pool->prev = NULL;
 	pool->on_list = 0;
-
-	kprintf("POOL INIT\n");
-	kprintf("implicit_next: 0x%x\n", pool->implicit_next);
-	kprintf("max_address:   0x%x\n", pool->max_address);
-	kprintf("next:          0x%x\n", pool->next);
-	kprintf("prev:          0x%x\n", pool->prev);
-	kprintf("on_list:       0x%x\n", pool->on_list);
+	pool->node = node;
+
+	log_debug(PHYS_ALLOC, "POOL INIT\n");
+	log_debug(PHYS_ALLOC, "implicit_next: 0x%x\n", pool->implicit_next);
+	log_debug(PHYS_ALLOC, "max_address:   0x%x\n", pool->max_address);
+	log_debug(PHYS_ALLOC, "next:          0x%x\n", pool->next);
+	log_debug(PHYS_ALLOC, "prev:          0x%x\n", pool->prev);
+	log_debug(PHYS_ALLOC, "on_list:       0x%x\n", pool->on_list);
 }
 
 static uint8_t pool_empty(Pool* pool)
@@ -210,11 +274,6 @@ static uint8_t pool_empty(Pool* pool)
 
 static uint8_t pool_full(Pool* pool)
 {
-	/*if (pool->implicit_next < pool->max_address)
-	{
-		panic("Something wrong with pool!");
-	}
-	*/
 	const uint64_t entries_free = stack_size(&pool->free_stack);
 	if (entries_free == 511)
 	{
@@ -228,7 +287,7 @@ static void pool_free(Pool* pool, void* ptr)
 {
 	if (ptr <= (void*)pool || ptr >= pool->max_address)
 	{
-		kprintf("POOL: 0x%x - PTR: 0x%x - MAX: 0x%x \n", pool, ptr, pool->max_address);
+		log_debug(PHYS_ALLOC, "POOL: 0x%x - PTR: 0x%x - MAX: 0x%x \n", pool, ptr, pool->max_address);
 		panic("Pool freeing bad ptr");
 	}
 
@@ -255,37 +314,77 @@ static void* pool_alloc(Pool* pool)
 	}
 }
 
-void* phys_alloc_4KIB()
+/* Take a 4KiB frame from one node only. Splits one of the node's 2MiB
+ * frames into a new pool when needed, NULL if the node has no memory.
+ *
+ * Params:
+ *   node      - Node to take the frame from
+ *   requester - Node the caller asked for, for the statistics
+ */
+static void* node_alloc_4KIB(uint32_t node, uint32_t requester)
 {
-	if (pool_4KIB == NULL)
+	PhysNode* pn = &phys_nodes[node];
+	const uint64_t flags = spin_lock_irqsave(&pn->lock);
+	if (pn->pool_4KIB == NULL)
 	{
-		pool_4KIB = (Pool*) phys_alloc_2MIB();
-		ASSERT(pool_4KIB != NULL);
-		if (pool_4KIB == NULL)
+		Pool* pool = (Pool*) stack_pop(&pn->stack_2MIB);
+		if (pool == NULL)
 		{
+			spin_unlock_irqrestore(&pn->lock, flags);
 			return NULL;
 		}
 
-		pool_4KIB = (Pool*) pool_4KIB;
+		pool_init(pool, node);
+		pool->on_list = 1;
+		pn->pool_4KIB = pool;
+	}
 
-		pool_init(pool_4KIB);
-		pool_4KIB->on_list = 1;
+	void* retVal = pool_alloc(pn->pool_4KIB);
+	if (pool_empty(pn->pool_4KIB))
+	{
+		Pool* p_next = pn->pool_4KIB->next;
+		pn->pool_4KIB->on_list = 0;
+		pn->pool_4KIB->next = NULL;
+		pn->pool_4KIB->prev = NULL;
+
+		pn->pool_4KIB = p_next;
+		if (p_next != NULL)
+		{
+			p_next->prev = NULL;
+		}
 	}
 
-	uint64_t retVal = (uint64_t) pool_alloc(pool_4KIB);	
-	if (pool_empty(pool_4KIB))
+	++pn->stats.alloc_4KIB;
+	if (node != requester)
 	{
-		Pool* p_next = pool_4KIB->next;
-		pool_4KIB->on_list = 0;
-		pool_4KIB->next = NULL;
-		pool_4KIB->prev = NULL;
+		++pn->stats.remote_alloc;
+	}
+
+	spin_unlock_irqrestore(&pn->lock, flags);
+	return retVal;
+}
 
-		pool_4KIB = p_next;
+void* phys_alloc_4KIB_node(uint32_t node)
+{
+	const uint8_t* order = numa_fallback_order(node);
+	const uint32_t count = numa_node_count();
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		void* retVal = node_alloc_4KIB(order[i], node);
+		if (retVal != NULL)
+		{
+			log_debug(PHYS_ALLOC, "4KIB: 0x%x \n", retVal);
+			TRACE(PHYS_ALLOC_4KIB, retVal, order[i]);
+			return retVal;
+		}
 	}
 
-	void* final_value = (void*) retVal;
-	kprintf("4KIB: 0x%x \n", final_value);
-	return final_value;
+	return NULL;
+}
+
+void* phys_alloc_4KIB()
+{
+	return phys_alloc_4KIB_node(numa_local_node());
 }
 
 void* phys_alloc_4KIB_safe(const char* error)
@@ -304,13 +403,13 @@ void phys_free_4KIB(void* ptr)
 	// Figure out which pool it belongs to	
 	const uint64_t address = (uint64_t) ptr;
 	Pool* pool = (Pool*) MASK_2MIB(address);
+	PhysNode* pn = &phys_nodes[pool->node];
 
-	pool_free(pool, (void*)address);
+	TRACE(PHYS_FREE_4KIB, address, pool->node);
 
-	if (pool_4KIB == NULL)
-	{
-		panic("phys_free_4KIB bad free");
-	}
+	const uint64_t flags = spin_lock_irqsave(&pn->lock);
+	pool_free(pool, (void*)address);
+	++pn->stats.free_4KIB;
 
 	// Check if this pool is already in the pool list	
 	if (pool->on_list && pool_full(pool))
@@ -318,13 +417,13 @@ void phys_free_4KIB(void* ptr)
 		// We need to remove it from the list and free the 2MIB
 		// chunk of memory it's using
 
-		if (pool_4KIB == pool)
+		if (pn->pool_4KIB == pool)
 		{
 			// It's the head of the list
-			pool_4KIB = pool_4KIB->next;
-			if (pool_4KIB != NULL)
+			pn->pool_4KIB = pool->next;
+			if (pn->pool_4KIB != NULL)
 			{
-				pool_4KIB->prev = NULL;
+				pn->pool_4KIB->prev = NULL;
 			}
 		}
 		else
@@ -344,18 +443,44 @@ void phys_free_4KIB(void* ptr)
 			}
 		}
 
-		// Reset the pool just in case
-		pool_init(pool);
-		phys_free_2MIB(pool);
+		// Reset the pool just in case, then hand the frame straight back
+		// to the node it came from.
+		pool_init(pool, pool->node);
+		stack_push(&pn->stack_2MIB, (StackNode*)pool);
 	}
 	else if (!pool->on_list)
 	{
 		// Add to the head of the list
-		pool_4KIB->prev = pool;
-		pool->next = pool_4KIB;
+		pool->next = pn->pool_4KIB;
 		pool->prev = NULL;
+		if (pn->pool_4KIB != NULL)
+		{
+			pn->pool_4KIB->prev = pool;
+		}
+
+		pn->pool_4KIB = pool;
+		pool->on_list = 1;
+	}
 
-		pool_4KIB = pool;
-		pool_4KIB->on_list = 1;
+	spin_unlock_irqrestore(&pn->lock, flags);
+}
+
+const PhysNodeStats* phys_alloc_node_stats(uint32_t node)
+{
+	ASSERT(node < numa_node_count());
+	return &phys_nodes[node].stats;
+}
+
+void phys_alloc_dump_stats()
+{
+	const uint32_t count = numa_node_count();
+	for (uint32_t n = 0; n < count; ++n)
+	{
+		const PhysNode* pn = &phys_nodes[n];
+		log_info(PHYS_ALLOC, "Node %d: %d/%d 2MiB free - 2MiB a/f %d/%d - 4KiB a/f %d/%d - remote %d\n",
+				n, stack_size(&pn->stack_2MIB), pn->stats.frames_2MIB,
+				pn->stats.alloc_2MIB, pn->stats.free_2MIB,
+				pn->stats.alloc_4KIB, pn->stats.free_4KIB,
+				pn->stats.remote_alloc);
 	}
 }
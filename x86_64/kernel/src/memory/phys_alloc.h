@@ -1,8 +1,30 @@
 #ifndef __X86_64_VIRT_MEMORY_PHYS_ALLOC_H__
 #define __X86_64_VIRT_MEMORY_PHYS_ALLOC_H__
 
+#include "inttypes.h"
+
+// Per NUMA node allocator statistics
+typedef struct
+{
+	uint64_t frames_2MIB;  // 2MiB frames the node started with
+	uint64_t alloc_2MIB;
+	uint64_t free_2MIB;
+	uint64_t alloc_4KIB;
+	uint64_t free_4KIB;
+	uint64_t remote_alloc; // Allocations this node served for another node
+} PhysNodeStats;
+
+/* Build the free lists of every NUMA node from the mmap_array.
+ */
 void setup_physical_allocator(void);
 
+/* Allocate from a specific node, falling back to other nodes in order
+ * of distance. The plain phys_alloc_* functions use the local node.
+ */
+void* phys_alloc_2MIB_node(uint32_t node);
+
+void* phys_alloc_4KIB_node(uint32_t node);
+
 void* phys_alloc_2MIB(void);
 
 void* phys_alloc_2MIB_safe(const char* error);
@@ -15,4 +37,12 @@ void* phys_alloc_4KIB_safe(const char* error);
 
 void phys_free_4KIB(void* ptr);
 
+/* Get the allocation statistics of a node.
+ */
+const PhysNodeStats* phys_alloc_node_stats(uint32_t node);
+
+/* Print the allocation statistics of every node.
+ */
+void phys_alloc_dump_stats(void);
+
 #endif
@@ -0,0 +1,450 @@
+#include "slab.h"
+
+#include "defines.h"
+#include "phys_alloc.h"
+#include "safety.h"
+#include "support.h"
+#include "kprintf.h"
+
+// Marks the start of every slab, the large variant is also used to tell
+// 2MiB slabs apart from 4KiB slabs when freeing.
+#define SLAB_MAGIC       0x51AB51AB51AB0004ULL
+#define SLAB_MAGIC_LARGE 0x51AB51AB51AB0200ULL
+
+// A slab may waste at most 1/8th of a page before 2MiB slabs are used
+#define SLAB_MAX_WASTE_SHIFT 3
+
+typedef struct _Slab
+{
+	uint64_t magic;
+	SlabCache* cache;
+	struct _Slab* next;
+	struct _Slab* prev;
+	void* free;
+	uint32_t in_use;
+	uint32_t reserved;
+} Slab;
+
+COMPILE_ASSERT(sizeof(Slab) == 48);
+
+// kmalloc() size classes. Powers of two plus the midpoints between them
+// above 32 bytes, so no more than a third of a block is wasted.
+static const uint32_t class_sizes[] =
+{
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+
+#define NUM_CLASSES (sizeof(class_sizes) / sizeof(class_sizes[0]))
+#define CLASS_GRANULE 16
+
+static SlabCache kmalloc_caches[NUM_CLASSES];
+
+// Maps (size-1)/CLASS_GRANULE to a size class
+static uint8_t class_lookup[KMALLOC_MAX_SIZE / CLASS_GRANULE];
+
+// Caches created by slab_cache_create() are themselves slab objects
+static SlabCache cache_cache;
+
+static SlabCache* all_caches = NULL;
+static Spinlock all_caches_lock;
+
+#ifdef BENCH_SLAB
+static void slab_benchmark(void);
+#endif
+
+static
+uint64_t align_up(uint64_t value, uint64_t align)
+{
+	return (value + align - 1) & ~(align - 1);
+}
+
+static
+void cache_init(SlabCache* cache, const char* name, uint32_t size,
+		uint32_t align, void (*ctor)(void*))
+{
+	if (align < 8)
+	{
+		align = 8;
+	}
+
+	cache->name = name;
+	cache->object_size = size;
+	cache->ctor = ctor;
+
+	// Constructed objects keep their free list pointer after the object
+	uint64_t stride = align_up(size, 8);
+	cache->link_offset = 0;
+	if (ctor != NULL)
+	{
+		cache->link_offset = stride;
+		stride += sizeof(void*);
+	}
+	cache->stride = align_up(stride, align);
+
+	cache->offset = align_up(sizeof(Slab), align);
+
+	// Use a page unless too much of it would be wasted
+	cache->slab_size = _4_KIB;
+	cache->per_slab = 0;
+	if (cache->offset < _4_KIB)
+	{
+		cache->per_slab = (_4_KIB - cache->offset) / cache->stride;
+	}
+
+	const uint64_t waste = _4_KIB - cache->per_slab*cache->stride;
+	if (cache->per_slab == 0 || waste > (_4_KIB >> SLAB_MAX_WASTE_SHIFT))
+	{
+		cache->slab_size = _2_MIB;
+		cache->per_slab = (_2_MIB - cache->offset) / cache->stride;
+	}
+
+	spin_init(&cache->lock, name);
+	cache->partial = NULL;
+	cache->full = NULL;
+	cache->empty = NULL;
+	cache->slabs = 0;
+	cache->in_use = 0;
+	cache->allocs = 0;
+	cache->frees = 0;
+
+	const uint64_t flags = spin_lock_irqsave(&all_caches_lock);
+	cache->next = all_caches;
+	all_caches = cache;
+	spin_unlock_irqrestore(&all_caches_lock, flags);
+}
+
+static
+void list_remove(Slab** head, Slab* slab)
+{
+	if (slab->prev != NULL)
+	{
+		slab->prev->next = slab->next;
+	}
+	else
+	{
+		*head = slab->next;
+	}
+
+	if (slab->next != NULL)
+	{
+		slab->next->prev = slab->prev;
+	}
+
+	slab->next = NULL;
+	slab->prev = NULL;
+}
+
+static
+void list_push(Slab** head, Slab* slab)
+{
+	slab->prev = NULL;
+	slab->next = *head;
+	if (*head != NULL)
+	{
+		(*head)->prev = slab;
+	}
+	*head = slab;
+}
+
+static inline
+void** link_of(const SlabCache* cache, void* obj)
+{
+	return (void**)((uint8_t*)obj + cache->link_offset);
+}
+
+/* Get a new slab from the physical allocator, construct all of its
+ * objects and thread them onto the slab's free list.
+ */
+static
+Slab* slab_grow(SlabCache* cache)
+{
+	Slab* slab;
+	if (cache->slab_size == _4_KIB)
+	{
+		slab = (Slab*) phys_alloc_4KIB();
+	}
+	else
+	{
+		slab = (Slab*) phys_alloc_2MIB();
+	}
+
+	if (slab == NULL)
+	{
+		return NULL;
+	}
+
+	slab->magic = (cache->slab_size == _4_KIB) ? SLAB_MAGIC : SLAB_MAGIC_LARGE;
+	slab->cache = cache;
+	slab->next = NULL;
+	slab->prev = NULL;
+	slab->in_use = 0;
+	slab->free = NULL;
+
+	// Thread the list backwards so objects come out in address order
+	uint8_t* base = (uint8_t*)slab + cache->offset;
+	for (int64_t i = cache->per_slab - 1; i >= 0; --i)
+	{
+		void* obj = base + i*cache->stride;
+		if (cache->ctor != NULL)
+		{
+			cache->ctor(obj);
+		}
+
+		*link_of(cache, obj) = slab->free;
+		slab->free = obj;
+	}
+
+	++cache->slabs;
+	return slab;
+}
+
+static
+void slab_release(SlabCache* cache, Slab* slab)
+{
+	slab->magic = 0;
+	--cache->slabs;
+	if (cache->slab_size == _4_KIB)
+	{
+		phys_free_4KIB(slab);
+	}
+	else
+	{
+		phys_free_2MIB(slab);
+	}
+}
+
+/* Find the slab an object belongs to.
+ */
+static
+Slab* slab_of(void* obj)
+{
+	Slab* large = (Slab*)MASK_2MIB(obj);
+	if (large->magic == SLAB_MAGIC_LARGE)
+	{
+		return large;
+	}
+
+	Slab* slab = (Slab*)MASK_4KIB(obj);
+	if (slab->magic != SLAB_MAGIC)
+	{
+		kprintf("Bad slab free: 0x%x\n", obj);
+		panic("slab_free of non-slab memory");
+	}
+
+	return slab;
+}
+
+void slab_init()
+{
+	spin_init(&all_caches_lock, "slab caches");
+	all_caches = NULL;
+	cache_init(&cache_cache, "slab_cache", sizeof(SlabCache), 8, NULL);
+
+	uint32_t c = 0;
+	for (uint32_t i = 0; i < KMALLOC_MAX_SIZE / CLASS_GRANULE; ++i)
+	{
+		while ((i+1)*CLASS_GRANULE > class_sizes[c])
+		{
+			++c;
+		}
+		class_lookup[i] = c;
+	}
+
+	for (uint32_t i = 0; i < NUM_CLASSES; ++i)
+	{
+		// Power of two classes are naturally aligned
+		const uint32_t size = class_sizes[i];
+		const uint32_t align = (size & (size - 1)) == 0 ? size : 16;
+		cache_init(&kmalloc_caches[i], "kmalloc", size, align, NULL);
+	}
+
+#ifdef BENCH_SLAB
+	slab_benchmark();
+#endif
+}
+
+SlabCache* slab_cache_create(const char* name, uint32_t size, uint32_t align,
+		void (*ctor)(void*))
+{
+	ASSERT(size > 0 && size <= KMALLOC_MAX_SIZE);
+	ASSERT((align & (align - 1)) == 0);
+
+	SlabCache* cache = (SlabCache*) slab_alloc(&cache_cache);
+	if (cache == NULL)
+	{
+		return NULL;
+	}
+
+	cache_init(cache, name, size, align, ctor);
+	return cache;
+}
+
+void* slab_alloc(SlabCache* cache)
+{
+	const uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+	Slab* slab = cache->partial;
+	if (slab == NULL)
+	{
+		slab = cache->empty;
+		if (slab != NULL)
+		{
+			list_remove(&cache->empty, slab);
+		}
+		else
+		{
+			slab = slab_grow(cache);
+			if (slab == NULL)
+			{
+				spin_unlock_irqrestore(&cache->lock, flags);
+				return NULL;
+			}
+		}
+		list_push(&cache->partial, slab);
+	}
+
+	void* obj = slab->free;
+	slab->free = *link_of(cache, obj);
+	++slab->in_use;
+	++cache->in_use;
+	++cache->allocs;
+
+	if (slab->in_use == cache->per_slab)
+	{
+		list_remove(&cache->partial, slab);
+		list_push(&cache->full, slab);
+	}
+
+	spin_unlock_irqrestore(&cache->lock, flags);
+	return obj;
+}
+
+void slab_free(void* obj)
+{
+	Slab* slab = slab_of(obj);
+	SlabCache* cache = slab->cache;
+	const uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+	if (slab->in_use == cache->per_slab)
+	{
+		list_remove(&cache->full, slab);
+		list_push(&cache->partial, slab);
+	}
+
+	*link_of(cache, obj) = slab->free;
+	slab->free = obj;
+	--slab->in_use;
+	--cache->in_use;
+	++cache->frees;
+
+	if (slab->in_use == 0)
+	{
+		list_remove(&cache->partial, slab);
+
+		// Keep one empty slab around so a cache that hovers around a
+		// slab boundary does not keep going back to the allocator.
+		if (cache->empty == NULL)
+		{
+			list_push(&cache->empty, slab);
+		}
+		else
+		{
+			slab_release(cache, slab);
+		}
+	}
+
+	spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+void* kmalloc(uint64_t size)
+{
+	if (size == 0 || size > KMALLOC_MAX_SIZE)
+	{
+		return NULL;
+	}
+
+	return slab_alloc(&kmalloc_caches[class_lookup[(size - 1) / CLASS_GRANULE]]);
+}
+
+void kfree(void* ptr)
+{
+	if (ptr != NULL)
+	{
+		slab_free(ptr);
+	}
+}
+
+void slab_dump_stats()
+{
+	for (SlabCache* cache = all_caches; cache != NULL; cache = cache->next)
+	{
+		kprintf("%s-%d: %d in use, %d slabs of %dKiB, %d allocs, %d frees\n",
+				cache->name, cache->object_size, cache->in_use, cache->slabs,
+				cache->slab_size / _1_KIB, cache->allocs, cache->frees);
+	}
+}
+
+#ifdef BENCH_SLAB
+#define BENCH_OBJECTS 4096
+
+/* Allocate BENCH_OBJECTS objects from every size class and print how
+ * much memory the slabs use compared to the bytes handed out. Every
+ * other object is then freed and allocated again while timed, the
+ * objects that stay allocated keep every slab in use so the timed
+ * loops never create or release a slab. Prints the average cycles per
+ * call.
+ */
+void slab_benchmark()
+{
+	void** objects = (void**) phys_alloc_2MIB_safe("Slab bench");
+
+	for (uint32_t c = 0; c < NUM_CLASSES; ++c)
+	{
+		const uint32_t size = class_sizes[c];
+		SlabCache* cache = &kmalloc_caches[c];
+
+		for (uint32_t i = 0; i < BENCH_OBJECTS; ++i)
+		{
+			objects[i] = kmalloc(size);
+		}
+
+		const uint64_t slab_bytes = cache->slabs * cache->slab_size;
+		const uint64_t used_bytes = (uint64_t)BENCH_OBJECTS * size;
+
+		for (uint32_t i = 0; i < BENCH_OBJECTS; i += 2)
+		{
+			kfree(objects[i]);
+		}
+
+		const uint64_t slabs = cache->slabs;
+
+		const uint64_t start_alloc = _rdtsc();
+		for (uint32_t i = 0; i < BENCH_OBJECTS; i += 2)
+		{
+			objects[i] = kmalloc(size);
+		}
+		const uint64_t alloc_cycles = _rdtsc() - start_alloc;
+
+		const uint64_t start_free = _rdtsc();
+		for (uint32_t i = 0; i < BENCH_OBJECTS; i += 2)
+		{
+			kfree(objects[i]);
+		}
+		const uint64_t free_cycles = _rdtsc() - start_free;
+
+		ASSERT(cache->slabs == slabs);
+
+		for (uint32_t i = 1; i < BENCH_OBJECTS; i += 2)
+		{
+			kfree(objects[i]);
+		}
+
+		kprintf("Slab bench %d: alloc %d cycles, free %d cycles, overhead %d%%\n",
+				size, alloc_cycles / (BENCH_OBJECTS / 2),
+				free_cycles / (BENCH_OBJECTS / 2),
+				((slab_bytes - used_bytes) * 100) / used_bytes);
+	}
+
+	phys_free_2MIB(objects);
+}
+#endif
@@ -0,0 +1,96 @@
+#ifndef __X86_64_MEMORY_SLAB_H__
+#define __X86_64_MEMORY_SLAB_H__
+
+#include "inttypes.h"
+#include "sync/spinlock.h"
+
+// Largest size kmalloc() can serve
+#define KMALLOC_MAX_SIZE 2048
+
+struct _Slab;
+
+/* A cache of equally sized objects. Objects are carved from slabs, each
+ * slab keeps its free objects on a list threaded through the objects
+ * themselves. Small objects use one 4KiB page per slab, objects that
+ * would waste too much of a page use a whole 2MiB frame.
+ */
+typedef struct _SlabCache
+{
+	const char* name;
+	uint32_t object_size;
+	uint32_t stride;      // Distance between objects
+	uint32_t link_offset; // Where the free list pointer is stored
+	uint32_t per_slab;
+	uint32_t offset;      // Where the first object starts in a slab
+	uint64_t slab_size;
+	void (*ctor)(void*);
+
+	// Covers the slab lists and the statistics
+	Spinlock lock;
+	struct _Slab* partial;
+	struct _Slab* full;
+	struct _Slab* empty;
+
+	// Statistics
+	uint64_t slabs;
+	uint64_t in_use;
+	uint64_t allocs;
+	uint64_t frees;
+
+	struct _SlabCache* next;
+} SlabCache;
+
+/* Set up the kmalloc() size classes. Must be called after the physical
+ * allocator is set up.
+ */
+void slab_init(void);
+
+/* Create a typed cache.
+ *
+ * Constructed objects are cached. The constructor runs once for every
+ * object when its slab is created, not on every allocation, so objects
+ * must be handed back to slab_free() in their constructed state. The
+ * free list pointer of such caches is kept after the object so it does
+ * not disturb the constructed state.
+ *
+ * Params:
+ *   name  - Name used when printing statistics
+ *   size  - Size of each object in bytes, at most KMALLOC_MAX_SIZE
+ *   align - Alignment of each object, a power of two. 0 means 8 bytes.
+ *   ctor  - Optional constructor, NULL for none
+ *
+ * Returns:
+ *   The new cache, or NULL when out of memory.
+ */
+SlabCache* slab_cache_create(const char* name, uint32_t size, uint32_t align,
+		void (*ctor)(void*));
+
+/* Allocate an object from a cache.
+ *
+ * Returns:
+ *   The object, or NULL when out of memory.
+ */
+void* slab_alloc(SlabCache* cache);
+
+/* Return an object to the cache it was allocated from.
+ */
+void slab_free(void* obj);
+
+/* Allocate a block of memory of at most KMALLOC_MAX_SIZE bytes. The
+ * block is aligned to at least 8 bytes, and power of two sizes are
+ * aligned to their size.
+ *
+ * Returns:
+ *   The block, or NULL when out of memory or too large.
+ */
+void* kmalloc(uint64_t size);
+
+/* Free a block from kmalloc(). NULL is ignored.
+ */
+void kfree(void* ptr);
+
+/* Print the statistics of every cache.
+ */
+void slab_dump_stats(void);
+
+#endif
@@ -0,0 +1,210 @@
+#include "tlb.h"
+
+#include "paging.h"
+#include "safety.h"
+
+#ifndef HOST_BUILD
+#include "cpu.h"
+#include "sync/spinlock.h"
+#include "interrupts/apic.h"
+#include "interrupts/defines.h"
+
+#define TLB_VECTOR 0xF0
+
+// Targets are kept in a 32-bit mask
+COMPILE_ASSERT(MAX_CPUS <= 32);
+
+/* Set by the initiator for every target, cleared by the target once it
+ * has flushed. One line per CPU, so acknowledging does not bounce the
+ * flags of other targets.
+ */
+typedef struct
+{
+	volatile uint32_t pending;
+} __attribute__((aligned(64))) TlbAck;
+
+static TlbAck acks[MAX_CPUS];
+
+// Address space each CPU has loaded
+static PML4_Table* volatile active[MAX_CPUS];
+
+// One shootdown at a time, its batch is the request
+static Spinlock shootdown_lock;
+static const TlbBatch* volatile request = NULL;
+#endif
+
+static inline
+void flush_all(void)
+{
+#ifndef HOST_BUILD
+	// No mappings are global, reloading CR3 drops them all
+	__asm__ volatile ("mov %%cr3, %%rax\n\tmov %%rax, %%cr3" ::: "rax", "memory");
+#endif
+}
+
+static
+void flush_local(const TlbBatch* batch)
+{
+	if (batch->count > TLB_BATCH_PAGES)
+	{
+		flush_all();
+		return;
+	}
+
+	for (uint64_t i = 0; i < batch->count; ++i)
+	{
+		invlpg(batch->pages[i]);
+	}
+}
+
+#ifndef HOST_BUILD
+/* Flush for the request in flight if this CPU is one of its targets.
+ */
+static
+void tlb_service(void)
+{
+	TlbAck* ack = &acks[cpu_index()];
+	if (__atomic_load_n(&ack->pending, __ATOMIC_ACQUIRE))
+	{
+		flush_local(request);
+		__atomic_store_n(&ack->pending, 0, __ATOMIC_RELEASE);
+	}
+}
+
+static
+void tlb_handler(uint64_t vector)
+{
+	UNUSED(vector);
+	tlb_service();
+	apic_eoi();
+}
+
+/* Have every other CPU with the batch's address space active flush it,
+ * and wait for all of them.
+ */
+static
+void shootdown(const TlbBatch* batch)
+{
+	const uint32_t count = cpu_count();
+	if (count == 1)
+	{
+		return;
+	}
+
+	// A CPU waiting here may be a target of the shootdown in flight,
+	// with interrupts disabled it has to answer by polling
+	while (!spin_trylock(&shootdown_lock))
+	{
+		tlb_service();
+		__asm__ volatile("pause");
+	}
+
+	const uint32_t self = cpu_index();
+	request = batch;
+
+	// The page table writes must be visible before the active address
+	// spaces are read. A CPU switching to this address space then either
+	// shows up as active or loads the new tables.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	// Every address space shares the kernel's mappings
+	const bool kernel = batch->pml4 == &kernel_PML4;
+
+	uint32_t targets = 0;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		if (i != self && (kernel || active[i] == batch->pml4))
+		{
+			__atomic_store_n(&acks[i].pending, 1, __ATOMIC_RELEASE);
+			targets |= 1U << i;
+		}
+	}
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		if (targets & (1U << i))
+		{
+			apic_send_ipi(cpu_get(i)->apic_id, TLB_VECTOR);
+		}
+	}
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		if (targets & (1U << i))
+		{
+			while (__atomic_load_n(&acks[i].pending, __ATOMIC_ACQUIRE))
+			{
+				__asm__ volatile("pause");
+			}
+		}
+	}
+
+	spin_unlock(&shootdown_lock);
+}
+#endif
+
+void tlb_init()
+{
+#ifndef HOST_BUILD
+	spin_init(&shootdown_lock, "tlb shootdown");
+	interrupts_install_fast_isr(TLB_VECTOR, tlb_handler);
+	tlb_init_cpu();
+#endif
+}
+
+void tlb_init_cpu()
+{
+#ifndef HOST_BUILD
+	active[cpu_index()] = &kernel_PML4;
+#endif
+}
+
+void tlb_switch(PML4_Table* pml4)
+{
+#ifdef HOST_BUILD
+	UNUSED(pml4);
+#else
+	// Announce the switch before loading the tables, a shootdown that
+	// misses it changed the tables before they were loaded
+	__atomic_store_n(&active[cpu_index()], pml4, __ATOMIC_SEQ_CST);
+	__asm__ volatile ("mov %0, %%cr3" :: "r"((uint64_t)pml4) : "memory");
+#endif
+}
+
+void tlb_batch_init(TlbBatch* batch, PML4_Table* pml4)
+{
+	batch->pml4 = pml4;
+	batch->count = 0;
+}
+
+void tlb_batch_add(TlbBatch* batch, uint64_t virt_addr)
+{
+	// Past the limit only the count matters, the flush drops everything
+	if (batch->count < TLB_BATCH_PAGES)
+	{
+		batch->pages[batch->count] = virt_addr;
+	}
+	++batch->count;
+}
+
+void tlb_batch_flush(TlbBatch* batch)
+{
+	if (batch->count == 0)
+	{
+		return;
+	}
+
+	flush_local(batch);
+#ifndef HOST_BUILD
+	shootdown(batch);
+#endif
+	batch->count = 0;
+}
+
+void tlb_flush_page(PML4_Table* pml4, uint64_t virt_addr)
+{
+	TlbBatch batch;
+	tlb_batch_init(&batch, pml4);
+	tlb_batch_add(&batch, virt_addr);
+	tlb_batch_flush(&batch);
+}
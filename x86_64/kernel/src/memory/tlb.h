@@ -0,0 +1,70 @@
+#ifndef __X86_64_MEMORY_TLB_H__
+#define __X86_64_MEMORY_TLB_H__
+
+#include "types.h"
+#include "inttypes.h"
+
+/* TLB shootdown.
+ *
+ * Unmapping a page only invalidates it in the TLB of the CPU doing it,
+ * every other CPU with the address space loaded must invalidate it as
+ * well. Unmaps are collected in a TlbBatch, and tlb_batch_flush() sends
+ * one IPI to each CPU that has the batch's PML4 active. The targets
+ * acknowledge through a per-CPU flag, the flush returns once all have.
+ * Only then may the unmapped frames be reused.
+ *
+ * A batch of more than TLB_BATCH_PAGES pages flushes the whole TLB
+ * instead of invalidating page by page.
+ */
+
+// Pages a batch invalidates one by one
+#define TLB_BATCH_PAGES 32
+
+typedef struct
+{
+	PML4_Table* pml4;
+	uint64_t count;
+	uint64_t pages[TLB_BATCH_PAGES];
+} TlbBatch;
+
+/* Install the shootdown handler and mark kernel_PML4 active on the
+ * bootstrap processor.
+ */
+void tlb_init(void);
+
+/* Mark kernel_PML4 active on an application processor.
+ */
+void tlb_init_cpu(void);
+
+/* Load an address space on this CPU.
+ *
+ * Params:
+ *   pml4 - PML4 table in identity mapped memory
+ */
+void tlb_switch(PML4_Table* pml4);
+
+/* Start an empty batch.
+ *
+ * Params:
+ *   batch - The batch
+ *   pml4  - Address space the pages are unmapped from
+ */
+void tlb_batch_init(TlbBatch* batch, PML4_Table* pml4);
+
+/* Queue a page for invalidation. Nothing is invalidated before
+ * tlb_batch_flush().
+ */
+void tlb_batch_add(TlbBatch* batch, uint64_t virt_addr);
+
+/* Invalidate the queued pages on this CPU and every other CPU that has
+ * the address space active, then empty the batch. Must not be called
+ * while holding a lock other CPUs wait for with interrupts disabled,
+ * they could not acknowledge.
+ */
+void tlb_batch_flush(TlbBatch* batch);
+
+/* Invalidate a single page everywhere, a batch of one.
+ */
+void tlb_flush_page(PML4_Table* pml4, uint64_t virt_addr);
+
+#endif
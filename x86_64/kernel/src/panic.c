@@ -1,9 +1,20 @@
+#include "serial.h"
+#include "textmode.h"
 #include "kprintf.h"
+#include "trace/trace.h"
+
+// Records shown when the kernel panics
+#define TRACE_PANIC_RECORDS 64
 
 void panic_(const char* message)
 {
 	kprintf("%s - PANIC  \n", message);
 	__asm__ volatile ("cli");
+#ifdef TRACE_KERNEL
+	trace_dump(TRACE_PANIC_RECORDS);
+#endif
+	serial_flush();
+	text_mode_flush();
 	while (1)
 	{
 		__asm__ volatile ("hlt");
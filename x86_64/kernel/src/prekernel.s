@@ -382,3 +382,6 @@ clear_bss_loop:
 kernel_returned:
 	hlt
 	jmp kernel_returned
+
+/* No executable stack, it would otherwise be implied for this object */
+.section .note.GNU-stack,"",@progbits
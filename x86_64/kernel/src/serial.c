@@ -1,26 +1,315 @@
 #include "serial.h"
+#include "safety.h"
 #include "support.h"
+#include "interrupts/defines.h"
+#include "interrupts/ioapic.h"
 
 #define SERIAL_PORT_A 0x3F8
 
+// UART registers, offsets from the port base
+#define UART_DATA 0  // THR when written, divisor low byte when DLAB is set
+#define UART_IER  1  // Interrupt enable, divisor high byte when DLAB is set
+#define UART_IIR  2  // Interrupt identification when read
+#define UART_FCR  2  // FIFO control when written
+#define UART_LCR  3
+#define UART_MCR  4
+#define UART_LSR  5
+
+#define IER_THRE  0x02 // Interrupt when the transmit holding register empties
+#define LCR_DLAB  0x80
+#define LCR_8N1   0x03
+#define FCR_ENABLE_CLEAR_14 0xC7
+#define MCR_OUT2  0x08 // Connects the UART interrupt line
+#define LSR_THRE  0x20
+#define LSR_TEMT  0x40
+
+// Bytes the transmit FIFO takes once it is empty
+#define UART_FIFO_SIZE 16
+
+// COM1
+#define SERIAL_IRQ 4
+
+// Must be a power of two
+#define RING_SIZE 1024
+#define RING_MASK (RING_SIZE - 1)
+
+/* Bounded multi-producer queue (Vyukov). Each slot's sequence number
+ * says whether it is free for the producer at that position or holds a
+ * byte for the consumer at that position.
+ */
+typedef struct
+{
+	volatile uint32_t seq;
+	char c;
+} Slot;
+
+static Slot ring[RING_SIZE];
+static volatile uint32_t ring_tail = 0; // Next position to produce
+static uint32_t ring_head = 0;          // Next position to consume
+
+// Held by whoever is moving bytes from the ring to the UART
+static volatile uint32_t consumer_busy = 0;
+
+// Set while the THRE interrupt is enabled
+static volatile uint32_t tx_running = 0;
+
+static bool interrupts_enabled = false;
+
+static inline
+bool transmit_empty(void)
+{
+	return (_inb(SERIAL_PORT_A + UART_LSR) & LSR_THRE) != 0;
+}
+
+static
+void ring_init(void)
+{
+	for (uint32_t i = 0; i < RING_SIZE; ++i)
+	{
+		ring[i].seq = i;
+	}
+	ring_tail = 0;
+	ring_head = 0;
+}
+
+/* Try to queue a byte.
+ *
+ * Returns:
+ *   False if the ring is full.
+ */
+static
+bool ring_push(char c)
+{
+	uint32_t pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		Slot* slot = &ring[pos & RING_MASK];
+		const int32_t diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&ring_tail, &pos, pos + 1, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				slot->c = c;
+				__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+				return true;
+			}
+			// pos was reloaded by the failed exchange
+		}
+		else if (diff < 0)
+		{
+			return false;
+		}
+		else
+		{
+			pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/* Take the oldest byte. Only called with consumer_busy held.
+ *
+ * Returns:
+ *   False if nothing is ready.
+ */
+static
+bool ring_pop(char* c)
+{
+	Slot* slot = &ring[ring_head & RING_MASK];
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring_head + 1)
+	{
+		return false;
+	}
+
+	*c = slot->c;
+	__atomic_store_n(&slot->seq, ring_head + RING_SIZE, __ATOMIC_RELEASE);
+	++ring_head;
+	return true;
+}
+
+static inline
+bool consumer_try_lock(void)
+{
+	return __atomic_exchange_n(&consumer_busy, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+static inline
+void consumer_unlock(void)
+{
+	__atomic_store_n(&consumer_busy, 0, __ATOMIC_RELEASE);
+}
+
+/* Move up to a FIFO's worth of bytes to the UART. The transmitter must
+ * be empty and consumer_busy held.
+ *
+ * Returns:
+ *   False if the ring ran empty.
+ */
+static
+bool fill_fifo(void)
+{
+	char c;
+	for (uint32_t i = 0; i < UART_FIFO_SIZE; ++i)
+	{
+		if (!ring_pop(&c))
+		{
+			return false;
+		}
+		_outb(SERIAL_PORT_A + UART_DATA, c);
+	}
+
+	return true;
+}
+
+/* Turn on the THRE interrupt unless it already is. Enabling it while
+ * the transmitter is empty raises the interrupt right away.
+ */
+static
+void start_tx(void)
+{
+	if (__atomic_exchange_n(&tx_running, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		_outb(SERIAL_PORT_A + UART_IER, IER_THRE);
+	}
+}
+
+/* Keep the transmitter busy from the ring, and stop the THRE interrupt
+ * once the ring runs empty. Called with consumer_busy held.
+ */
+static
+void pump(void)
+{
+	if (transmit_empty() && !fill_fifo())
+	{
+		// Nothing left, stop the interrupt. A producer may have queued
+		// a byte after the ring ran empty but before tx_running was
+		// cleared, and would not have restarted the transmitter. The
+		// clear must be visible before the ring is read again, else
+		// both sides can miss each other.
+		_outb(SERIAL_PORT_A + UART_IER, 0);
+		__atomic_store_n(&tx_running, 0, __ATOMIC_SEQ_CST);
+
+		const Slot* slot = &ring[ring_head & RING_MASK];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == ring_head + 1)
+		{
+			start_tx();
+		}
+	}
+}
+
+static
+void serial_handler(uint64_t vector, uint64_t code)
+{
+	UNUSED(vector);
+	UNUSED(code);
+
+	// Reading the IIR acknowledges the THRE interrupt
+	_inb(SERIAL_PORT_A + UART_IIR);
+
+	if (consumer_try_lock())
+	{
+		pump();
+		consumer_unlock();
+	}
+
+	apic_eoi();
+}
+
 void init_serial_debug()
 {
-	_outb(SERIAL_PORT_A + 1, 0x00);
-	_outb(SERIAL_PORT_A + 3, 0x80);
-	_outb(SERIAL_PORT_A + 0, 0x03);
-	_outb(SERIAL_PORT_A + 1, 0x00);
-	_outb(SERIAL_PORT_A + 3, 0x03);
-	_outb(SERIAL_PORT_A + 2, 0xC7);
-	_outb(SERIAL_PORT_A + 4, 0x08);
+	ring_init();
+	interrupts_enabled = false;
+
+	_outb(SERIAL_PORT_A + UART_IER, 0x00);
+	serial_set_baud(SERIAL_DEFAULT_BAUD);
+	_outb(SERIAL_PORT_A + UART_FCR, FCR_ENABLE_CLEAR_14);
+	_outb(SERIAL_PORT_A + UART_MCR, MCR_OUT2);
+}
+
+bool serial_set_baud(uint32_t baud)
+{
+	if (baud == 0 || baud > SERIAL_MAX_BAUD || SERIAL_MAX_BAUD % baud != 0)
+	{
+		return false;
+	}
+
+	const uint16_t divisor = SERIAL_MAX_BAUD / baud;
+
+	// While DLAB is set the data and IER offsets are the divisor latch.
+	// Holding the consumer keeps the handler from writing data, and
+	// tx_running keeps producers from writing IER.
+	while (!consumer_try_lock())
+	{
+		__asm__ volatile("pause");
+	}
+	__atomic_store_n(&tx_running, 1, __ATOMIC_SEQ_CST);
+
+	// Let the bytes already in the FIFO go out at the old rate
+	while ((_inb(SERIAL_PORT_A + UART_LSR) & LSR_TEMT) == 0);
+
+	_outb(SERIAL_PORT_A + UART_LCR, LCR_DLAB);
+	_outb(SERIAL_PORT_A + UART_DATA, divisor & 0xFF);
+	_outb(SERIAL_PORT_A + UART_IER, divisor >> 8);
+	_outb(SERIAL_PORT_A + UART_LCR, LCR_8N1);
+
+	// A THRE interrupt taken meanwhile found the consumer busy and
+	// dropped out, restart the transmission from here
+	_outb(SERIAL_PORT_A + UART_IER, IER_THRE);
+	pump();
+	consumer_unlock();
+
+	return true;
 }
 
-int serial_transmit_empty()
+void serial_enable_interrupts()
 {
-	return _inb(SERIAL_PORT_A + 5) & 0x20;
+	interrupts_install_isr(ioapic_irq_vector(SERIAL_IRQ), serial_handler);
+	interrupts_enabled = true;
 }
 
 void serial_char(char c)
 {
-	while (serial_transmit_empty() == 0); 
-	_outb(SERIAL_PORT_A, c);
+	if (!interrupts_enabled)
+	{
+		while (!transmit_empty());
+		_outb(SERIAL_PORT_A + UART_DATA, c);
+		return;
+	}
+
+	while (!ring_push(c))
+	{
+		// Full, likely with interrupts off. Drain it by polling unless
+		// someone else already is.
+		if (consumer_try_lock())
+		{
+			while (!transmit_empty())
+			{
+				__asm__ volatile("pause");
+			}
+			fill_fifo();
+			consumer_unlock();
+		}
+		else
+		{
+			__asm__ volatile("pause");
+		}
+	}
+
+	start_tx();
+}
+
+void serial_flush()
+{
+	// The system is going down, take the ring no matter who holds it
+	_outb(SERIAL_PORT_A + UART_IER, 0);
+	interrupts_enabled = false;
+
+	bool more = true;
+	while (more)
+	{
+		while (!transmit_empty());
+		more = fill_fifo();
+	}
+
+	while ((_inb(SERIAL_PORT_A + UART_LSR) & LSR_TEMT) == 0);
 }
@@ -1,8 +1,42 @@
 #ifndef __X86_64_SERIAL_H___
 #define __X86_64_SERIAL_H___
 
+#include "inttypes.h"
+
+// Fastest rate of the UART's 1.8432MHz clock
+#define SERIAL_MAX_BAUD 115200
+
+#define SERIAL_DEFAULT_BAUD SERIAL_MAX_BAUD
+
+/* Set up COM1 at SERIAL_DEFAULT_BAUD, 8N1, FIFOs enabled. Until
+ * serial_enable_interrupts() is called output is written synchronously.
+ */
 void init_serial_debug(void);
 
+/* Change the baud rate of COM1.
+ *
+ * Params:
+ *   baud - The new rate, SERIAL_MAX_BAUD divided by a whole number
+ *
+ * Returns:
+ *   True if the rate was set, false if it is not supported.
+ */
+bool serial_set_baud(uint32_t baud);
+
+/* Install the COM1 interrupt handler. From then on serial_char() only
+ * queues bytes, and the transmitter empty interrupt drains the queue.
+ * Must be called after the I/O APIC routes IRQ 4.
+ */
+void serial_enable_interrupts(void);
+
+/* Queue one byte for output. Lock-free, safe from any CPU and from
+ * interrupt handlers. Waits only if the queue is full.
+ */
 void serial_char(char c);
 
+/* Write out everything queued and wait for the UART to go idle, without
+ * relying on interrupts. Only meant for panic_().
+ */
+void serial_flush(void);
+
 #endif
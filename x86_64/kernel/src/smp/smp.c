@@ -0,0 +1,216 @@
+#include "smp.h"
+#include "trampoline.h"
+
+#include "cpu.h"
+#include "klib.h"
+#include "log.h"
+#include "panic.h"
+#include "safety.h"
+#include "cpuid.h"
+#include "interrupts/apic.h"
+#include "interrupts/defines.h"
+#include "interrupts/init.h"
+#include "interrupts/topology.h"
+#include "interrupts/tss.h"
+#include "memory/defines.h"
+#include "memory/numa.h"
+#include "memory/phys_alloc.h"
+#include "memory/tlb.h"
+#include "thread/thread.h"
+#include "timer/timer.h"
+
+#define AP_STACK_SIZE (1ULL << TRAMPOLINE_STACK_SHIFT)
+
+COMPILE_ASSERT(MAX_CPUS * AP_STACK_SIZE <= _2_MIB);
+
+// Wakes an idle AP to look at its call slot
+#define SMP_WAKE_VECTOR 0x48
+
+#define MSR_EFER 0xC0000080
+#define EFER_NXE 0x800
+
+// Delays of the INIT-SIPI-SIPI sequence, Intel SDM vol. 3 8.4.4.1
+#define INIT_DELAY_NS 10000000ULL
+#define SIPI_DELAY_NS 200000ULL
+
+// How long the APs get to check in
+#define ONLINE_TIMEOUT_NS 100000000ULL
+
+typedef struct
+{
+	void (*volatile fn)(void);
+} __attribute__((aligned(64))) SmpCall;
+
+static SmpCall calls[MAX_CPUS];
+
+static uint8_t* ap_stacks = NULL;
+
+static
+void smp_wake_handler(uint64_t vector)
+{
+	UNUSED(vector);
+	apic_eoi();
+}
+
+/* Run the calls other CPUs hand this one, halting in between.
+ * Interrupts are disabled between the check and the HLT, STI holds
+ * them off for one more instruction, so a wakeup is not lost. This
+ * is the CPU's idle thread, threads queued here take over on their
+ * wake IPI.
+ */
+static
+void ap_idle(void)
+{
+	SmpCall* call = &calls[cpu_index()];
+	for (;;)
+	{
+		__asm__ volatile("cli" ::: "memory");
+		void (*fn)(void) = call->fn;
+		if (fn != NULL)
+		{
+			__asm__ volatile("sti" ::: "memory");
+			fn();
+			__atomic_store_n(&call->fn, NULL, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		__asm__ volatile("sti\n\thlt" ::: "memory");
+	}
+}
+
+/* Entered from the trampoline, on the stack of this index.
+ */
+static
+void ap_main(uint32_t index)
+{
+	cpu_init_ap(index);
+	tss_init_cpu((uint64_t)(ap_stacks + (index + 1) * AP_STACK_SIZE));
+	klib_init_cpu();
+	interrupts_init_ap();
+	tlb_init_cpu();
+	this_cpu()->node = numa_cpu_node(this_cpu()->apic_id);
+	timer_init_cpu();
+	thread_init_cpu();
+
+	ap_idle();
+}
+
+/* Copy the trampoline to low memory and fill in its data block.
+ */
+static
+void setup_trampoline(void)
+{
+	memcpy((void*)TRAMPOLINE_BASE, trampoline_start, trampoline_end - trampoline_start);
+
+	TrampolineData* data = (TrampolineData*)
+		(TRAMPOLINE_BASE + (trampoline_data - trampoline_start));
+
+	uint64_t cr3;
+	__asm__ volatile("movq %%cr3, %0" : "=r"(cr3));
+	ASSERT(cr3 < 0x100000000ULL);
+
+	uint32_t efer_lo, efer_hi;
+	readmsr(MSR_EFER, &efer_lo, &efer_hi);
+
+	data->cr3 = cr3;
+	data->efer = efer_lo & EFER_NXE;
+	data->next_index = 1;
+	data->stacks = (uint64_t)ap_stacks;
+	data->entry = (uint64_t)ap_main;
+}
+
+void smp_init()
+{
+	const Topology* topo = topology();
+	const uint32_t self = apic_bsp_id();
+
+	ap_stacks = (uint8_t*) phys_alloc_2MIB_safe("AP stacks");
+	setup_trampoline();
+	interrupts_install_fast_isr(SMP_WAKE_VECTOR, smp_wake_handler);
+
+	const uint64_t start = now();
+
+	// Every AP is sent INIT first, so they all wait out the one delay
+	uint32_t started = 0;
+	for (uint32_t i = 0; i < topo->num_cpus && started < MAX_CPUS - 1; ++i)
+	{
+		if (topo->apic_ids[i] != self)
+		{
+			apic_send_icr(topo->apic_ids[i], APIC_ICR_INIT | APIC_ICR_ASSERT);
+			++started;
+		}
+	}
+
+	if (started == 0)
+	{
+		log_info(SMP, "SMP: no application processors\n");
+		return;
+	}
+
+	delay_ns(INIT_DELAY_NS);
+
+	// The second SIPI is ignored by APs that already left the
+	// wait-for-SIPI state
+	for (uint32_t sipi = 0; sipi < 2; ++sipi)
+	{
+		uint32_t sent = 0;
+		for (uint32_t i = 0; i < topo->num_cpus && sent < started; ++i)
+		{
+			if (topo->apic_ids[i] != self)
+			{
+				apic_send_icr(topo->apic_ids[i],
+						APIC_ICR_STARTUP | APIC_ICR_ASSERT | (TRAMPOLINE_BASE >> 12));
+				++sent;
+			}
+		}
+
+		delay_ns(SIPI_DELAY_NS);
+	}
+
+	const uint64_t deadline = now() + ONLINE_TIMEOUT_NS;
+	while (cpu_count() < started + 1 && now() < deadline)
+	{
+		__asm__ volatile("pause");
+	}
+
+	const uint64_t elapsed = now() - start;
+	log_info(SMP, "SMP: %d of %d CPUs online in %d us\n",
+			cpu_count(), started + 1, elapsed / 1000);
+	if (topo->num_cpus > MAX_CPUS)
+	{
+		log_warn(SMP, "SMP: %d CPUs not started, MAX_CPUS is %d\n",
+				topo->num_cpus - MAX_CPUS, MAX_CPUS);
+	}
+
+	for (uint32_t i = 1; i < cpu_count(); ++i)
+	{
+		const PerCPU* cpu = cpu_get(i);
+		log_debug(SMP, "SMP: CPU %d APIC ID %d node %d\n", i, cpu->apic_id, cpu->node);
+	}
+}
+
+void smp_call(uint32_t index, void (*fn)(void))
+{
+	ASSERT(index < cpu_count() && index != cpu_index());
+
+	SmpCall* call = &calls[index];
+	ASSERT(call->fn == NULL);
+	__atomic_store_n(&call->fn, fn, __ATOMIC_RELEASE);
+	apic_send_ipi(cpu_get(index)->apic_id, SMP_WAKE_VECTOR);
+}
+
+void smp_wait(uint32_t index)
+{
+	ASSERT(index < cpu_count());
+
+	while (__atomic_load_n(&calls[index].fn, __ATOMIC_ACQUIRE) != NULL)
+	{
+		__asm__ volatile("pause");
+	}
+}
+
+void smp_run_on(uint32_t index, void (*fn)(void))
+{
+	smp_call(index, fn);
+	smp_wait(index);
+}
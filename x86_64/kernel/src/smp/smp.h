@@ -0,0 +1,30 @@
+#ifndef __X86_64_SMP_SMP_H__
+#define __X86_64_SMP_SMP_H__
+
+#include "inttypes.h"
+
+/* Start every application processor the topology lists, up to
+ * MAX_CPUS in total, and wait for them to come online. Each gets its
+ * own per-CPU block, stack, GDT, TSS, LAPIC and timer, then idles.
+ * Interrupts must still be disabled on the bootstrap processor.
+ */
+void smp_init(void);
+
+/* Start a function on another CPU, outside interrupt context, without
+ * waiting for it. The CPU must not be running an earlier call.
+ *
+ * Params:
+ *   index - CPU index, not the calling CPU
+ *   fn    - The function to run
+ */
+void smp_call(uint32_t index, void (*fn)(void));
+
+/* Wait for the function started on a CPU with smp_call() to return.
+ */
+void smp_wait(uint32_t index);
+
+/* Run a function on another CPU and wait for it to return.
+ */
+void smp_run_on(uint32_t index, void (*fn)(void));
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef __X86_64_SMP_TRAMPOLINE_H__
+#define __X86_64_SMP_TRAMPOLINE_H__
+
+/* Real mode entry point of the application processors. The code in
+ * trampoline.S is copied to TRAMPOLINE_BASE, where the startup IPI
+ * starts the APs. It switches to long mode with the kernel's page
+ * tables, takes the next CPU index and stack, and calls the entry
+ * point with the index as its argument.
+ *
+ * Shared with trampoline.S, so only defines outside the C part.
+ */
+
+// Below 1MiB and 4KiB aligned, the startup IPI vector is the page
+#define TRAMPOLINE_BASE 0x8000
+
+// Offsets into the data block at trampoline_data
+#define TRAMPOLINE_CR3        0
+#define TRAMPOLINE_EFER       4
+#define TRAMPOLINE_NEXT_INDEX 8
+#define TRAMPOLINE_STACKS     16
+#define TRAMPOLINE_ENTRY      24
+#define TRAMPOLINE_DATA_SIZE  32
+
+// Every AP gets a 1 << TRAMPOLINE_STACK_SHIFT byte stack
+#define TRAMPOLINE_STACK_SHIFT 16
+
+#ifndef __ASSEMBLER__
+
+#include "inttypes.h"
+#include "safety.h"
+
+typedef struct
+{
+	uint32_t cr3;                 // Kernel PML4, below 4GiB
+	uint32_t efer;                // EFER bits to set besides LME
+	volatile uint32_t next_index; // CPU index of the next AP to arrive
+	uint32_t reserved;
+	uint64_t stacks;              // Stack of index i ends at stacks + (i+1) << SHIFT
+	uint64_t entry;               // void entry(uint32_t index)
+} TrampolineData;
+
+COMPILE_ASSERT(__builtin_offsetof(TrampolineData, cr3) == TRAMPOLINE_CR3);
+COMPILE_ASSERT(__builtin_offsetof(TrampolineData, efer) == TRAMPOLINE_EFER);
+COMPILE_ASSERT(__builtin_offsetof(TrampolineData, next_index) == TRAMPOLINE_NEXT_INDEX);
+COMPILE_ASSERT(__builtin_offsetof(TrampolineData, stacks) == TRAMPOLINE_STACKS);
+COMPILE_ASSERT(__builtin_offsetof(TrampolineData, entry) == TRAMPOLINE_ENTRY);
+COMPILE_ASSERT(sizeof(TrampolineData) == TRAMPOLINE_DATA_SIZE);
+
+// Placed in trampoline.S
+extern const uint8_t trampoline_start[];
+extern const uint8_t trampoline_data[];
+extern const uint8_t trampoline_end[];
+
+#endif
+#endif
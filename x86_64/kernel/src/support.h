@@ -45,4 +45,15 @@ void _outl(uint16_t port, uint32_t val)
 	__asm__ volatile("outl %0, %1" : : "a"(val), "d"(port));
 }
 
+/* Read the time stamp counter. Not serializing, so surrounding
+ * instructions may be reordered around it.
+ */
+inline __attribute__((always_inline))
+uint64_t _rdtsc(void)
+{
+	uint32_t lo, hi;
+	__asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
 #endif
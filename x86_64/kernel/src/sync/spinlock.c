@@ -0,0 +1,158 @@
+#include "spinlock.h"
+
+#include "klib.h"
+#include "kprintf.h"
+
+#ifdef LOCK_STATS
+// Every named lock, newest first
+static LockStats* all_stats = NULL;
+
+void lock_stats_register(LockStats* stats, const char* name)
+{
+	stats->name = name;
+
+	// Locks set up again, like the allocator's in the host tests, are
+	// already on the list
+	for (const LockStats* s = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE);
+			s != NULL; s = s->next)
+	{
+		if (s == stats)
+		{
+			return;
+		}
+	}
+
+	stats->next = __atomic_load_n(&all_stats, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&all_stats, &stats->next, stats, true,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+#endif
+
+void lock_stats_dump()
+{
+#ifdef LOCK_STATS
+	for (const LockStats* stats = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE);
+			stats != NULL; stats = stats->next)
+	{
+		if (stats->acquisitions == 0)
+		{
+			continue;
+		}
+
+		kprintf("Lock %s: %d acquisitions, %d contended, wait avg %d, "
+				"hold avg %d max %d cycles\n",
+				stats->name, stats->acquisitions, stats->contended,
+				stats->contended > 0 ? stats->wait_cycles / stats->contended : 0,
+				stats->hold_cycles / stats->acquisitions, stats->max_hold_cycles);
+	}
+#endif
+}
+
+void spin_init(Spinlock* lock, const char* name)
+{
+	memclr(lock, sizeof(Spinlock));
+#ifdef LOCK_STATS
+	lock_stats_register(&lock->stats, name);
+#else
+	UNUSED(name);
+#endif
+}
+
+void mcs_init(McsLock* lock, const char* name)
+{
+	memclr(lock, sizeof(McsLock));
+#ifdef LOCK_STATS
+	lock_stats_register(&lock->stats, name);
+#else
+	UNUSED(name);
+#endif
+}
+
+void spin_lock_wait(Spinlock* lock, uint32_t ticket)
+{
+#ifdef LOCK_STATS
+	const uint64_t start = _rdtsc();
+#endif
+
+	for (;;)
+	{
+		const uint32_t owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+		if (owner == ticket)
+		{
+			break;
+		}
+
+		// Polling less often the further back in line we are keeps the
+		// lock's line from bouncing on every waiter's read
+		uint32_t pauses = (ticket - owner) * LOCK_BACKOFF_PAUSES;
+		if (pauses > LOCK_BACKOFF_MAX)
+		{
+			pauses = LOCK_BACKOFF_MAX;
+		}
+
+		while (pauses-- > 0)
+		{
+			__asm__ volatile("pause");
+		}
+	}
+
+#ifdef LOCK_STATS
+	lock_stats_acquired(&lock->stats, start);
+#endif
+}
+
+void mcs_lock(McsLock* lock, McsNode* node)
+{
+	node->next = NULL;
+	node->locked = 1;
+
+	McsNode* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+	if (prev == NULL)
+	{
+#ifdef LOCK_STATS
+		lock_stats_acquired(&lock->stats, 0);
+#endif
+		return;
+	}
+
+#ifdef LOCK_STATS
+	const uint64_t start = _rdtsc();
+#endif
+
+	// Queue behind prev and wait for it to hand the lock over
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+	{
+		__asm__ volatile("pause");
+	}
+
+#ifdef LOCK_STATS
+	lock_stats_acquired(&lock->stats, start);
+#endif
+}
+
+void mcs_unlock(McsLock* lock, McsNode* node)
+{
+#ifdef LOCK_STATS
+	lock_stats_released(&lock->stats);
+#endif
+
+	McsNode* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if (next == NULL)
+	{
+		McsNode* expected = node;
+		if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		{
+			return;
+		}
+
+		// A waiter swapped itself in but has not linked to us yet
+		while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+		{
+			__asm__ volatile("pause");
+		}
+	}
+
+	__atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
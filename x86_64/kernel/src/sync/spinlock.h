@@ -0,0 +1,244 @@
+#ifndef __X86_64_SYNC_SPINLOCK_H__
+#define __X86_64_SYNC_SPINLOCK_H__
+
+#include "inttypes.h"
+#include "safety.h"
+#include "support.h"
+
+#ifndef HOST_BUILD
+#include "cpu.h"
+#endif
+
+/* Spinlocks for the structures CPUs share.
+ *
+ * Spinlock is a ticket lock. Waiters take a ticket and are served in
+ * order, so no CPU starves, but every waiter spins on the same line
+ * and each release invalidates it in all of their caches. Use it for
+ * short critical sections that are rarely contended.
+ *
+ * McsLock is a queue lock (Mellor-Crummey and Scott). Every waiter
+ * spins on its own McsNode, which usually lives on its stack, and the
+ * release only touches the line of the next waiter. Use it for locks
+ * many CPUs fight over.
+ *
+ * A zeroed lock is unlocked, so static locks work before their
+ * spin_init()/mcs_init(), which name them for the statistics. Neither
+ * lock is recursive. The _irqsave variants also disable interrupts,
+ * they are needed for every lock that is taken from interrupt handlers.
+ *
+ * With LOCK_STATS every lock counts its acquisitions, how many had to
+ * wait and for how long, and how long it was held. lock_stats_dump()
+ * prints all named locks.
+ */
+
+// PAUSEs a ticket waiter spins per ticket ahead of it between polls
+#define LOCK_BACKOFF_PAUSES 8
+
+// Most PAUSEs between polls of a ticket lock
+#define LOCK_BACKOFF_MAX 1024
+
+typedef struct _LockStats
+{
+	const char* name;
+	uint64_t acquisitions;
+	uint64_t contended;    // Acquisitions that had to wait
+	uint64_t wait_cycles;
+	uint64_t hold_cycles;
+	uint64_t max_hold_cycles;
+	uint64_t acquired_at;  // TSC when the current holder got the lock
+	struct _LockStats* next;
+} LockStats;
+
+typedef struct
+{
+	volatile uint32_t next;  // Ticket of the next CPU to arrive
+	volatile uint32_t owner; // Ticket being served
+#ifdef LOCK_STATS
+	LockStats stats;
+#endif
+} Spinlock;
+
+typedef struct _McsNode
+{
+	struct _McsNode* volatile next;
+	volatile uint32_t locked;
+} __attribute__((aligned(16))) McsNode;
+
+typedef struct
+{
+	McsNode* volatile tail;
+#ifdef LOCK_STATS
+	LockStats stats;
+#endif
+} McsLock;
+
+#ifdef HOST_BUILD
+// The host tests run as a single user mode thread, without interrupts
+// to hold off
+static inline
+uint64_t lock_irq_save(void)
+{
+	return 0;
+}
+
+static inline
+void lock_irq_restore(uint64_t flags)
+{
+	UNUSED(flags);
+}
+#else
+#define lock_irq_save irq_save
+#define lock_irq_restore irq_restore
+#endif
+
+#ifdef LOCK_STATS
+/* Add a lock to the ones lock_stats_dump() prints.
+ */
+void lock_stats_register(LockStats* stats, const char* name);
+
+/* Account for an acquisition, called once the lock is held.
+ *
+ * Params:
+ *   stats - The lock's statistics
+ *   start - TSC when the acquisition started, 0 if it did not wait
+ */
+static inline
+void lock_stats_acquired(LockStats* stats, uint64_t start)
+{
+	const uint64_t now = _rdtsc();
+	++stats->acquisitions;
+	if (start != 0)
+	{
+		++stats->contended;
+		stats->wait_cycles += now - start;
+	}
+	stats->acquired_at = now;
+}
+
+/* Account for the hold time, called before the lock is released.
+ */
+static inline
+void lock_stats_released(LockStats* stats)
+{
+	const uint64_t held = _rdtsc() - stats->acquired_at;
+	stats->hold_cycles += held;
+	if (held > stats->max_hold_cycles)
+	{
+		stats->max_hold_cycles = held;
+	}
+}
+#endif
+
+/* Print the statistics of every named lock. Prints nothing without
+ * LOCK_STATS.
+ */
+void lock_stats_dump(void);
+
+/* Set up a lock, unlocked, and name it for the statistics. Must not
+ * be called while the lock is in use.
+ *
+ * Params:
+ *   lock - The lock
+ *   name - Name used when printing statistics
+ */
+void spin_init(Spinlock* lock, const char* name);
+
+void mcs_init(McsLock* lock, const char* name);
+
+/* Wait for a ticket, backing off in proportion to the tickets ahead.
+ */
+void spin_lock_wait(Spinlock* lock, uint32_t ticket);
+
+static inline
+void spin_lock(Spinlock* lock)
+{
+	const uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+	if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+	{
+		spin_lock_wait(lock, ticket);
+		return;
+	}
+
+#ifdef LOCK_STATS
+	lock_stats_acquired(&lock->stats, 0);
+#endif
+}
+
+/* Take the lock only if it is free.
+ *
+ * Returns:
+ *   True if the lock was taken.
+ */
+static inline
+bool spin_trylock(Spinlock* lock)
+{
+	uint32_t ticket = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&lock->next, &ticket, ticket + 1, false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		return false;
+	}
+
+#ifdef LOCK_STATS
+	lock_stats_acquired(&lock->stats, 0);
+#endif
+	return true;
+}
+
+static inline
+void spin_unlock(Spinlock* lock)
+{
+#ifdef LOCK_STATS
+	lock_stats_released(&lock->stats);
+#endif
+	// Only the holder writes owner
+	__atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+/* Disable interrupts, then take the lock.
+ *
+ * Returns:
+ *   The interrupt state to hand to spin_unlock_irqrestore().
+ */
+static inline
+uint64_t spin_lock_irqsave(Spinlock* lock)
+{
+	const uint64_t flags = lock_irq_save();
+	spin_lock(lock);
+	return flags;
+}
+
+static inline
+void spin_unlock_irqrestore(Spinlock* lock, uint64_t flags)
+{
+	spin_unlock(lock);
+	lock_irq_restore(flags);
+}
+
+/* Take a queue lock.
+ *
+ * Params:
+ *   lock - The lock
+ *   node - Queue entry of this acquisition, owned by the lock until
+ *          it is handed to mcs_unlock()
+ */
+void mcs_lock(McsLock* lock, McsNode* node);
+
+void mcs_unlock(McsLock* lock, McsNode* node);
+
+static inline
+uint64_t mcs_lock_irqsave(McsLock* lock, McsNode* node)
+{
+	const uint64_t flags = lock_irq_save();
+	mcs_lock(lock, node);
+	return flags;
+}
+
+static inline
+void mcs_unlock_irqrestore(McsLock* lock, McsNode* node, uint64_t flags)
+{
+	mcs_unlock(lock, node);
+	lock_irq_restore(flags);
+}
+
+#endif
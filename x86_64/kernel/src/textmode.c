@@ -1,13 +1,18 @@
 #include "textmode.h"
 #include "inttypes.h"
+#include "support.h"
 
 #define MAX_X 80
 #define MAX_Y 25
 
-#define NUM_PAGES (20)
-#define NUM_LINES (MAX_Y*NUM_PAGES)
-static uint8_t text[MAX_X*NUM_LINES];
-static uint32_t page_offset = 0;
+// Scrollback, a power of two
+#define TEXT_LINES 512
+#define TEXT_MASK (TEXT_LINES - 1)
+
+#define TEXT_COLOR 0x9
+
+// Roughly 5ms at 3GHz
+#define TEXT_FLUSH_CYCLES (1ULL << 24)
 
 typedef struct
 {
@@ -17,127 +22,296 @@ typedef struct
 
 #define VIDEO_ADDRESS 0xB8000
 
+// The 32KiB text window at VIDEO_ADDRESS holds this many whole lines,
+// the CRTC can start the screen at any of them
+#define VIDEO_CELLS 16384
+#define VIDEO_LINES (VIDEO_CELLS / MAX_X)
+
+#define CRTC_INDEX 0x3D4
+#define CRTC_DATA 0x3D5
+#define CRTC_START_HIGH 0x0C
+#define CRTC_START_LOW 0x0D
+
 static video_cell* video = (video_cell*)VIDEO_ADDRESS;
 
+/* Lines are numbered from the start of output and never wrap, line n
+ * is kept in text[n & TEXT_MASK] until TEXT_LINES more lines follow.
+ */
+static char text[TEXT_LINES][MAX_X];
+
+static uint64_t write_line;
 static uint16_t write_x;
-static uint16_t write_y;
+
+// Newest line ever started, backspaces can leave write_line below it
+static uint64_t last_line;
+
+// Oldest line changed since the last flush
+static uint64_t dirty_from;
+static bool dirty;
+
+// First line on the screen, when not following the output
+static uint64_t view_top;
+static bool following = true;
+
+// Line shown in video memory row 0, and what the last flush drew
+// (a shown_top of -1 forces a full redraw)
+static uint64_t video_origin;
+static uint64_t shown_top = (uint64_t)-1;
+static bool shown_following = true;
+
+static uint64_t last_flush;
+
+static void flush(void);
+
+static
+void clear_line(uint64_t line)
+{
+	char* row = text[line & TEXT_MASK];
+	for (uint32_t x = 0; x < MAX_X; ++x)
+	{
+		row[x] = ' ';
+	}
+}
+
+static
+uint64_t oldest_line(void)
+{
+	return last_line >= TEXT_LINES ? last_line - TEXT_LINES + 1 : 0;
+}
+
+static
+uint64_t bottom_top(void)
+{
+	return write_line >= MAX_Y ? write_line - MAX_Y + 1 : 0;
+}
+
+static
+void mark_dirty(uint64_t line)
+{
+	if (!dirty || line < dirty_from)
+	{
+		dirty_from = line;
+	}
+	dirty = true;
+}
+
+static
+void set_start_address(uint16_t cell)
+{
+	_outb(CRTC_INDEX, CRTC_START_HIGH);
+	_outb(CRTC_DATA, cell >> 8);
+	_outb(CRTC_INDEX, CRTC_START_LOW);
+	_outb(CRTC_DATA, cell & 0xFF);
+}
+
+static
+void draw_line(uint64_t line)
+{
+	const char* row = text[line & TEXT_MASK];
+	video_cell* cell = &video[(line - video_origin) * MAX_X];
+	for (uint32_t x = 0; x < MAX_X; ++x)
+	{
+		cell[x].c = row[x];
+		cell[x].color = TEXT_COLOR;
+	}
+}
+
+static
+void new_line(void)
+{
+	++write_line;
+	write_x = 0;
+	clear_line(write_line);
+	mark_dirty(write_line);
+
+	if (write_line > last_line)
+	{
+		last_line = write_line;
+	}
+
+	if (_rdtsc() - last_flush >= TEXT_FLUSH_CYCLES)
+	{
+		flush();
+	}
+}
 
 void text_mode_reset()
 {
-	write_x = write_y = 0;
+	for (uint64_t line = 0; line < TEXT_LINES; ++line)
+	{
+		clear_line(line);
+	}
+
+	write_line = 0;
+	write_x = 0;
+	last_line = 0;
+	dirty = false;
+	following = true;
+	view_top = 0;
+	video_origin = 0;
+	shown_top = (uint64_t)-1;
+	shown_following = true;
+	last_flush = 0;
 }
 
 void init_text_mode(void)
 {
-	write_x = write_y = 0;
+	text_mode_reset();
 }
 
 void clear_screen()
 {
-	uint16_t* video = (uint16_t*)VIDEO_ADDRESS;
-	for (int i = 0; i < MAX_X*MAX_Y; ++i)
+	text_mode_reset();
+
+	uint16_t* cells = (uint16_t*)VIDEO_ADDRESS;
+	for (uint32_t i = 0; i < MAX_X*MAX_Y; ++i)
 	{
-		video[i] = 0;
+		cells[i] = 0;
 	}
+	set_start_address(0);
+	shown_top = 0;
 }
 
-static void display_page(uint32_t page_offset)
+/* Copy the changes to video memory, called with the print lock held.
+ */
+static
+void flush(void)
 {
-	clear_screen();
-	uint32_t text_y = page_offset*MAX_Y;
-	for (uint32_t disp_y = 0; disp_y < MAX_Y; ++disp_y, ++text_y)
+	last_flush = _rdtsc();
+
+	// Output since the view was set may have overwritten the lines it
+	// shows, or backspaces may have moved the bottom up to it
+	if (!following && view_top < oldest_line())
+	{
+		view_top = oldest_line();
+	}
+	if (!following && view_top >= bottom_top())
+	{
+		following = true;
+	}
+
+	const uint64_t top = following ? bottom_top() : view_top;
+	const bool moved = top != shown_top || following != shown_following;
+	if (!moved && !dirty)
+	{
+		return;
+	}
+
+	uint64_t from = dirty ? dirty_from : top + MAX_Y;
+	if (moved)
 	{
-		for (uint32_t disp_x = 0; disp_x < MAX_X; ++disp_x)
+		// Lines scrolled in from below were written since the last flush
+		// and are dirty. Anything else needs the whole screen redrawn,
+		// lines off the screen are not kept up to date in video memory.
+		if (top < shown_top || shown_top == (uint64_t)-1 ||
+				!following || !shown_following)
 		{
-			const uint32_t text_offset = text_y*MAX_X + disp_x;
-			const uint32_t offset = disp_y*MAX_X + disp_x;
-			video[offset].c = text[text_offset];
-			video[offset].color = 0x9;
+			from = top;
 		}
+
+		// Move the window through video memory, rewinding to row 0 once
+		// the screen would run off its end
+		if (top < video_origin || top + MAX_Y > video_origin + VIDEO_LINES)
+		{
+			video_origin = top;
+			from = top;
+		}
+
+		set_start_address((top - video_origin) * MAX_X);
+		shown_top = top;
+		shown_following = following;
 	}
+
+	if (from < top)
+	{
+		from = top;
+	}
+
+	const uint64_t end = top + MAX_Y;
+	for (uint64_t line = from; line < end && line <= write_line; ++line)
+	{
+		draw_line(line);
+	}
+
+	// Rows below the output when the screen is not yet full
+	for (uint64_t line = write_line + 1; line < end && from <= line; ++line)
+	{
+		video_cell* cell = &video[(line - video_origin) * MAX_X];
+		for (uint32_t x = 0; x < MAX_X; ++x)
+		{
+			cell[x].c = ' ';
+			cell[x].color = TEXT_COLOR;
+		}
+	}
+
+	dirty = false;
+}
+
+void text_mode_flush()
+{
+	const ConsoleLock state = console_lock();
+	flush();
+	console_unlock(state);
 }
 
 void page_up()
 {
-	if (page_offset > 0)
-	{
-		--page_offset;
-	}
+	const ConsoleLock state = console_lock();
+	const uint64_t top = following ? bottom_top() : view_top;
+	const uint64_t oldest = oldest_line();
 
-	display_page(page_offset);
+	view_top = top >= oldest + MAX_Y ? top - MAX_Y : oldest;
+	following = false;
+	flush();
+	console_unlock(state);
 }
 
 void page_down()
 {
-	const uint32_t max_page_offset = write_y / MAX_Y;
-	if (page_offset < max_page_offset)
+	const ConsoleLock state = console_lock();
+	if (!following)
 	{
-		++page_offset;
+		view_top += MAX_Y;
 	}
 
-	display_page(page_offset);
+	flush();
+	console_unlock(state);
 }
 
 void text_mode_char(char c)
 {
-	// Scroll to bottom
-	const uint32_t current_page = write_y / MAX_Y;
-	if (current_page != page_offset)
-	{
-		page_offset = current_page;
-		clear_screen();
-	}
-
 	switch (c)
 	{
 		case '\r':
 		case '\n':
-			{
-				++write_y;
-				if (write_y >= NUM_LINES)
-				{
-					write_y = 0;
-				}
-				write_x = 0;
-			}
+			new_line();
 			break;
 		case '\b':
 			{
 				if (write_x == 0)
 				{
-					write_x = MAX_X;
-					if (write_y > 0)
+					if (write_line == oldest_line())
 					{
-						--write_y;
+						break;
 					}
+					--write_line;
+					write_x = MAX_X;
 				}
 				--write_x;
 
-				// Clear this spot
-				text[write_y*MAX_X + write_x] = ' ';
-
-				const uint32_t offset = (write_y%MAX_Y)*MAX_X + write_x;
-				video[offset].c = ' ';
-				video[offset].color = 0x9;
+				text[write_line & TEXT_MASK][write_x] = ' ';
+				mark_dirty(write_line);
 			}
 			break;
 		default:
 			{
-				text[write_y*MAX_X + write_x] = c;
+				text[write_line & TEXT_MASK][write_x] = c;
+				mark_dirty(write_line);
 
-				const uint32_t offset = (write_y%MAX_Y)*MAX_X + write_x;
-				video[offset].c = c;
-				video[offset].color = 0x9;
-				
 				++write_x;
 				if (write_x >= MAX_X)
 				{
-					write_x = 0;
-					++write_y;
-					if (write_y >= NUM_LINES)
-					{
-						write_y = 0;
-					}
+					new_line();
 				}
 			}
 			break;
@@ -1,10 +1,48 @@
 #ifndef __X86_64_TEXT_MODE_H__
 #define __X86_64_TEXT_MODE_H__
 
+#include "inttypes.h"
+
+/* VGA text console. Characters go into a scrollback ring buffer and
+ * are copied to video memory in batches: on text_mode_flush(), or at a
+ * line break once TEXT_FLUSH_CYCLES have passed since the last flush.
+ * Only lines that changed are copied, and the screen scrolls by moving
+ * the CRTC start address rather than redrawing.
+ */
+
+typedef struct
+{
+	uint64_t flags;  // Interrupt state to restore
+	bool nested;     // This CPU already held the lock
+} ConsoleLock;
+
 void init_text_mode(void);
 
+/* Take the lock kprintf() prints under, with interrupts disabled.
+ * Everything that touches the console holds it. A CPU that already
+ * holds it, like a panic in the middle of a message, gets it again.
+ * Defined in kprintf.c.
+ *
+ * Returns:
+ *   What to hand to console_unlock().
+ */
+ConsoleLock console_lock(void);
+
+void console_unlock(ConsoleLock state);
+
+/* Write a character. Not safe to call from several CPUs at once, it
+ * is only called by kprintf(), which serializes the callers.
+ */
 void text_mode_char(char c);
 
+/* Copy everything written so far to the screen. Takes the console
+ * lock, like the paging functions below.
+ */
+void text_mode_flush(void);
+
+/* Scroll the view one screen back in the scrollback, or forward again.
+ * New output keeps the view at the bottom once it is reached.
+ */
 void page_up(void);
 
 void page_down(void);
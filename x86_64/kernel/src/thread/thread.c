@@ -0,0 +1,396 @@
+#include "thread.h"
+
+#include "cpu.h"
+#include "cpuid.h"
+#include "klib.h"
+#include "panic.h"
+#include "safety.h"
+#include "sync/spinlock.h"
+#include "interrupts/apic.h"
+#include "interrupts/defines.h"
+#include "memory/defines.h"
+#include "memory/phys_alloc.h"
+#include "memory/stack.h"
+#include "timer/timer.h"
+
+// Vectors that run on an IST stack, their frame is not on the stack of
+// the interrupted thread
+#define VECTOR_NMI 2
+#define VECTOR_DOUBLE_FAULT 8
+#define VECTOR_MACHINE_CHECK 18
+
+#define RFLAGS_RESERVED (1 << 1)
+
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXSAVE (1 << 18)
+
+// Initial control words of a new thread's FPU image, all exceptions
+// masked, at their offsets in the FXSAVE and XSAVE layouts
+#define FPU_FCW_OFFSET 0
+#define FPU_FCW_DEFAULT 0x037F
+#define FPU_MXCSR_OFFSET 24
+#define FPU_MXCSR_DEFAULT 0x1F80
+
+#define THREADS_PER_FRAME (_2_MIB / THREAD_STACK_SIZE)
+
+COMPILE_ASSERT(_2_MIB % THREAD_STACK_SIZE == 0);
+COMPILE_ASSERT(sizeof(Thread) >= sizeof(StackNode));
+
+/* The frame isr_save pushes, see interrupts.S.
+ */
+typedef struct
+{
+	uint64_t rdi, rsi, rdx, rcx, rbx, rax, rbp;
+	uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
+	uint64_t vector, code;
+	uint64_t rip, cs, rflags, rsp, ss;
+} Frame;
+
+COMPILE_ASSERT(sizeof(Frame) == 22 * 8);
+
+typedef struct
+{
+	Spinlock lock;     // Protects the queue
+	Thread* head;      // Ready threads, in the order they run
+	Thread* tail;
+	Thread* zombie;    // Exited thread whose stack is still in use
+	Timer slice;       // Ends the time slice of the running thread
+	Thread idle;       // The context the CPU booted in
+} __attribute__((aligned(64))) ThreadCPU;
+
+static ThreadCPU thread_cpus[MAX_CPUS];
+
+// How the SSE/AVX state is switched, from what klib_init() enabled
+typedef enum
+{
+	FPU_NONE,
+	FPU_FXSAVE,
+	FPU_XSAVE
+} FpuMode;
+
+static FpuMode fpu_mode = FPU_NONE;
+
+// Unused stacks, carved from 2MiB frames and never given back
+static Spinlock stacks_lock;
+static Stack free_stacks;
+
+static
+Thread* alloc_stack(void)
+{
+	const uint64_t flags = spin_lock_irqsave(&stacks_lock);
+	if (stack_empty(&free_stacks))
+	{
+		uint8_t* frame = (uint8_t*) phys_alloc_2MIB();
+		if (frame == NULL)
+		{
+			spin_unlock_irqrestore(&stacks_lock, flags);
+			return NULL;
+		}
+
+		for (uint64_t i = 0; i < THREADS_PER_FRAME; ++i)
+		{
+			stack_push(&free_stacks, (StackNode*)(frame + i * THREAD_STACK_SIZE));
+		}
+	}
+
+	Thread* thread = (Thread*) stack_pop(&free_stacks);
+	spin_unlock_irqrestore(&stacks_lock, flags);
+	return thread;
+}
+
+static
+void free_stack(Thread* thread)
+{
+	const uint64_t flags = spin_lock_irqsave(&stacks_lock);
+	stack_push(&free_stacks, (StackNode*)thread);
+	spin_unlock_irqrestore(&stacks_lock, flags);
+}
+
+static
+void fpu_init(void)
+{
+	uint64_t cr4;
+	__asm__ volatile("movq %%cr4, %0" : "=r"(cr4));
+
+	if (cr4 & CR4_OSXSAVE)
+	{
+		// EBX is the image size for the features enabled in XCR0
+		uint32_t eax, ebx, ecx, edx;
+		cpuid_count(0xD, 0, &eax, &ebx, &ecx, &edx);
+		ASSERT(ebx <= THREAD_FPU_SIZE);
+		fpu_mode = FPU_XSAVE;
+	}
+	else if (cr4 & CR4_OSFXSR)
+	{
+		fpu_mode = FPU_FXSAVE;
+	}
+	else
+	{
+		fpu_mode = FPU_NONE;
+	}
+}
+
+/* Every feature XCR0 enables is saved, EDX:EAX is the mask.
+ */
+static inline
+void fpu_save(Thread* thread)
+{
+	if (fpu_mode == FPU_XSAVE)
+	{
+		__asm__ volatile("xsave64 (%0)" :: "r"(thread->fpu), "a"(~0U), "d"(~0U) : "memory");
+	}
+	else if (fpu_mode == FPU_FXSAVE)
+	{
+		__asm__ volatile("fxsave64 (%0)" :: "r"(thread->fpu) : "memory");
+	}
+}
+
+static inline
+void fpu_restore(const Thread* thread)
+{
+	if (fpu_mode == FPU_XSAVE)
+	{
+		__asm__ volatile("xrstor64 (%0)" :: "r"(thread->fpu), "a"(~0U), "d"(~0U) : "memory");
+	}
+	else if (fpu_mode == FPU_FXSAVE)
+	{
+		__asm__ volatile("fxrstor64 (%0)" :: "r"(thread->fpu) : "memory");
+	}
+}
+
+/* Queue operations, called with the CPU's lock held.
+ */
+static
+void enqueue(ThreadCPU* tc, Thread* thread)
+{
+	thread->next = NULL;
+	if (tc->tail == NULL)
+	{
+		tc->head = thread;
+	}
+	else
+	{
+		tc->tail->next = thread;
+	}
+	tc->tail = thread;
+}
+
+static
+Thread* dequeue(ThreadCPU* tc)
+{
+	Thread* thread = tc->head;
+	if (thread != NULL)
+	{
+		tc->head = thread->next;
+		if (tc->head == NULL)
+		{
+			tc->tail = NULL;
+		}
+	}
+	return thread;
+}
+
+static
+void slice_expired(Timer* timer)
+{
+	UNUSED(timer);
+	this_cpu()->need_switch = 1;
+}
+
+/* A software interrupt, no EOI.
+ */
+static
+void yield_handler(uint64_t vector, uint64_t code)
+{
+	UNUSED(vector);
+	UNUSED(code);
+	this_cpu()->need_switch = 1;
+}
+
+static
+void wake_handler(uint64_t vector, uint64_t code)
+{
+	UNUSED(vector);
+	UNUSED(code);
+	this_cpu()->need_switch = 1;
+	apic_eoi();
+}
+
+/* First code a new thread runs, the frame thread_create() built
+ * returns here.
+ */
+static
+void thread_start(Thread* thread)
+{
+	thread->entry(thread->arg);
+	thread_exit();
+}
+
+void thread_init()
+{
+	fpu_init();
+	spin_init(&stacks_lock, "thread stacks");
+	stack_init(&free_stacks);
+	interrupts_install_isr(THREAD_YIELD_VECTOR, yield_handler);
+	interrupts_install_isr(THREAD_WAKE_VECTOR, wake_handler);
+	thread_init_cpu();
+}
+
+void thread_init_cpu()
+{
+	PerCPU* cpu = this_cpu();
+	ThreadCPU* tc = &thread_cpus[cpu->index];
+
+	memclr(tc, sizeof(ThreadCPU));
+	spin_init(&tc->lock, "thread queue");
+
+	tc->idle.name = "idle";
+	tc->idle.cpu = cpu->index;
+	tc->idle.state = THREAD_RUNNING;
+	cpu->need_switch = 0;
+	cpu->thread = &tc->idle;
+}
+
+Thread* thread_create(const char* name, ThreadEntry entry, void* arg, uint32_t cpu)
+{
+	ASSERT(cpu < cpu_count());
+
+	Thread* thread = alloc_stack();
+	if (thread == NULL)
+	{
+		return NULL;
+	}
+
+	memclr(thread, sizeof(Thread));
+	thread->name = name;
+	thread->entry = entry;
+	thread->arg = arg;
+	thread->cpu = cpu;
+	thread->state = THREAD_READY;
+
+	// A zeroed XSAVE header means every component starts in its init
+	// state, the control words are loaded either way
+	*(uint16_t*)(thread->fpu + FPU_FCW_OFFSET) = FPU_FCW_DEFAULT;
+	*(uint32_t*)(thread->fpu + FPU_MXCSR_OFFSET) = FPU_MXCSR_DEFAULT;
+
+	// thread_start() is entered as if called, with a null return address
+	// on top of a 16 byte aligned stack, and the frame below that
+	const uint64_t top = (uint64_t)thread + THREAD_STACK_SIZE;
+	*(uint64_t*)(top - 8) = 0;
+
+	Frame* frame = (Frame*)(top - 16 - sizeof(Frame));
+	memclr(frame, sizeof(Frame));
+	frame->rdi = (uint64_t)thread;
+	frame->rip = (uint64_t)thread_start;
+	frame->rflags = RFLAGS_IF | RFLAGS_RESERVED;
+	frame->rsp = top - 8;
+	__asm__ volatile("mov %%cs, %0" : "=r"(frame->cs));
+	__asm__ volatile("mov %%ss, %0" : "=r"(frame->ss));
+	thread->frame = (uint64_t)frame;
+
+	ThreadCPU* tc = &thread_cpus[cpu];
+	const uint64_t flags = spin_lock_irqsave(&tc->lock);
+	enqueue(tc, thread);
+	spin_unlock_irqrestore(&tc->lock, flags);
+
+	// An idle CPU is halted, or about to, the IPI gets it switching. On
+	// this CPU it arrives as soon as interrupts are enabled.
+	apic_send_ipi(cpu_get(cpu)->apic_id, THREAD_WAKE_VECTOR);
+
+	return thread;
+}
+
+void thread_exit()
+{
+	Thread* thread = thread_current();
+	ASSERT(thread != &thread_cpus[thread->cpu].idle);
+
+	// Never queued again, the next switch leaves it for good
+	thread->state = THREAD_DEAD;
+	thread_yield();
+	panic("Dead thread resumed");
+}
+
+Thread* thread_current()
+{
+	return this_cpu()->thread;
+}
+
+uint64_t thread_switch(uint64_t frame)
+{
+	PerCPU* cpu = this_cpu();
+	Thread* prev = cpu->thread;
+	const Frame* f = (const Frame*)frame;
+
+	// Only switch out of a thread's own context. IST vectors run on
+	// their own stack, and a context with interrupts disabled holds
+	// locks or per-CPU state. The switch waits for the next interrupt.
+	if (prev == NULL
+			|| f->vector == VECTOR_NMI
+			|| f->vector == VECTOR_DOUBLE_FAULT
+			|| f->vector == VECTOR_MACHINE_CHECK
+			|| !(f->rflags & RFLAGS_IF))
+	{
+		return frame;
+	}
+
+	cpu->need_switch = 0;
+
+	ThreadCPU* tc = &thread_cpus[cpu->index];
+
+	// The last switch left the zombie's stack
+	if (tc->zombie != NULL)
+	{
+		free_stack(tc->zombie);
+		tc->zombie = NULL;
+	}
+
+	spin_lock(&tc->lock);
+	Thread* next = dequeue(tc);
+	if (next == NULL)
+	{
+		if (prev->state == THREAD_RUNNING)
+		{
+			spin_unlock(&tc->lock);
+			return frame;
+		}
+		next = &tc->idle;
+	}
+
+	if (prev->state == THREAD_RUNNING)
+	{
+		prev->state = THREAD_READY;
+		if (prev != &tc->idle)
+		{
+			enqueue(tc, prev);
+		}
+	}
+	spin_unlock(&tc->lock);
+
+	prev->frame = frame;
+	if (prev->state == THREAD_DEAD)
+	{
+		tc->zombie = prev;
+	}
+	else
+	{
+		fpu_save(prev);
+	}
+	fpu_restore(next);
+
+	next->state = THREAD_RUNNING;
+	++next->switches;
+	cpu->thread = next;
+
+	// The idle thread runs until something is queued, it has no slice
+	if (next == &tc->idle)
+	{
+		timer_cancel(&tc->slice);
+	}
+	else
+	{
+		timer_arm(&tc->slice, now() + THREAD_SLICE_NS, slice_expired, NULL);
+	}
+
+	return next->frame;
+}
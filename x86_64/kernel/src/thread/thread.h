@@ -0,0 +1,111 @@
+#ifndef __X86_64_THREAD_THREAD_H__
+#define __X86_64_THREAD_THREAD_H__
+
+#include "inttypes.h"
+
+/* Preemptive kernel threads.
+ *
+ * Every thread has its own stack, with the Thread at the bottom of it.
+ * A thread that is not running is suspended inside an interrupt: its
+ * registers are the frame isr_save in interrupts.S pushed on its stack,
+ * and resuming it is isr_restore on that frame. The SSE/AVX registers
+ * are not in the frame, a thread can be preempted inside a vector
+ * memcpy, so the switch saves them in Thread.fpu. A switch only happens
+ * on the way out of a full path interrupt, when a handler set
+ * PerCPU.need_switch:
+ *
+ *   - thread_yield() raises THREAD_YIELD_VECTOR
+ *   - a thread's time slice timer fires
+ *   - another CPU queues a thread here and sends THREAD_WAKE_VECTOR
+ *
+ * Each CPU runs its threads round robin from its own run queue, they
+ * do not migrate. The context a CPU booted in becomes its idle thread,
+ * which runs whenever the queue is empty and is never queued itself.
+ */
+
+// Stack and Thread of one thread
+#define THREAD_STACK_SIZE 0x8000
+
+// Room for the FXSAVE or XSAVE image of the x87, SSE and AVX state
+#define THREAD_FPU_SIZE 1024
+
+// Time a thread runs before the next one in the queue gets the CPU
+#define THREAD_SLICE_NS 10000000ULL
+
+#define THREAD_YIELD_VECTOR 0x49
+#define THREAD_WAKE_VECTOR 0x4A
+
+typedef void (*ThreadEntry)(void* arg);
+
+typedef enum
+{
+	THREAD_READY,
+	THREAD_RUNNING,
+	THREAD_DEAD
+} ThreadState;
+
+typedef struct _Thread
+{
+	uint64_t frame;         // Saved interrupt frame while not running
+	struct _Thread* next;   // Run queue link
+	const char* name;
+	ThreadEntry entry;
+	void* arg;
+	uint32_t cpu;           // CPU whose queue it runs from
+	ThreadState state;
+	uint64_t switches;      // Times it was switched to
+
+	// SSE/AVX state while not running
+	uint8_t fpu[THREAD_FPU_SIZE] __attribute__((aligned(64)));
+} Thread;
+
+/* Turn the boot context of the bootstrap processor into its idle
+ * thread and install the switch vectors. Needs the timer.
+ */
+void thread_init(void);
+
+/* Turn the context of an application processor into its idle thread.
+ */
+void thread_init_cpu(void);
+
+/* Create a thread and queue it on a CPU.
+ *
+ * Params:
+ *   name  - Name of the thread
+ *   entry - Function the thread runs, returning from it exits the
+ *           thread
+ *   arg   - Handed to entry
+ *   cpu   - CPU to run on, below cpu_count()
+ *
+ * Returns:
+ *   The thread, or NULL when out of memory.
+ */
+Thread* thread_create(const char* name, ThreadEntry entry, void* arg, uint32_t cpu);
+
+/* Give the CPU to the next thread in this CPU's queue, if there is
+ * one. Must be called with interrupts enabled.
+ */
+static inline
+void thread_yield(void)
+{
+	__asm__ volatile("int %0" :: "i"(THREAD_YIELD_VECTOR) : "memory");
+}
+
+/* End the calling thread, it does not return. Its stack is freed once
+ * another thread runs.
+ */
+void thread_exit(void);
+
+/* The thread running on this CPU.
+ */
+Thread* thread_current(void);
+
+/* Called by isr_save with the frame of the interrupted thread when
+ * PerCPU.need_switch is set.
+ *
+ * Returns:
+ *   The frame of the thread to resume.
+ */
+uint64_t thread_switch(uint64_t frame);
+
+#endif
@@ -0,0 +1,570 @@
+#include "timer.h"
+
+#include "cpu.h"
+#include "cpuid.h"
+#include "klib.h"
+#include "log.h"
+#include "safety.h"
+#include "support.h"
+#include "memory/defines.h"
+#include "memory/phys_alloc.h"
+#include "interrupts/apic.h"
+#include "interrupts/ioapic.h"
+#include "interrupts/defines.h"
+
+// Vector of the LAPIC timer, in the highest priority class
+#define TIMER_VECTOR 0xF8
+
+#define MSR_TSC_DEADLINE 0x6E0
+#define CPUID_1_ECX_TSC_DEADLINE (1 << 24)
+#define CPUID_80000007_EDX_INVARIANT_TSC (1 << 8)
+
+// PIT channel 2, its gate is controlled through the keyboard
+// controller's port B, which also shows its output
+#define PIT_HZ 1193182
+#define PIT_CH2 0x42
+#define PIT_COMMAND 0x43
+#define PIT_CH2_MODE0_LOHI 0xB0
+#define PIT_PORT_B 0x61
+#define PIT_GATE2 0x01
+#define PIT_SPEAKER 0x02
+#define PIT_OUT2 0x20
+
+#define PIT_IRQ 0
+
+#define CALIBRATE_MS 10
+#define CALIBRATE_RUNS 3
+#define CALIBRATE_COUNT (PIT_HZ * CALIBRATE_MS / 1000)
+
+#define NS_PER_SEC 1000000000ULL
+
+__extension__ typedef unsigned __int128 uint128_t;
+
+// Hierarchical timing wheel, WHEEL_LEVELS levels of WHEEL_SLOTS slots
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 6
+
+// Furthest tick a timer can be placed at, about 13 days
+#define WHEEL_MAX_DELTA ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+// No timer armed
+#define WHEEL_IDLE ((uint64_t)-1)
+
+typedef struct
+{
+	uint64_t current;    // First tick not processed yet
+	uint64_t programmed; // Tick the hardware fires at
+	uint64_t count;      // Armed timers
+
+	// Bit per non-empty slot, for each level
+	uint64_t bitmap[WHEEL_LEVELS];
+
+	// Unordered, doubly linked lists of timers
+	Timer* slots[WHEEL_LEVELS * WHEEL_SLOTS];
+} __attribute__((aligned(64))) TimerWheel;
+
+COMPILE_ASSERT(WHEEL_SLOTS == 64);
+COMPILE_ASSERT(sizeof(TimerWheel) * MAX_CPUS <= _2_MIB);
+
+static TimerWheel* wheels = NULL;
+
+static bool tsc_deadline = false;
+static uint64_t tsc_hz = 0;
+static uint64_t lapic_hz = 0;
+static uint64_t tsc_base = 0;
+
+// 32.32 fixed point factors for the conversions, rounded up so a
+// deadline converted with them is never early
+static uint64_t tsc_to_ns_mult = 0;
+static uint64_t ns_to_tsc_mult = 0;
+static uint64_t ns_to_lapic_mult = 0;
+
+static inline
+uint64_t mul_shift32(uint64_t value, uint64_t mult)
+{
+	return (uint64_t)(((uint128_t)value * mult) >> 32);
+}
+
+static inline
+uint64_t mul_shift32_ceil(uint64_t value, uint64_t mult)
+{
+	return (uint64_t)(((uint128_t)value * mult + 0xFFFFFFFF) >> 32);
+}
+
+/* Factor that converts nanoseconds to ticks of a clock, at the full
+ * precision of the calibrated rate.
+ */
+static
+uint64_t ns_mult(uint64_t hz)
+{
+	// (hz << 32) / NS_PER_SEC without a 128-bit division, which the
+	// kernel has no libgcc for. The remainder is below 2^30, shifted it
+	// still fits.
+	const uint64_t whole = (hz / NS_PER_SEC) << 32;
+	const uint64_t rest = hz % NS_PER_SEC;
+	return whole + ((rest << 32) + NS_PER_SEC - 1) / NS_PER_SEC;
+}
+
+uint64_t tsc_to_ns(uint64_t cycles)
+{
+	return mul_shift32(cycles, tsc_to_ns_mult);
+}
+
+uint64_t ns_to_tsc(uint64_t ns)
+{
+	return mul_shift32(ns, ns_to_tsc_mult);
+}
+
+uint64_t now()
+{
+	if (tsc_hz == 0)
+	{
+		return 0;
+	}
+
+	return tsc_to_ns(_rdtsc() - tsc_base);
+}
+
+uint64_t timer_tsc_hz()
+{
+	return tsc_hz;
+}
+
+void delay_ns(uint64_t ns)
+{
+	const uint64_t end = _rdtsc() + ns_to_tsc(ns);
+	while (_rdtsc() < end)
+	{
+		__asm__ volatile("pause");
+	}
+}
+
+/* Count TSC cycles and LAPIC timer ticks over CALIBRATE_MS of PIT
+ * channel 2, taking the shortest of a few runs. Anything that delays
+ * the measurement, like an SMI, only makes a run longer.
+ */
+static
+void calibrate(void)
+{
+	uint64_t best_tsc = (uint64_t)-1;
+	uint64_t best_lapic = 0;
+
+	for (uint32_t run = 0; run < CALIBRATE_RUNS; ++run)
+	{
+		_outb(PIT_PORT_B, (_inb(PIT_PORT_B) & ~PIT_SPEAKER) | PIT_GATE2);
+		_outb(PIT_COMMAND, PIT_CH2_MODE0_LOHI);
+		_outb(PIT_CH2, CALIBRATE_COUNT & 0xFF);
+
+		apic_timer_start(0xFFFFFFFF);
+		const uint64_t start = _rdtsc();
+
+		// Counting starts once the high byte is written
+		_outb(PIT_CH2, CALIBRATE_COUNT >> 8);
+		while ((_inb(PIT_PORT_B) & PIT_OUT2) == 0);
+
+		const uint64_t cycles = _rdtsc() - start;
+		const uint64_t ticks = 0xFFFFFFFF - apic_timer_count();
+		apic_timer_start(0);
+
+		if (cycles < best_tsc)
+		{
+			best_tsc = cycles;
+			best_lapic = ticks;
+		}
+	}
+
+	tsc_hz = best_tsc * PIT_HZ / CALIBRATE_COUNT;
+	lapic_hz = best_lapic * PIT_HZ / CALIBRATE_COUNT;
+}
+
+/* The wheel tick of a point in time, rounded up or down.
+ */
+static inline
+uint64_t tick_ceil(uint64_t ns)
+{
+	return (ns + (1ULL << TIMER_TICK_SHIFT) - 1) >> TIMER_TICK_SHIFT;
+}
+
+static inline
+uint64_t tick_floor(uint64_t ns)
+{
+	return ns >> TIMER_TICK_SHIFT;
+}
+
+/* Level L of the wheel has a slot per 2^(WHEEL_BITS*L) ticks. Ticks
+ * before 'current' have been processed. A timer goes into the lowest
+ * level whose slots still tell its expiry apart within one turn, and
+ * is cascaded into the levels below once 'current' reaches the start
+ * of its slot.
+ */
+static inline
+uint64_t level_shift(uint32_t level)
+{
+	return level * WHEEL_BITS;
+}
+
+/* The bitmap rotated so that bit 0 is the slot at the given index.
+ */
+static inline
+uint64_t rotate(uint64_t bitmap, uint32_t index)
+{
+	return (bitmap >> index) | (bitmap << ((64 - index) & 63));
+}
+
+/* The next tick at or after 'current' that expires or cascades a
+ * timer, WHEEL_IDLE if none is armed.
+ */
+static
+uint64_t next_event(const TimerWheel* wheel)
+{
+	uint64_t next = WHEEL_IDLE;
+	for (uint32_t level = 0; level < WHEEL_LEVELS; ++level)
+	{
+		const uint64_t bitmap = wheel->bitmap[level];
+		if (bitmap == 0)
+		{
+			continue;
+		}
+
+		// First slot boundary of this level not processed yet
+		const uint64_t shift = level_shift(level);
+		const uint64_t base = ((wheel->current + (1ULL << shift) - 1) >> shift) << shift;
+		const uint32_t index = (base >> shift) & WHEEL_MASK;
+
+		const uint64_t tick = base + ((uint64_t)__builtin_ctzll(rotate(bitmap, index)) << shift);
+		if (tick < next)
+		{
+			next = tick;
+		}
+	}
+
+	return next;
+}
+
+/* The tick a timer in the given slot expires or cascades at.
+ */
+static inline
+uint64_t slot_tick(const Timer* timer, uint32_t level)
+{
+	const uint64_t shift = level_shift(level);
+	return (timer->expires >> shift) << shift;
+}
+
+/* Link a timer into its slot.
+ *
+ * Returns:
+ *   The tick it expires or cascades at.
+ */
+static
+uint64_t insert(TimerWheel* wheel, Timer* timer)
+{
+	if (timer->expires < wheel->current)
+	{
+		timer->expires = wheel->current;
+	}
+
+	uint64_t delta = timer->expires - wheel->current;
+	if (delta > WHEEL_MAX_DELTA)
+	{
+		// Fires early, and is put back by expire()
+		timer->expires = wheel->current + WHEEL_MAX_DELTA;
+		delta = WHEEL_MAX_DELTA;
+	}
+
+	const uint32_t level = delta < WHEEL_SLOTS ? 0 :
+		(63 - __builtin_clzll(delta)) / WHEEL_BITS;
+	const uint32_t index = (timer->expires >> level_shift(level)) & WHEEL_MASK;
+	const uint32_t slot = level * WHEEL_SLOTS + index;
+
+	Timer** head = &wheel->slots[slot];
+	timer->next = *head;
+	if (*head != NULL)
+	{
+		(*head)->pprev = &timer->next;
+	}
+	timer->pprev = head;
+	*head = timer;
+
+	timer->slot = slot;
+	wheel->bitmap[level] |= 1ULL << index;
+
+	return slot_tick(timer, level);
+}
+
+static
+void unlink(TimerWheel* wheel, Timer* timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next != NULL)
+	{
+		timer->next->pprev = timer->pprev;
+	}
+
+	// Timers being expired are no longer in their slot, which is then
+	// either empty with its bit clear or holds newer timers
+	const uint32_t slot = timer->slot;
+	if (wheel->slots[slot] == NULL)
+	{
+		wheel->bitmap[slot / WHEEL_SLOTS] &= ~(1ULL << (slot & WHEEL_MASK));
+	}
+}
+
+/* Take all timers out of a slot. They stay doubly linked from 'list',
+ * so they can still be cancelled.
+ */
+static
+void detach(TimerWheel* wheel, uint32_t slot, Timer** list)
+{
+	*list = wheel->slots[slot];
+	if (*list != NULL)
+	{
+		(*list)->pprev = list;
+	}
+
+	wheel->slots[slot] = NULL;
+	wheel->bitmap[slot / WHEEL_SLOTS] &= ~(1ULL << (slot & WHEEL_MASK));
+}
+
+/* Point the hardware at the start of the given tick, or stop it.
+ */
+static
+void program(TimerWheel* wheel, uint64_t tick)
+{
+	wheel->programmed = tick;
+
+	if (tick == WHEEL_IDLE)
+	{
+		// A deadline of 0 disarms
+		if (tsc_deadline)
+		{
+			writemsr(MSR_TSC_DEADLINE, 0, 0);
+		}
+		else
+		{
+			apic_timer_start(0);
+		}
+		return;
+	}
+
+	// Relative to now(), so conversion errors do not grow with uptime.
+	// Both factors round up, now() has reached the tick when it fires.
+	const uint64_t deadline = tick << TIMER_TICK_SHIFT;
+	const uint64_t t = now();
+	const uint64_t delta = deadline > t ? deadline - t : 0;
+
+	if (tsc_deadline)
+	{
+		// One in the past fires right away
+		const uint64_t tsc = _rdtsc() + mul_shift32_ceil(delta, ns_to_tsc_mult);
+		writemsr(MSR_TSC_DEADLINE, tsc & 0xFFFFFFFF, tsc >> 32);
+		return;
+	}
+
+	uint64_t count = mul_shift32_ceil(delta, ns_to_lapic_mult);
+
+	// Too far away for the counter, wake up early and reprogram then
+	if (count > 0xFFFFFFFF)
+	{
+		count = 0xFFFFFFFF;
+	}
+	if (count == 0)
+	{
+		count = 1;
+	}
+
+	apic_timer_start(count);
+}
+
+/* Process every tick up to the current time: cascade the higher
+ * levels and run the timers that are due.
+ */
+static
+void expire(TimerWheel* wheel)
+{
+	const uint64_t t = now();
+	const uint64_t now_tick = tick_floor(t);
+
+	for (;;)
+	{
+		// Ticks without work are skipped
+		const uint64_t tick = next_event(wheel);
+		if (tick > now_tick)
+		{
+			break;
+		}
+		wheel->current = tick;
+
+		for (uint32_t level = WHEEL_LEVELS - 1; level > 0; --level)
+		{
+			const uint64_t shift = level_shift(level);
+			if ((tick & ((1ULL << shift) - 1)) != 0)
+			{
+				continue;
+			}
+
+			Timer* list;
+			detach(wheel, level * WHEEL_SLOTS + ((tick >> shift) & WHEEL_MASK), &list);
+			while (list != NULL)
+			{
+				Timer* timer = list;
+				unlink(wheel, timer);
+				insert(wheel, timer);
+			}
+		}
+
+		// Timers the callbacks arm go into later ticks
+		Timer* list;
+		detach(wheel, tick & WHEEL_MASK, &list);
+		wheel->current = tick + 1;
+
+		while (list != NULL)
+		{
+			Timer* timer = list;
+			unlink(wheel, timer);
+			if (timer->deadline > t)
+			{
+				// Clamped by insert(), its expires is this tick. Clamp it
+				// again from the new current.
+				timer->expires = tick_ceil(timer->deadline);
+				insert(wheel, timer);
+				continue;
+			}
+
+			timer->armed = false;
+			--wheel->count;
+			timer->callback(timer);
+		}
+	}
+
+	if (wheel->current <= now_tick)
+	{
+		wheel->current = now_tick + 1;
+	}
+}
+
+static
+void timer_handler(uint64_t vector, uint64_t code)
+{
+	UNUSED(vector);
+	UNUSED(code);
+
+	TimerWheel* wheel = &wheels[cpu_index()];
+	expire(wheel);
+	program(wheel, next_event(wheel));
+	apic_eoi();
+}
+
+void timer_arm(Timer* timer, uint64_t deadline, TimerCallback callback, void* data)
+{
+	const uint64_t flags = irq_save();
+	TimerWheel* wheel = &wheels[cpu_index()];
+
+	if (timer->armed)
+	{
+		ASSERT(timer->cpu == cpu_index());
+		unlink(wheel, timer);
+		--wheel->count;
+	}
+	else if (wheel->count == 0)
+	{
+		// Nothing to process in between, start from the present
+		const uint64_t now_tick = tick_floor(now());
+		if (now_tick > wheel->current)
+		{
+			wheel->current = now_tick;
+		}
+	}
+
+	timer->deadline = deadline;
+	timer->expires = tick_ceil(deadline);
+	timer->callback = callback;
+	timer->data = data;
+	timer->cpu = cpu_index();
+	timer->armed = true;
+	++wheel->count;
+
+	// Moving a timer later leaves an early interrupt, which finds
+	// nothing to do and reprograms
+	const uint64_t tick = insert(wheel, timer);
+	if (tick < wheel->programmed)
+	{
+		program(wheel, tick);
+	}
+
+	irq_restore(flags);
+}
+
+bool timer_cancel(Timer* timer)
+{
+	const uint64_t flags = irq_save();
+
+	const bool was_armed = timer->armed;
+	if (was_armed)
+	{
+		ASSERT(timer->cpu == cpu_index());
+		TimerWheel* wheel = &wheels[cpu_index()];
+		unlink(wheel, timer);
+		timer->armed = false;
+		--wheel->count;
+	}
+
+	irq_restore(flags);
+	return was_armed;
+}
+
+void timer_init_cpu()
+{
+	TimerWheel* wheel = &wheels[cpu_index()];
+	memclr(wheel, sizeof(TimerWheel));
+	wheel->current = tick_floor(now());
+	wheel->programmed = WHEEL_IDLE;
+
+	apic_timer_init(TIMER_VECTOR, tsc_deadline);
+}
+
+void timer_init()
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid_count(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+	bool invariant = false;
+	if (eax >= 0x80000007)
+	{
+		cpuid_count(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+		invariant = (edx & CPUID_80000007_EDX_INVARIANT_TSC) != 0;
+	}
+	if (!invariant)
+	{
+		log_warn(TIMER, "Timer: TSC is not invariant, now() may drift\n");
+	}
+
+	// Calibrate in one-shot mode, the LAPIC does not count in
+	// TSC-deadline mode
+	apic_timer_init(TIMER_VECTOR, false);
+	calibrate();
+	if (tsc_hz == 0 || lapic_hz == 0)
+	{
+		panic("Timer calibration failed");
+	}
+
+	tsc_to_ns_mult = ((NS_PER_SEC << 32) + tsc_hz - 1) / tsc_hz;
+	ns_to_tsc_mult = ns_mult(tsc_hz);
+	ns_to_lapic_mult = ns_mult(lapic_hz);
+
+	cpuid_count(1, 0, &eax, &ebx, &ecx, &edx);
+	tsc_deadline = (ecx & CPUID_1_ECX_TSC_DEADLINE) != 0;
+
+	log_info(TIMER, "Timer: TSC %d kHz, LAPIC %d kHz, %s mode\n",
+			tsc_hz / 1000, lapic_hz / 1000, tsc_deadline ? "TSC-deadline" : "one-shot");
+
+	interrupts_install_isr(TIMER_VECTOR, timer_handler);
+
+	// No periodic tick
+	ioapic_set_masked(PIT_IRQ, true);
+
+	wheels = (TimerWheel*) phys_alloc_2MIB_safe("Timer wheels");
+
+	tsc_base = _rdtsc();
+	timer_init_cpu();
+}
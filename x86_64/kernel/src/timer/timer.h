@@ -0,0 +1,84 @@
+#ifndef __X86_64_TIMER_TIMER_H__
+#define __X86_64_TIMER_TIMER_H__
+
+#include "inttypes.h"
+
+/* Tickless kernel time. The TSC is the clock, calibrated against the
+ * PIT at boot. Armed timers are kept in a hierarchical timing wheel per
+ * CPU, and each CPU's LAPIC timer is programmed for only the next tick
+ * that has work, in TSC-deadline mode when the CPU has it and in
+ * one-shot mode otherwise. There is no periodic tick.
+ */
+
+// Wheel tick of 2^TIMER_TICK_SHIFT ns, timers fire up to one tick
+// after their deadline
+#define TIMER_TICK_SHIFT 14
+
+struct _Timer;
+
+typedef void (*TimerCallback)(struct _Timer* timer);
+
+typedef struct _Timer
+{
+	struct _Timer* next;
+	struct _Timer** pprev;  // Link pointing at this timer
+	uint64_t deadline;      // now() value to fire at
+	uint64_t expires;       // Wheel tick to fire at
+	TimerCallback callback;
+	void* data;             // For the callback
+	uint32_t cpu;           // CPU it is armed on
+	uint16_t slot;          // Wheel slot it is linked into
+	bool armed;
+} Timer;
+
+/* Calibrate the TSC and LAPIC timer and start the timer on the
+ * bootstrap processor. Interrupts must still be disabled, and the
+ * LAPIC and I/O APIC set up.
+ */
+void timer_init(void);
+
+/* Start the timer on another CPU, after timer_init() has run.
+ */
+void timer_init_cpu(void);
+
+/* Nanoseconds since timer_init(), 0 before it.
+ */
+uint64_t now(void);
+
+/* Convert between TSC cycles and nanoseconds.
+ */
+uint64_t tsc_to_ns(uint64_t cycles);
+
+uint64_t ns_to_tsc(uint64_t ns);
+
+/* The calibrated TSC frequency in Hz.
+ */
+uint64_t timer_tsc_hz(void);
+
+/* Spin for at least the given time.
+ */
+void delay_ns(uint64_t ns);
+
+/* Arm a timer on the current CPU, in constant time. The callback runs
+ * in the timer interrupt on this CPU, with interrupts disabled, once
+ * now() has passed the deadline. It may arm the timer again. A timer
+ * that is already armed is moved to the new deadline.
+ *
+ * Params:
+ *   timer    - The timer, owned by the caller until it fires or is
+ *              cancelled
+ *   deadline - When to fire, in now() nanoseconds
+ *   callback - What to call
+ *   data     - Stored in the timer for the callback
+ */
+void timer_arm(Timer* timer, uint64_t deadline, TimerCallback callback, void* data);
+
+/* Disarm a timer, in constant time. Must be called on the CPU it was
+ * armed on.
+ *
+ * Returns:
+ *   True if it was armed, false if it already fired or was never armed.
+ */
+bool timer_cancel(Timer* timer);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef __X86_64_TRACE_EVENTS_H__
+#define __X86_64_TRACE_EVENTS_H__
+
+/* Every trace event, X(NAME, format). The format decodes the record's
+ * arguments in trace_dump(), the same way kprintf() would. Add new
+ * events at the end, at most TRACE_MAX_EVENTS of them.
+ */
+#define TRACE_EVENTS(X) \
+	X(MARK,            "mark %d %d %d %d") \
+	X(PHYS_ALLOC_4KIB, "phys_alloc_4KIB 0x%x node %d") \
+	X(PHYS_FREE_4KIB,  "phys_free_4KIB 0x%x node %d") \
+	X(PHYS_ALLOC_2MIB, "phys_alloc_2MIB 0x%x node %d") \
+	X(PHYS_FREE_2MIB,  "phys_free_2MIB 0x%x node %d") \
+	X(OBJCACHE_REFILL, "objcache refill 0x%x full %d empty %d") \
+	X(OBJCACHE_FLUSH,  "objcache flush 0x%x full %d empty %d") \
+	X(INTERRUPT,       "unhandled interrupt 0x%x code %d")
+
+#endif
@@ -0,0 +1,136 @@
+#include "trace.h"
+
+#ifdef TRACE_KERNEL
+
+#include "safety.h"
+#include "kprintf.h"
+#include "memory/defines.h"
+#include "memory/phys_alloc.h"
+
+COMPILE_ASSERT(TRACE_NUM_EVENTS <= TRACE_MAX_EVENTS);
+COMPILE_ASSERT(sizeof(TraceRecord) == 48);
+COMPILE_ASSERT(sizeof(TraceRing) == 64);
+COMPILE_ASSERT(TRACE_RING_RECORDS * sizeof(TraceRecord) <= _2_MIB);
+
+#define TRACE_NAME(NAME, FORMAT) #NAME,
+static const char* event_names[] = { TRACE_EVENTS(TRACE_NAME) };
+#undef TRACE_NAME
+
+#define TRACE_FORMAT(NAME, FORMAT) FORMAT,
+static const char* event_formats[] = { TRACE_EVENTS(TRACE_FORMAT) };
+#undef TRACE_FORMAT
+
+TraceRing trace_rings[MAX_CPUS];
+volatile uint64_t trace_mask = (uint64_t)-1;
+
+void trace_init()
+{
+	for (uint32_t i = 0; i < cpu_count(); ++i)
+	{
+		if (trace_rings[i].records == NULL)
+		{
+			trace_rings[i].head = 0;
+			trace_rings[i].records = (TraceRecord*) phys_alloc_2MIB_safe("trace ring");
+		}
+	}
+}
+
+void trace_enable(TraceEvent event, bool enable)
+{
+	ASSERT(event < TRACE_NUM_EVENTS);
+
+	if (enable)
+	{
+		__atomic_or_fetch(&trace_mask, 1ULL << event, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		__atomic_and_fetch(&trace_mask, ~(1ULL << event), __ATOMIC_RELAXED);
+	}
+}
+
+/* Position of the oldest record of a ring that is still kept.
+ */
+static
+uint64_t ring_oldest(const TraceRing* ring)
+{
+	return ring->head > TRACE_RING_RECORDS ? ring->head - TRACE_RING_RECORDS : 0;
+}
+
+void trace_dump(uint32_t max_records)
+{
+	// Stop recording so the dump itself does not show up
+	const uint64_t saved_mask = trace_mask;
+	trace_mask = 0;
+
+	// Walk all rings in TSC order, skipping the oldest records until at
+	// most max_records are left
+	uint64_t cursor[MAX_CPUS];
+	uint64_t total = 0;
+	for (uint32_t cpu = 0; cpu < MAX_CPUS; ++cpu)
+	{
+		cursor[cpu] = ring_oldest(&trace_rings[cpu]);
+		total += trace_rings[cpu].head - cursor[cpu];
+	}
+
+	bool first = true;
+	uint64_t first_tsc = 0;
+	for (;;)
+	{
+		uint32_t oldest_cpu = MAX_CPUS;
+		uint64_t oldest_tsc = (uint64_t)-1;
+		for (uint32_t cpu = 0; cpu < MAX_CPUS; ++cpu)
+		{
+			const TraceRing* ring = &trace_rings[cpu];
+			if (ring->records == NULL || cursor[cpu] == ring->head)
+			{
+				continue;
+			}
+
+			const TraceRecord* record = &ring->records[cursor[cpu] & TRACE_RING_MASK];
+			if (record->tsc <= oldest_tsc)
+			{
+				oldest_tsc = record->tsc;
+				oldest_cpu = cpu;
+			}
+		}
+
+		if (oldest_cpu == MAX_CPUS)
+		{
+			break;
+		}
+
+		const TraceRecord* record =
+			&trace_rings[oldest_cpu].records[cursor[oldest_cpu] & TRACE_RING_MASK];
+		++cursor[oldest_cpu];
+
+		if (total > max_records)
+		{
+			--total;
+			continue;
+		}
+
+		if (first)
+		{
+			first_tsc = record->tsc;
+			first = false;
+			kprintf("trace: %d records, TSC 0x%x\n", total, first_tsc);
+		}
+
+		kprintf("trace: cpu %d +%d ", oldest_cpu, record->tsc - first_tsc);
+		if (record->event < TRACE_NUM_EVENTS)
+		{
+			kprintf("%s: ", event_names[record->event]);
+			kprintf(event_formats[record->event], record->args[0],
+					record->args[1], record->args[2], record->args[3]);
+		}
+		else
+		{
+			kprintf("bad event %d", record->event);
+		}
+		kprintf("\n");
+	}
+
+	trace_mask = saved_mask;
+}
+#endif
@@ -0,0 +1,118 @@
+#ifndef __X86_64_TRACE_TRACE_H__
+#define __X86_64_TRACE_TRACE_H__
+
+#include "inttypes.h"
+#include "trace/events.h"
+
+/* Binary event tracing. Only built into kernels compiled with TRACE_KERNEL.
+ *
+ * TRACE(NAME, args...) stores the event id, the TSC and up to four
+ * 64-bit arguments in a ring buffer belonging to the current CPU. No
+ * formatting and no locking happens at the tracepoint, the records are
+ * decoded by trace_dump(). Once a ring is full the oldest records are
+ * overwritten.
+ *
+ * Without TRACE_KERNEL a tracepoint compiles to nothing and its arguments are
+ * not evaluated.
+ *
+ *   TRACE(PHYS_FREE_2MIB, address, node);
+ */
+
+#define TRACE_ID(NAME, FORMAT) TRACE_##NAME,
+typedef enum
+{
+	TRACE_EVENTS(TRACE_ID)
+	TRACE_NUM_EVENTS
+} TraceEvent;
+#undef TRACE_ID
+
+// Events are enabled by a bit in a 64-bit mask
+#define TRACE_MAX_EVENTS 64
+
+#ifdef TRACE_KERNEL
+
+#include "cpu.h"
+#include "support.h"
+
+// Records per CPU, a power of two
+#define TRACE_RING_SHIFT 15
+#define TRACE_RING_RECORDS (1 << TRACE_RING_SHIFT)
+#define TRACE_RING_MASK (TRACE_RING_RECORDS - 1)
+
+typedef struct
+{
+	uint64_t tsc;
+	uint64_t event;
+	uint64_t args[4];
+} TraceRecord;
+
+typedef struct
+{
+	uint64_t head; // Records ever written, the next slot is head & mask
+	TraceRecord* records;
+	uint8_t reserved[48];
+} __attribute__((aligned(64))) TraceRing;
+
+extern TraceRing trace_rings[MAX_CPUS];
+extern volatile uint64_t trace_mask;
+
+static inline __attribute__((always_inline))
+void trace_record(uint32_t event, uint64_t a0, uint64_t a1, uint64_t a2, uint64_t a3)
+{
+	if ((trace_mask & (1ULL << event)) == 0)
+	{
+		return;
+	}
+
+	TraceRing* ring = &trace_rings[cpu_index()];
+	if (ring->records == NULL)
+	{
+		return;
+	}
+
+	// Only this CPU writes its ring. A single unlocked XADD claims the
+	// slot atomically with respect to interrupt handlers tracing too.
+	uint64_t slot = 1;
+	__asm__ volatile("xaddq %0, %1" : "+r"(slot), "+m"(ring->head));
+
+	TraceRecord* record = &ring->records[slot & TRACE_RING_MASK];
+	record->tsc = _rdtsc();
+	record->event = event;
+	record->args[0] = a0;
+	record->args[1] = a1;
+	record->args[2] = a2;
+	record->args[3] = a3;
+}
+
+#define TRACE_ARGS_(NAME, A0, A1, A2, A3, ...) \
+	trace_record(TRACE_##NAME, (uint64_t)(A0), (uint64_t)(A1), \
+			(uint64_t)(A2), (uint64_t)(A3))
+
+#define TRACE(...) TRACE_ARGS_(__VA_ARGS__, 0, 0, 0, 0, 0)
+
+/* Give every CPU counted by cpu_count() a ring buffer. CPUs that
+ * already have one keep it, so this may be called again once more
+ * CPUs are up.
+ */
+void trace_init(void);
+
+/* Turn recording of one event on or off. All events start on.
+ */
+void trace_enable(TraceEvent event, bool enable);
+
+/* Decode the newest records of all CPUs, oldest first, merged by TSC.
+ * Tracepoints that fire meanwhile may overwrite what is printed, this
+ * is meant for after the fact.
+ *
+ * Params:
+ *   max_records - Print at most this many records
+ */
+void trace_dump(uint32_t max_records);
+
+#else
+
+#define TRACE(...) ((void)0)
+
+#endif
+
+#endif